@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Group commit benchmark: ingests many small objects in short transactions,
+ * first with an fsync per packfile commit and then in group commit mode with
+ * one sync per batch of transactions, and verifies the objects afterwards.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <ori/index.h>
+#include <ori/packfile.h>
+#include <ori/metadatalog.h>
+
+using namespace std;
+
+#define TEST_OBJECTS 16384
+#define TEST_TXOBJS 32
+// Transactions per durability point in group commit mode
+#define TEST_GROUP 64
+
+string
+randomPayload(unsigned int *seed)
+{
+    size_t len = 256 + rand_r(seed) % 4096;
+    string payload(len, '\0');
+
+    for (size_t i = 0; i < len; i++)
+        payload[i] = rand_r(seed) % 256;
+
+    return payload;
+}
+
+int
+verify(const string &dir, const vector<ObjectHash> &hashes)
+{
+    Index idx;
+    MetadataLog md;
+    Packfile pf(dir + "/pack0.pak", 0);
+    int errors = 0;
+
+    idx.open(dir + "/index");
+    md.open(dir + "/metadata");
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (!idx.hasObject(hashes[i]) || md.getRefCount(hashes[i]) != 1) {
+            errors++;
+            continue;
+        }
+
+        bytestream::ap bs(pf.getPayload(idx.getEntry(hashes[i])));
+        if (OriCrypt_HashString(bs->readAll()) != hashes[i])
+            errors++;
+    }
+    idx.close();
+
+    return errors;
+}
+
+int
+run(bool groupCommit, const vector<string> &payloads,
+    const vector<ObjectHash> &hashes)
+{
+    char tmpl[] = "/tmp/groupcommit_test.XXXXXX";
+    int errors;
+
+    if (mkdtemp(tmpl) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    string dir = tmpl;
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+
+    {
+        Index idx;
+        MetadataLog md;
+        Packfile pf(dir + "/pack0.pak", 0);
+
+        idx.open(dir + "/index");
+        md.open(dir + "/metadata");
+        if (groupCommit) {
+            pf.setGroupCommit(true);
+            idx.setGroupCommit(true);
+            md.setGroupCommit(true);
+        }
+
+        for (int i = 0; i < TEST_OBJECTS / TEST_TXOBJS; i++) {
+            PfTransaction::sp tr = pf.begin(&idx);
+            MdTransaction::sp mtr = md.begin();
+
+            for (int j = 0; j < TEST_TXOBJS; j++) {
+                size_t ix = i * TEST_TXOBJS + j;
+                ObjectInfo info(hashes[ix]);
+
+                info.type = ObjectInfo::Blob;
+                info.payload_size = payloads[ix].size();
+                tr->addPayload(info, payloads[ix]);
+                mtr->addRef(info.hash);
+            }
+            tr->commit();
+            mtr.reset();
+
+            if (groupCommit && (i + 1) % TEST_GROUP == 0) {
+                pf.sync();
+                idx.sync();
+                md.sync();
+            }
+        }
+
+        // Final durability point
+        pf.sync();
+        idx.sync();
+        md.sync();
+        idx.close();
+    }
+
+    gettimeofday(&end, 0);
+
+    float tDiff = end.tv_sec - start.tv_sec;
+    tDiff += (float)(end.tv_usec - start.tv_usec) / 1000000.0;
+
+    errors = verify(dir, hashes);
+
+    printf("%-14s Objects %d, Errors %d, Time %3.3f, Speed %.0f objs/s\n",
+           groupCommit ? "Group commit" : "Commit fsync",
+           TEST_OBJECTS, errors, tDiff, TEST_OBJECTS / tDiff);
+
+    unlink((dir + "/index").c_str());
+    unlink((dir + "/index" INDEX_SORTED).c_str());
+    unlink((dir + "/metadata").c_str());
+    unlink((dir + "/pack0.pak").c_str());
+    rmdir(dir.c_str());
+
+    return errors;
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int seed = 42;
+    vector<string> payloads;
+    vector<ObjectHash> hashes;
+    int errors = 0;
+
+    // Generate and hash the objects up front, only the stores are timed
+    for (int i = 0; i < TEST_OBJECTS; i++) {
+        payloads.push_back(randomPayload(&seed));
+        hashes.push_back(OriCrypt_HashString(payloads.back()));
+    }
+
+    errors += run(false, payloads, hashes);
+    errors += run(true, payloads, hashes);
+
+    return errors == 0 ? 0 : 1;
+}
@@ -35,6 +35,8 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <stdexcept>
+#include <future>
 
 #include <oriutil/debug.h>
 #include <oriutil/orinet.h>
@@ -42,6 +44,8 @@
 #include <ori/httpclient.h>
 #include <ori/httprepo.h>
 
+#include "tuneables.h"
+
 #define D_READ 0
 #define D_WRITE 1
 
@@ -51,6 +55,7 @@ using namespace std;
  * HttpClient
  */
 HttpClient::HttpClient(const std::string &remotePath)
+    : numConns(0)
 {
     string tmp;
     size_t portPos, pathPos;
@@ -80,50 +85,44 @@ HttpClient::HttpClient(const std::string &remotePath)
 
 HttpClient::~HttpClient()
 {
-    // Close
+    disconnect();
 }
 
+/*
+ * A keep-alive connection.  Each has its own event loop that runs only in
+ * the thread using the connection, so threads never share libevent state.
+ */
+struct HttpClientConn
+{
+    struct event_base *base;
+    struct evhttp_connection *con;
+};
+
 int
 HttpClient::connect()
 {
-    string id;
-    string version;
-    string headRev;
-    uint16_t port;
-
-    base = event_base_new();
-    dnsBase = evdns_base_new(base, /* Add DNS servers */ 0);
-    if (dnsBase == NULL) {
-        WARNING("HTTP client couldn't set up evdns!");
-        return -1;
-    }
-
-    port = strtoul(remotePort.c_str(), NULL, 10);
-
     // Can't get evdns to work, using Util_ResolveHost
-    std::string remoteIP = OriNet_ResolveHost(remoteHost);
-    con = evhttp_connection_base_new(base, dnsBase, remoteIP.c_str(), port);
-    if (con == NULL) {
-        WARNING("HTTP client couldn't set up connection!");
+    remoteIP = OriNet_ResolveHost(remoteHost);
+
+    HttpClientConn *conn = getConn();
+    if (conn == NULL) {
         return -1;
     }
+    putConn(conn);
 
     return 0;
 }
 
-
 void
 HttpClient::disconnect()
 {
-    if (con)
-        evhttp_connection_free(con);
-    if (dnsBase)
-        evdns_base_free(dnsBase, 0);
-    if (base)
-        event_base_free(base);
-    con = NULL;
-    dnsBase = NULL;
-    base = NULL;
+    unique_lock<mutex> l(connLock);
+
+    for (size_t i = 0; i < conns.size(); i++) {
+        freeConn(conns[i]);
+    }
+    numConns -= conns.size();
+    conns.clear();
 }
 
 bool
@@ -132,10 +131,83 @@ HttpClient::connected()
     return false;
 }
 
+/*
+ * Takes an idle connection, opens a new one if all are in use and fewer
+ * than HTTPCLIENT_MAXCONNS are open, or waits for one to be returned.
+ * @returns NULL if a connection could not be opened.
+ */
+HttpClientConn *
+HttpClient::getConn()
+{
+    unique_lock<mutex> l(connLock);
+
+    while (conns.empty() && numConns >= HTTPCLIENT_MAXCONNS) {
+        connFree.wait(l);
+    }
+    if (!conns.empty()) {
+        HttpClientConn *conn = conns.back();
+        conns.pop_back();
+        return conn;
+    }
+    numConns++;
+    l.unlock();
+
+    HttpClientConn *conn = new HttpClientConn();
+    uint16_t port = strtoul(remotePort.c_str(), NULL, 10);
+
+    conn->base = event_base_new();
+    conn->con = NULL;
+    if (conn->base != NULL) {
+        conn->con = evhttp_connection_base_new(conn->base, NULL,
+                                               remoteIP.c_str(), port);
+    }
+    if (conn->con == NULL) {
+        WARNING("HTTP client couldn't set up connection!");
+        dropConn(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+void
+HttpClient::putConn(HttpClientConn *conn)
+{
+    unique_lock<mutex> l(connLock);
+
+    conns.push_back(conn);
+    connFree.notify_one();
+}
+
+/*
+ * Closes a connection that can't be reused and lets another be opened in
+ * its place.
+ */
+void
+HttpClient::dropConn(HttpClientConn *conn)
+{
+    freeConn(conn);
+
+    unique_lock<mutex> l(connLock);
+    numConns--;
+    connFree.notify_one();
+}
+
+void
+HttpClient::freeConn(HttpClientConn *conn)
+{
+    if (conn->con)
+        evhttp_connection_free(conn->con);
+    if (conn->base)
+        event_base_free(conn->base);
+    delete conn;
+}
+
 struct RequestCB
 {
-    HttpClient *client;
+    HttpClientConn *conn;
     string *response;
+    int status;
 };
 
 void
@@ -143,20 +215,20 @@ HttpClient_requestDoneCB(struct evhttp_request *req, void *r)
 {
     int status;
     RequestCB *cb = (RequestCB *)r;
-    HttpClient *client = cb->client;
+    HttpClientConn *conn = cb->conn;
     //struct evkeyvalq *headers;
     struct evbuffer *bufIn;
 
     if (!req) {
         WARNING("req is NULL!");
-        event_base_loopexit(client->base, NULL);
+        event_base_loopexit(conn->base, NULL);
         return;
     }
 
     status = evhttp_request_get_response_code(req);
     if (status != HTTP_OK) {
         WARNING("HTTP request failed!");
-        event_base_loopexit(client->base, NULL);
+        event_base_loopexit(conn->base, NULL);
         return;
     }
 
@@ -172,39 +244,61 @@ HttpClient_requestDoneCB(struct evhttp_request *req, void *r)
     char *data = (char *)evbuffer_pullup(bufIn, len);
     if (data == NULL) {
         WARNING("Error running evbuffer_pullup");
-        event_base_loopexit(client->base, NULL);
+        event_base_loopexit(conn->base, NULL);
         return;
     }
 
     cb->response->assign(data, len);
+    cb->status = 0;
 
-    event_base_loopexit(client->base, NULL);
+    event_base_loopexit(conn->base, NULL);
 }
 
+/*
+ * Makes a request on an idle connection and waits for the response.
+ */
 int
-HttpClient::getRequest(const string &command, string &response)
+HttpClient::request(int type, const string &url, const string *payload,
+                    string &response)
 {
-    int status;
     RequestCB cb;
     struct evhttp_request *req;
 
-    cb.client = this;
+    cb.conn = getConn();
     cb.response = &response;
+    cb.status = -1;
+    if (cb.conn == NULL) {
+        return -1;
+    }
+
     req = evhttp_request_new(HttpClient_requestDoneCB, (void *)&cb);
 
     struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
     evhttp_add_header(headers, "Connection", "keep-alive");
 
-    status = evhttp_make_request(con, req, EVHTTP_REQ_GET, command.c_str());
+    if (payload != NULL) {
+        struct evbuffer *outbuf = evhttp_request_get_output_buffer(req);
+        evbuffer_add(outbuf, payload->data(), payload->size());
+    }
+
+    int status = evhttp_make_request(cb.conn->con, req,
+                                     (enum evhttp_cmd_type)type, url.c_str());
     if (status < 0) {
         WARNING("HTTP request failure!");
+        putConn(cb.conn);
         return -1;
     }
 
-    // XXX: Create dedicated event loop
-    event_base_dispatch(base);
+    event_base_dispatch(cb.conn->base);
+    putConn(cb.conn);
 
-    return 0;
+    return cb.status;
+}
+
+int
+HttpClient::getRequest(const string &command, string &response)
+{
+    return request(EVHTTP_REQ_GET, command, NULL, response);
 }
 
 int
@@ -212,12 +306,213 @@ HttpClient::postRequest(const string &url,
                         const string &payload,
                         string &response)
 {
-    RequestCB cb;
-    cb.client = this;
-    cb.response = &response;
+    return request(EVHTTP_REQ_POST, url, &payload, response);
+}
+
+/*
+ * The request is made from a new thread, so as many requests as there are
+ * connections are in flight at once.
+ */
+std::future<HttpResponse>
+HttpClient::getRequestAsync(const string &url)
+{
+    return std::async(std::launch::async, [this, url]() {
+        HttpResponse r;
+        r.status = request(EVHTTP_REQ_GET, url, NULL, r.body);
+        return r;
+    });
+}
+
+std::future<HttpResponse>
+HttpClient::postRequestAsync(const string &url, const string &payload)
+{
+    return std::async(std::launch::async, [this, url, payload]() {
+        HttpResponse r;
+        r.status = request(EVHTTP_REQ_POST, url, &payload, r.body);
+        return r;
+    });
+}
+
+/*
+ * Response body read as it arrives.  Reading runs the event loop only when
+ * everything received so far has been consumed, so the body is never
+ * buffered in full and the socket applies back pressure to the server.
+ */
+class HttpResponseStream : public bytestream
+{
+public:
+    HttpResponseStream(HttpClient *client, HttpClientConn *conn);
+    ~HttpResponseStream();
+    bool ended();
+    size_t read(uint8_t *buf, size_t n);
+    size_t sizeHint() const;
+    /// Waits for the response to start, @returns false if it failed
+    bool start();
+
+    struct evbuffer *body;
+    bool started;
+    bool done;
+    bool failed;
+private:
+    bool runLoop();
+    HttpClient *client;
+    HttpClientConn *conn;
+};
+
+void
+HttpClient_streamChunkCB(struct evhttp_request *req, void *arg)
+{
+    HttpResponseStream *s = (HttpResponseStream *)arg;
+
+    s->started = true;
+    if (evhttp_request_get_response_code(req) != HTTP_OK) {
+        s->failed = true;
+        return;
+    }
+    evbuffer_add_buffer(s->body, evhttp_request_get_input_buffer(req));
+}
+
+void
+HttpClient_streamDoneCB(struct evhttp_request *req, void *arg)
+{
+    HttpResponseStream *s = (HttpResponseStream *)arg;
+
+    s->done = true;
+    if (!req) {
+        WARNING("req is NULL!");
+        s->failed = true;
+        return;
+    }
+    if (evhttp_request_get_response_code(req) != HTTP_OK) {
+        WARNING("HTTP request failed!");
+        s->failed = true;
+        return;
+    }
+    evbuffer_add_buffer(s->body, evhttp_request_get_input_buffer(req));
+}
+
+HttpResponseStream::HttpResponseStream(HttpClient *client,
+                                       HttpClientConn *conn)
+    : body(evbuffer_new()), started(false), done(false), failed(false),
+      client(client), conn(conn)
+{
+    if (body == NULL) {
+        client->putConn(conn);
+        throw std::runtime_error("evbuffer_new failed");
+    }
+}
+
+void
+HttpClient_streamTimeoutCB(evutil_socket_t fd, short what, void *arg)
+{
+    *(bool *)arg = true;
+}
+
+HttpResponseStream::~HttpResponseStream()
+{
+    /*
+     * Readers stop at the end of the data they expect, the end of the
+     * response usually arrives after that.  If nothing is left unread wait
+     * a little for it, so the connection can be reused.
+     */
+    if (!done && !failed && evbuffer_get_length(body) == 0) {
+        struct timeval tv;
+        bool timedOut = false;
+        struct event *timer = evtimer_new(conn->base,
+                                          HttpClient_streamTimeoutCB,
+                                          &timedOut);
+
+        tv.tv_sec = HTTPCLIENT_ENDTIMEOUT / 1000;
+        tv.tv_usec = (HTTPCLIENT_ENDTIMEOUT % 1000) * 1000;
+        if (timer != NULL && evtimer_add(timer, &tv) == 0) {
+            while (!done && !timedOut && evbuffer_get_length(body) == 0) {
+                if (!runLoop())
+                    break;
+            }
+        }
+        if (timer != NULL)
+            event_free(timer);
+    }
+    evbuffer_free(body);
+
+    // Closing the connection is cheaper than receiving the rest of the body
+    if (done)
+        client->putConn(conn);
+    else
+        client->dropConn(conn);
+}
+
+bool
+HttpResponseStream::ended()
+{
+    return evbuffer_get_length(body) == 0 && done;
+}
+
+size_t
+HttpResponseStream::read(uint8_t *buf, size_t n)
+{
+    while (evbuffer_get_length(body) == 0 && !done) {
+        if (!runLoop())
+            break;
+    }
+    if (evbuffer_get_length(body) == 0) {
+        if (failed)
+            WARNING("HTTP response truncated");
+        return 0;
+    }
+
+    int status = evbuffer_remove(body, buf, n);
+    if (status < 0) return 0;
+    return status;
+}
+
+size_t
+HttpResponseStream::sizeHint() const
+{
+    return 0;
+}
+
+bool
+HttpResponseStream::start()
+{
+    while (!started && !done) {
+        if (!runLoop())
+            break;
+    }
+
+    return !failed;
+}
+
+/*
+ * Runs the event loop until something happens.  @returns false if nothing
+ * is left to wait for.
+ */
+bool
+HttpResponseStream::runLoop()
+{
+    if (event_base_loop(conn->base, EVLOOP_ONCE) != 0) {
+        WARNING("HTTP client event loop failed!");
+        failed = true;
+        done = true;
+        return false;
+    }
+
+    return true;
+}
+
+bytestream *
+HttpClient::postRequestStream(const string &url, const string &payload)
+{
+    HttpClientConn *conn = getConn();
+    if (conn == NULL)
+        return NULL;
+
+    bytestream::ap s(new HttpResponseStream(this, conn));
+    HttpResponseStream *rs = (HttpResponseStream *)s.get();
 
     struct evhttp_request *req = evhttp_request_new(
-            HttpClient_requestDoneCB, &cb);
+            HttpClient_streamDoneCB, rs);
+    evhttp_request_set_chunked_cb(req, HttpClient_streamChunkCB);
 
     struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
     evhttp_add_header(headers, "Connection", "keep-alive");
@@ -225,16 +520,18 @@ HttpClient::postRequest(const string &url,
     struct evbuffer *outbuf = evhttp_request_get_output_buffer(req);
     evbuffer_add(outbuf, payload.data(), payload.size());
 
-    int status = evhttp_make_request(con, req, EVHTTP_REQ_POST, url.c_str());
+    int status = evhttp_make_request(conn->con, req, EVHTTP_REQ_POST,
+                                     url.c_str());
     if (status < 0) {
         WARNING("HTTP request failure!");
-        return -1;
+        rs->done = true;
+        return NULL;
     }
 
-    // XXX: Create dedicated event loop
-    event_base_dispatch(base);
+    if (!rs->start())
+        return NULL;
 
-    return 0;
+    return s.release();
 }
 
 int
@@ -254,7 +551,7 @@ cmd_httpclient(int argc, char * const argv[])
         exit(1);
     }
 
-    HttpClient client = HttpClient(std::string(argv[1]));
+    HttpClient client(argv[1]);
     if (client.connect() < 0) {
         printf("Error connecting to %s\n", argv[1]);
         exit(1);
@@ -25,7 +25,11 @@
 #define ORIHTTP_PATH_COMMITS    "/commits"
 #define ORIHTTP_PATH_CONTAINS   "/contains"
 #define ORIHTTP_PATH_GETOBJS    "/getobjs"
+#define ORIHTTP_PATH_GETMISSING "/getmissing"
 #define ORIHTTP_PATH_OBJINFO    "/objinfo/"
 
+// Bytes of a streamed reply read and sent at a time
+#define ORIHTTP_CHUNKSIZE       (256*1024)
+
 #endif /* __HTTPDEFS_H__ */
 
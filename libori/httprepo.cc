@@ -33,12 +33,14 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/stopwatch.h>
+#include <oriutil/zipcodec.h>
 #include <ori/object.h>
 #include <ori/httpclient.h>
 #include <ori/httprepo.h>
 #include <ori/packfile.h>
 
 #include "httpdefs.h"
+#include "tuneables.h"
 
 using namespace std;
 
@@ -127,19 +129,14 @@ HttpRepo::getObject(const ObjectHash &id)
         num = bs->readUInt32();
         ASSERT(num == 0);
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        bytestream::ap zs(ZipCodec_Decode(new strstream(payload), info));
+        std::string data = zs->readAll();
+        if (zs->error()) {
+            WARNING("Cannot decode object %s: %s", info.hash.hex().c_str(),
+                    zs->error());
+            return Object::sp();
         }
-        return Object::sp(new HttpObject(this, info));
+        return Object::sp(new HttpObject(this, info, data));
     }
     return Object::sp();
 }
@@ -215,14 +212,30 @@ HttpRepo::getObjects(const ObjectHashVec &vec) {
         ss.writeHash(vec[i]);
     }
 
-    string resp;
-    int status = client->postRequest(ORIHTTP_PATH_GETOBJS, ss.str(), resp);
-    bytestream::ap bs(new strstream(resp));
+    // The objects are received while the caller reads them
+    return client->postRequestStream(ORIHTTP_PATH_GETOBJS, ss.str());
+}
 
-    if (status == 0) {
-        return bs.release();
+/*
+ * Each stream holds one of the client's connections.
+ */
+int
+HttpRepo::getObjectsStreams()
+{
+    return HTTPCLIENT_MAXCONNS;
+}
+
+bytestream *
+HttpRepo::getMissingObjects(const ObjectHashVec &haves)
+{
+    strwstream ss;
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
     }
-    return NULL;
+
+    // Servers without /getmissing fail the request
+    return client->postRequestStream(ORIHTTP_PATH_GETMISSING, ss.str());
 }
 
 std::set<ObjectInfo>
@@ -284,31 +297,13 @@ HttpRepo::listCommits()
 }
 
 
-std::string &
-HttpRepo::_payload(const ObjectHash &id)
-{
-    return payloads[id];
-}
-
-void
-HttpRepo::_addPayload(const ObjectHash &id, const std::string &payload)
-{
-    payloads[id] = payload;
-}
-
-void
-HttpRepo::_clearPayload(const ObjectHash &id)
-{
-    payloads.erase(id);
-}
-
-
 /*
  * HttpObject
  */
 
-HttpObject::HttpObject(HttpRepo *repo, ObjectInfo info)
-    : Object(info), repo(repo)
+HttpObject::HttpObject(HttpRepo *repo, ObjectInfo info,
+                       const std::string &payload)
+    : Object(info), repo(repo), payload(payload)
 {
     ASSERT(repo != NULL);
     ASSERT(!info.hash.isEmpty());
@@ -316,23 +311,22 @@ HttpObject::HttpObject(HttpRepo *repo, ObjectInfo info)
 
 HttpObject::~HttpObject()
 {
-    repo->_clearPayload(info.hash);
 }
 
 bytestream *
 HttpObject::getPayloadStream()
 {
-    return new strstream(repo->_payload(info.hash));
+    return new strstream(payload);
 }
 
 /*bytestream::ap
 HttpObject::getStoredPayloadStream()
 {
-    return bytestream::ap(new strstream(repo->_payload(info.hash)));
+    return bytestream::ap(new strstream(payload));
 }
 
 size_t
 HttpObject::getStoredPayloadSize()
 {
-    return repo->_payload(info.hash).length();
+    return payload.length();
 }*/
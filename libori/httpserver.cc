@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -40,6 +41,8 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oristr.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/thread.h>
 #include <oriutil/zeroconf.h>
 #include <ori/version.h>
 #include <ori/localrepo.h>
@@ -47,6 +50,7 @@
 
 #include "evbufstream.h"
 #include "httpdefs.h"
+#include "tuneables.h"
 
 using namespace std;
 
@@ -71,22 +75,118 @@ HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg)
     return;
 }
 
-HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port)
-    : repo(repository), port(port), httpd(NULL), base(NULL)
+/*
+ * An event loop and the connections it serves.
+ */
+struct HTTPServerLoop
 {
-    base = event_base_new();
-    event_set_log_callback(HTTPServerLogCB);
+    HTTPServer *server;
+    struct event_base *base;
+    struct evhttp *httpd;
+    struct event *check;
+    Thread *thread;
+};
+
+class HTTPServerThread : public Thread
+{
+public:
+    HTTPServerThread(HTTPServerLoop *loop)
+        : Thread("HTTPServerThread"), loop(loop)
+    {
+    }
+    virtual void run()
+    {
+        event_base_dispatch(loop->base);
+    }
+private:
+    HTTPServerLoop *loop;
+};
+
+/*
+ * Loops cannot be woken from other threads, so each checks for a stop
+ * request every HTTPD_CHECKINTERVAL.
+ */
+void
+HTTPServerCheckCB(evutil_socket_t fd, short what, void *arg)
+{
+    HTTPServerLoop *loop = (HTTPServerLoop *)arg;
+
+    if (loop->server->exiting)
+        event_base_loopbreak(loop->base);
+}
 
-    httpd = evhttp_new(base);
-    evhttp_bind_socket(httpd, "0.0.0.0", port);
+HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port, int threads)
+    : repo(repository), port(port), loops(), exiting(false)
+{
+    struct evhttp_bound_socket *sock = NULL;
+
+    event_set_log_callback(HTTPServerLogCB);
 
-    evhttp_set_gencb(httpd, HTTPServerReqHandlerCB, this);
+    if (threads <= 0)
+        threads = HTTPD_THREADS;
+
+    for (int i = 0; i < threads; i++) {
+        HTTPServerLoop *loop = new HTTPServerLoop();
+        struct timeval tv;
+
+        tv.tv_sec = HTTPD_CHECKINTERVAL / 1000;
+        tv.tv_usec = (HTTPD_CHECKINTERVAL % 1000) * 1000;
+
+        loop->server = this;
+        loop->base = event_base_new();
+        loop->httpd = evhttp_new(loop->base);
+        loop->check = event_new(loop->base, -1, EV_PERSIST,
+                                HTTPServerCheckCB, loop);
+        loop->thread = NULL;
+        event_add(loop->check, &tv);
+        evhttp_set_gencb(loop->httpd, HTTPServerReqHandlerCB, this);
+        loops.push_back(loop);
+
+        /*
+         * The first loop binds the socket, the others accept from a
+         * duplicate of it as every listener closes its socket when freed.
+         */
+        if (i == 0) {
+            sock = evhttp_bind_socket_with_handle(loop->httpd, "0.0.0.0",
+                                                  port);
+            if (sock == NULL) {
+                int err = errno;
+                WARNING("httpd: couldn't bind port %u", port);
+                freeLoops();
+                throw SystemException(err);
+            }
+        } else {
+            int fd = dup(evhttp_bound_socket_get_fd(sock));
+            if (fd < 0 || evhttp_accept_socket(loop->httpd, fd) < 0) {
+                int err = errno;
+                WARNING("httpd: couldn't accept on port %u", port);
+                if (fd >= 0)
+                    close(fd);
+                freeLoops();
+                throw SystemException(err);
+            }
+        }
+    }
 }
 
 HTTPServer::~HTTPServer()
 {
-    evhttp_free(httpd);
-    event_base_free(base);
+    freeLoops();
+}
+
+void
+HTTPServer::freeLoops()
+{
+    for (size_t i = loops.size(); i-- > 0;) {
+        HTTPServerLoop *loop = loops[i];
+
+        delete loop->thread;
+        evhttp_free(loop->httpd);
+        event_free(loop->check);
+        event_base_free(loop->base);
+        delete loop;
+    }
+    loops.clear();
 }
 
 void
@@ -98,13 +198,24 @@ HTTPServer::start(bool mDNSEnable)
         MDNS_Register(port);
 #endif
 
-    event_base_dispatch(base);
+    for (size_t i = 1; i < loops.size(); i++) {
+        loops[i]->thread = new HTTPServerThread(loops[i]);
+        loops[i]->thread->start();
+    }
+
+    event_base_dispatch(loops[0]->base);
+
+    // Stop the other loops if the first one failed
+    exiting = true;
+    for (size_t i = 1; i < loops.size(); i++) {
+        loops[i]->thread->wait();
+    }
 }
 
 void
 HTTPServer::stop()
 {
-    event_base_loopexit(base, NULL);
+    exiting = true;
 }
 
 void
@@ -122,6 +233,7 @@ HTTPServer::entry(struct evhttp_request *req)
      * /commits
      * /contains
      * /getobjs
+     * /getmissing
      * /objs/...
      * /objinfo/...
      */
@@ -145,6 +257,8 @@ HTTPServer::entry(struct evhttp_request *req)
         contains(req);
     } else if (url == ORIHTTP_PATH_GETOBJS) {
         getObjs(req);
+    } else if (url == ORIHTTP_PATH_GETMISSING) {
+        getMissing(req);
     } else if (OriStr_StartsWith(url, "/objs/")) {
         evhttp_send_error(req, HTTP_NOTFOUND, "File Not Found");
         return;
@@ -201,7 +315,7 @@ HTTPServer::stop(struct evhttp_request *req)
 
     evbuffer_add_printf(buf, "Stopping\n");
     evhttp_send_reply(req, HTTP_OK, "OK", buf);
-    event_base_loopexit(base, NULL);
+    stop();
 }
 
 void
@@ -344,6 +458,122 @@ HTTPServer::contains(struct evhttp_request *req)
     evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
 }
 
+/*
+ * An objects reply in progress.  The objects are read from the packfiles one
+ * chunk at a time, with libevent 2.1 the next chunk is read once the last
+ * one has been written to the socket.
+ */
+struct HTTPObjsReply
+{
+    struct evhttp_request *req;
+    bytestream *objs;
+};
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+static void HTTPServerObjsChunkCB(struct evhttp_connection *con, void *arg);
+#endif
+
+/*
+ * Sends the next chunk of the reply.  @returns false once the reply has
+ * ended and been freed.
+ */
+static bool
+HTTPServerSendObjs(HTTPObjsReply *r)
+{
+    struct evbuffer *buf = evbuffer_new();
+    struct evbuffer_iovec vec;
+    size_t len = 0;
+
+    if (buf != NULL &&
+        evbuffer_reserve_space(buf, ORIHTTP_CHUNKSIZE, &vec, 1) == 1) {
+        while (len < ORIHTTP_CHUNKSIZE && !r->objs->ended()) {
+            len += r->objs->read((uint8_t *)vec.iov_base + len,
+                                 ORIHTTP_CHUNKSIZE - len);
+        }
+        vec.iov_len = len;
+        evbuffer_commit_space(buf, &vec, 1);
+    }
+
+    if (len > 0 && !r->objs->error()) {
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+        evhttp_send_reply_chunk_with_cb(r->req, buf, HTTPServerObjsChunkCB, r);
+#else
+        evhttp_send_reply_chunk(r->req, buf);
+#endif
+        evbuffer_free(buf);
+        return true;
+    }
+
+    if (buf == NULL) {
+        LOG("couldn't allocate evbuffer!");
+    } else {
+        evbuffer_free(buf);
+    }
+    if (r->objs->error()) {
+        WARNING("httpd: sending objects: %s", r->objs->error());
+    }
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+    evhttp_connection_set_closecb(evhttp_request_get_connection(r->req),
+                                  NULL, NULL);
+#endif
+    evhttp_send_reply_end(r->req);
+    delete r->objs;
+    delete r;
+
+    return false;
+}
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+/*
+ * The last chunk has been written.
+ */
+static void
+HTTPServerObjsChunkCB(struct evhttp_connection *con, void *arg)
+{
+    HTTPServerSendObjs((HTTPObjsReply *)arg);
+}
+
+/*
+ * The client went away before the reply ended.
+ */
+static void
+HTTPServerObjsCloseCB(struct evhttp_connection *con, void *arg)
+{
+    HTTPObjsReply *r = (HTTPObjsReply *)arg;
+
+    // libevent detaches the unfinished request and leaves it to us
+    if (evhttp_request_get_connection(r->req) == NULL)
+        evhttp_request_free(r->req);
+    delete r->objs;
+    delete r;
+}
+#endif
+
+/*
+ * Replies with the objects read from objs.
+ */
+static void
+HTTPServerStartObjs(struct evhttp_request *req, bytestream *objs)
+{
+    HTTPObjsReply *r = new HTTPObjsReply();
+    r->req = req;
+    r->objs = objs;
+
+    evhttp_add_header(req->output_headers, "Content-Type",
+            "application/octet-stream");
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  HTTPServerObjsCloseCB, r);
+    HTTPServerSendObjs(r);
+#else
+    // libevent 2.0 cannot tell us when a chunk has been written
+    while (HTTPServerSendObjs(r)) {
+    }
+#endif
+}
+
 void
 HTTPServer::getObjs(struct evhttp_request *req)
 {
@@ -366,12 +596,28 @@ HTTPServer::getObjs(struct evhttp_request *req)
 
 
     // Transmit
-    evbufwstream out;
-    repo.transmit(&out, objs);
+    HTTPServerStartObjs(req, repo.transmitStream(objs));
+}
 
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
+void
+HTTPServer::getMissing(struct evhttp_request *req)
+{
+    // Get the commits the client has
+    evbuffer *buf = evhttp_request_get_input_buffer(req);
+    evbufstream in(buf);
+
+    uint32_t numHaves = in.readUInt32();
+    ObjectHashVec haves;
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+
+    DLOG("httpd: getMissing %d commits known", numHaves);
+
+    // Transmit
+    HTTPServerStartObjs(req, repo.getMissingObjects(haves));
 }
 
 void
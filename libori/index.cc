@@ -21,13 +21,19 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 #include <string>
 #include <set>
+#include <map>
 #include <iostream>
 #include <unordered_map>
 
+#include "tuneables.h"
+
 #include <oriutil/debug.h>
 #include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
@@ -40,10 +46,100 @@ using namespace std;
 
 /// Adds a checksum
 #define TOTAL_ENTRYSIZE (IndexEntry::SIZE + 16)
+/// Magic, version, number of entries and the fanout table
+#define SORTED_HDRSIZE (4 + 4 + 4 + 256 * 4)
+/// Truncated SHA-256 of the entire sorted index
+#define SORTED_CHECKSUMSIZE 16
+/// Offset of the object hash within an encoded entry
+#define ENTRY_HASHOFF ORI_OBJECT_TYPESIZE
+
+static int
+_entryCmp(const uint8_t *e1, const uint8_t *e2)
+{
+    return memcmp(e1 + ENTRY_HASHOFF, e2 + ENTRY_HASHOFF, ObjectHash::SIZE);
+}
+
+static bool
+_isPurged(const uint8_t *e)
+{
+    return memcmp(e, ObjectInfo::getStrForType(ObjectInfo::Purged),
+                  ORI_OBJECT_TYPESIZE) == 0;
+}
+
+/*
+ * Walks the sorted index and the (sorted) index log in hash order.  Entries
+ * in the log replace entries with the same hash in the sorted index.
+ */
+class IndexMerger
+{
+public:
+    IndexMerger(const uint8_t *sorted, size_t sortedCount,
+                const string &log)
+        : sorted(sorted), sortedCount(sortedCount), sortedIx(0),
+          log((const uint8_t *)log.data()),
+          logCount(log.size() / IndexEntry::SIZE), logIx(0)
+    {
+    }
+    const uint8_t *next()
+    {
+        const uint8_t *s = sortedIx < sortedCount ?
+            sorted + sortedIx * IndexEntry::SIZE : NULL;
+        const uint8_t *l = logIx < logCount ?
+            log + logIx * IndexEntry::SIZE : NULL;
+
+        if (s == NULL && l == NULL)
+            return NULL;
+        if (l == NULL) {
+            sortedIx++;
+            return s;
+        }
+        if (s != NULL) {
+            int cmp = _entryCmp(s, l);
+            if (cmp < 0) {
+                sortedIx++;
+                return s;
+            }
+            if (cmp == 0)
+                sortedIx++;
+        }
+        logIx++;
+        return l;
+    }
+private:
+    const uint8_t *sorted;
+    size_t sortedCount;
+    size_t sortedIx;
+    const uint8_t *log;
+    size_t logCount;
+    size_t logIx;
+};
+
+/*
+ * Writes buf to fd, adding it to the checksum in state unless state is NULL.
+ */
+static void
+_writeSorted(int fd, const string &buf, SHA256_CTX *state)
+{
+    size_t off = 0;
+
+    if (state != NULL)
+        SHA256_Update(state, buf.data(), buf.size());
+    while (off < buf.size()) {
+        ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        off += n;
+    }
+}
 
 Index::Index()
+    : fd(-1), groupCommit(false), sortedMap(NULL), sortedLen(0),
+      sortedCount(0), sortedEntries(NULL)
 {
-    fd = -1;
+    memset(fanout, 0, sizeof(fanout));
 }
 
 Index::~Index()
@@ -54,17 +150,21 @@ Index::~Index()
 void
 Index::open(const string &indexFile)
 {
-    int i, entries;
+    size_t i, entries;
     struct stat sb;
 
     fileName = indexFile;
 
-    // Read index
+    _openSorted(); // throws SystemException or RuntimeException
+
+    // Read index log
     fd = ::open(indexFile.c_str(), O_RDWR | O_CREAT,
               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd < 0) {
+        int errcode = errno;
+        _closeSorted();
         WARNING("Could not open the index file!");
-        throw SystemException();
+        throw SystemException(errcode);
     }
 
 
@@ -72,6 +172,7 @@ Index::open(const string &indexFile)
         int errcode = errno;
         ::close(fd);
         fd = -1;
+        _closeSorted();
         WARNING("Could not fstat the index file!");
         throw SystemException(errcode);
     }
@@ -81,36 +182,31 @@ Index::open(const string &indexFile)
         WARNING("Index seems dirty please rebuild it!");
         ::close(fd);
         fd = -1;
+        _closeSorted();
         throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
     }
 
+    std::string log(sb.st_size, '\0');
+    if (sb.st_size > 0) {
+        fdstream fs(fd, 0, sb.st_size);
+        bool success UNUSED = fs.readExact((uint8_t *)&log[0], sb.st_size);
+        ASSERT(success);
+    }
+
     entries = sb.st_size / TOTAL_ENTRYSIZE;
     for (i = 0; i < entries; i++) {
-        std::string entry_str(TOTAL_ENTRYSIZE, '\0');
-
-        int status UNUSED = read(fd, &entry_str[0], TOTAL_ENTRYSIZE);
-        ASSERT(status == TOTAL_ENTRYSIZE);
+        const uint8_t *buf = (const uint8_t *)&log[i * TOTAL_ENTRYSIZE];
+        IndexEntry entry = _decodeEntry(buf);
 
-        IndexEntry entry;
-
-        string info_str = entry_str.substr(0, ObjectInfo::SIZE);
-        entry.info.fromString(info_str);
-
-        strstream ss(entry_str, ObjectInfo::SIZE);
-        entry.offset = ss.readUInt32();
-        entry.packed_size = ss.readUInt32();
-        entry.packfile = ss.readUInt32();
-
-
-        std::vector<uint8_t> storedChecksum(16);
-        ss.read(&storedChecksum[0], 16);
         ObjectHash computedChecksum =
-            OriCrypt_HashString(entry_str.substr(0, IndexEntry::SIZE));
-        if (memcmp(&storedChecksum[0], computedChecksum.hash, 16) != 0) {
+            OriCrypt_HashBlob(buf, IndexEntry::SIZE);
+        if (memcmp(buf + IndexEntry::SIZE, computedChecksum.hash, 16) != 0) {
             // XXX: Attempt truncating last entries
             WARNING("Index has corrupt entries please rebuild it!");
             ::close(fd);
             fd = -1;
+            _closeSorted();
+            index.clear();
             throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
         }
 
@@ -126,31 +222,115 @@ Index::open(const string &indexFile)
     if (OriFile_Exists(indexFile + ".tmp")) {
         OriFile_Delete(indexFile + ".tmp");
     }
+    if (OriFile_Exists(indexFile + INDEX_SORTED + ".tmp")) {
+        OriFile_Delete(indexFile + INDEX_SORTED + ".tmp");
+    }
 }
 
 void
 Index::close()
 {
     if (fd != -1) {
+        flush();
+        if (index.size() > INDEX_LOG_MAXENTRIES) {
+            try {
+                rewrite();
+            } catch (exception &e) {
+                WARNING("Could not merge the index log: %s", e.what());
+            }
+        }
         ::fsync(fd);
         ::close(fd);
         fd = -1;
     }
+    _closeSorted();
+    index.clear();
 }
 
 void
 Index::sync()
 {
+    flush();
     ::fsync(fd);
 }
 
 void
-Index::rewrite()
+Index::setGroupCommit(bool enable)
+{
+    groupCommit = enable;
+    if (!enable)
+        flush();
+}
+
+void
+Index::flush()
+{
+    size_t off = 0;
+
+    while (off < pending.size()) {
+        ssize_t n = ::write(fd, pending.data() + off, pending.size() - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+        off += n;
+    }
+    pending.clear();
+}
+
+/*
+ * Merge the index log into a new sorted index.  The new sorted index is
+ * written to a temporary file and renamed into place before the log is
+ * truncated, so a crash at any point leaves a usable index.
+ */
+void
+Index::rewrite(bool dropPurged)
 {
     int fdNew;
-    string newIndex = fileName + ".tmp";
+    string sortedFile = fileName + INDEX_SORTED;
+    string newIndex = sortedFile + ".tmp";
+
+    // Verify the current sorted index before trusting its contents
+    if (sortedMap != NULL) {
+        ObjectHash checksum = OriCrypt_HashBlob(sortedMap,
+                sortedLen - SORTED_CHECKSUMSIZE);
+        if (memcmp(sortedMap + sortedLen - SORTED_CHECKSUMSIZE,
+                   checksum.hash, SORTED_CHECKSUMSIZE) != 0) {
+            WARNING("Sorted index has corrupt entries please rebuild it!");
+            throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+        }
+    }
+
+    // Sort the index log
+    map<ObjectHash, IndexEntry> sortedLog(index.begin(), index.end());
+    string log;
+    log.reserve(sortedLog.size() * IndexEntry::SIZE);
+    for (map<ObjectHash, IndexEntry>::iterator it = sortedLog.begin();
+            it != sortedLog.end();
+            it++)
+    {
+        log += _encodeEntry((*it).second);
+    }
 
-    fdNew = ::open(newIndex.c_str(), O_RDWR | O_CREAT,
+    // Compute the new fanout table
+    uint32_t newFanout[256];
+    uint32_t total = 0;
+    const uint8_t *e;
+
+    memset(newFanout, 0, sizeof(newFanout));
+    IndexMerger counter(sortedEntries, sortedCount, log);
+    while ((e = counter.next()) != NULL) {
+        if (dropPurged && _isPurged(e))
+            continue;
+        newFanout[e[ENTRY_HASHOFF]]++;
+        total++;
+    }
+    for (int i = 1; i < 256; i++) {
+        newFanout[i] += newFanout[i - 1];
+    }
+
+    fdNew = ::open(newIndex.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fdNew < 0) {
         perror("open");
@@ -158,19 +338,65 @@ Index::rewrite()
         return;
     };
 
-    int tmpFd = fd;
-    fd = fdNew;
-    ::close(tmpFd);
-
     // Write new index
-    for (unordered_map<ObjectHash, IndexEntry>::iterator it = index.begin();
-            it != index.end();
-            it++)
-    {
-        _writeEntry((*it).second);
+    try {
+        SHA256_CTX state;
+        strwstream hdr;
+        string buf;
+
+        SHA256_Init(&state);
+
+        hdr.write(INDEX_SORTED_MAGIC, 4);
+        hdr.writeUInt32(INDEX_SORTED_VERSION);
+        hdr.writeUInt32(total);
+        for (int i = 0; i < 256; i++) {
+            hdr.writeUInt32(newFanout[i]);
+        }
+        ASSERT(hdr.str().size() == SORTED_HDRSIZE);
+        _writeSorted(fdNew, hdr.str(), &state);
+
+        IndexMerger merger(sortedEntries, sortedCount, log);
+        buf.reserve(COPYFILE_BUFSZ + IndexEntry::SIZE);
+        while ((e = merger.next()) != NULL) {
+            if (dropPurged && _isPurged(e))
+                continue;
+            buf.append((const char *)e, IndexEntry::SIZE);
+            if (buf.size() >= COPYFILE_BUFSZ) {
+                _writeSorted(fdNew, buf, &state);
+                buf.clear();
+            }
+        }
+        _writeSorted(fdNew, buf, &state);
+
+        ObjectHash checksum;
+        SHA256_Final(checksum.hash, &state);
+        buf.assign((const char *)checksum.hash, SORTED_CHECKSUMSIZE);
+        _writeSorted(fdNew, buf, NULL);
+
+        if (::fsync(fdNew) < 0)
+            throw SystemException();
+    } catch (exception &e) {
+        ::close(fdNew);
+        OriFile_Delete(newIndex);
+        throw;
     }
+    ::close(fdNew);
+
+    OriFile_Rename(newIndex, sortedFile);
+
+    _closeSorted();
+    _openSorted();
 
-    OriFile_Rename(newIndex, fileName);
+    // The log has been merged, including any entries not yet appended
+    pending.clear();
+    if (fd != -1) {
+        if (::ftruncate(fd, 0) < 0) {
+            perror("ftruncate");
+            WARNING("Could not truncate the index log!");
+        }
+        ::fsync(fd);
+    }
+    index.clear();
 }
 
 void
@@ -179,8 +405,23 @@ Index::dump()
     unordered_map<ObjectHash, IndexEntry>::iterator it;
 
     cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
+    for (size_t i = 0; i < sortedCount; i++)
+    {
+        const uint8_t *se = sortedEntries + i * IndexEntry::SIZE;
+        if (_isPurged(se))
+            continue;
+        IndexEntry e = _decodeEntry(se);
+        if (index.find(e.info.hash) != index.end())
+            continue;
+        cout << e.info.hash.hex() << " packfile: " <<
+            e.packfile << "," <<
+            e.offset << "," <<
+            e.packed_size << endl;
+    }
     for (it = index.begin(); it != index.end(); it++)
     {
+        if ((*it).second.info.type == ObjectInfo::Purged)
+            continue;
         cout << (*it).first.hex() << " packfile: " <<
             (*it).second.packfile << "," <<
             (*it).second.offset << "," <<
@@ -195,8 +436,10 @@ Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
     ASSERT(!objId.isEmpty());
 
     _writeEntry(entry);
+    if (!groupCommit)
+        flush();
 
-    if (index.find(objId) != index.end()) {
+    if (hasObject(objId)) {
         fprintf(stderr, "WARNING: duplicate updateEntry\n");
     }
 
@@ -204,19 +447,77 @@ Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
     index[objId] = entry;
 }
 
-const IndexEntry &
+void
+Index::updateEntries(const vector<IndexEntry> &entries)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        const ObjectHash &objId = entries[i].info.hash;
+        ASSERT(!objId.isEmpty());
+
+        _writeEntry(entries[i]);
+
+        if (hasObject(objId)) {
+            fprintf(stderr, "WARNING: duplicate updateEntry\n");
+        }
+
+        index[objId] = entries[i];
+    }
+    if (!groupCommit)
+        flush();
+}
+
+void
+Index::relocateEntries(const vector<IndexEntry> &entries)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        ASSERT(hasObject(entries[i].info.hash));
+
+        _writeEntry(entries[i]);
+        index[entries[i].info.hash] = entries[i];
+    }
+    if (!groupCommit)
+        flush();
+}
+
+void
+Index::removeEntries(const vector<ObjectHash> &objIds)
+{
+    for (size_t i = 0; i < objIds.size(); i++) {
+        IndexEntry entry;
+
+        ASSERT(!objIds[i].isEmpty());
+
+        entry.info = ObjectInfo(objIds[i]);
+        entry.info.type = ObjectInfo::Purged;
+        entry.offset = 0;
+        entry.packed_size = 0;
+        entry.packfile = 0;
+
+        _writeEntry(entry);
+        index[objIds[i]] = entry;
+    }
+    if (!groupCommit)
+        flush();
+}
+
+IndexEntry
 Index::getEntry(const ObjectHash &objId) const
 {
     unordered_map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
-    if (it == index.end()) {
-        WARNING("Could not find the object!");
-        throw RuntimeException(ORIEC_INDEXNOTFOUND, "Index not found");
+    IndexEntry entry;
+
+    if (it != index.end()) {
+        if ((*it).second.info.type != ObjectInfo::Purged)
+            return (*it).second;
+    } else if (_findSorted(objId, &entry)) {
+        return entry;
     }
 
-    return (*it).second;
+    WARNING("Could not find the object!");
+    throw RuntimeException(ORIEC_INDEXNOTFOUND, "Index not found");
 }
 
-const ObjectInfo &
+ObjectInfo
 Index::getInfo(const ObjectHash &objId) const
 {
     return getEntry(objId).info;
@@ -228,8 +529,35 @@ Index::hasObject(const ObjectHash &objId) const
     unordered_map<ObjectHash, IndexEntry>::const_iterator it;
 
     it = index.find(objId);
+    if (it != index.end())
+        return (*it).second.info.type != ObjectInfo::Purged;
 
-    return it != index.end();
+    return _findSorted(objId, NULL);
+}
+
+vector<ObjectHash>
+Index::getPurged() const
+{
+    vector<ObjectHash> purged;
+    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+
+    for (size_t i = 0; i < sortedCount; i++)
+    {
+        const uint8_t *se = sortedEntries + i * IndexEntry::SIZE;
+        if (!_isPurged(se))
+            continue;
+        IndexEntry e = _decodeEntry(se);
+        if (index.find(e.info.hash) == index.end())
+            purged.push_back(e.info.hash);
+    }
+
+    for (it = index.begin(); it != index.end(); it++)
+    {
+        if ((*it).second.info.type == ObjectInfo::Purged)
+            purged.push_back((*it).first);
+    }
+
+    return purged;
 }
 
 set<ObjectInfo>
@@ -238,17 +566,150 @@ Index::getList()
     set<ObjectInfo> lst;
     unordered_map<ObjectHash, IndexEntry>::iterator it;
 
+    for (size_t i = 0; i < sortedCount; i++)
+    {
+        const uint8_t *se = sortedEntries + i * IndexEntry::SIZE;
+        if (_isPurged(se))
+            continue;
+        IndexEntry e = _decodeEntry(se);
+        if (index.find(e.info.hash) == index.end())
+            lst.insert(e.info);
+    }
+
     for (it = index.begin(); it != index.end(); it++)
     {
-        lst.insert((*it).second.info);
+        if ((*it).second.info.type != ObjectInfo::Purged)
+            lst.insert((*it).second.info);
     }
 
     return lst;
 }
 
+void
+Index::_openSorted()
+{
+    string sortedFile = fileName + INDEX_SORTED;
+    struct stat sb;
+    int sfd;
+
+    ASSERT(sortedMap == NULL);
+
+    sfd = ::open(sortedFile.c_str(), O_RDONLY);
+    if (sfd < 0) {
+        if (errno == ENOENT)
+            return;
+        WARNING("Could not open the sorted index file!");
+        throw SystemException();
+    }
+
+    if (::fstat(sfd, &sb) < 0) {
+        int errcode = errno;
+        ::close(sfd);
+        WARNING("Could not fstat the sorted index file!");
+        throw SystemException(errcode);
+    }
+
+    if (sb.st_size < SORTED_HDRSIZE + SORTED_CHECKSUMSIZE) {
+        ::close(sfd);
+        WARNING("Sorted index is truncated please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    void *m = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, sfd, 0);
+    if (m == MAP_FAILED) {
+        int errcode = errno;
+        ::close(sfd);
+        WARNING("Could not mmap the sorted index file!");
+        throw SystemException(errcode);
+    }
+    ::close(sfd);
+
+    sortedMap = (uint8_t *)m;
+    sortedLen = sb.st_size;
+    // Lookups are binary searches
+    posix_madvise(sortedMap, sortedLen, POSIX_MADV_RANDOM);
+
+    strstream ss(string((const char *)sortedMap, SORTED_HDRSIZE));
+    string magic(4, '\0');
+    ss.readExact((uint8_t *)&magic[0], 4);
+    uint32_t version = ss.readUInt32();
+    sortedCount = ss.readUInt32();
+    for (int i = 0; i < 256; i++) {
+        fanout[i] = ss.readUInt32();
+    }
+
+    if (magic != INDEX_SORTED_MAGIC) {
+        _closeSorted();
+        WARNING("Sorted index is corrupt please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+    if (version != INDEX_SORTED_VERSION) {
+        _closeSorted();
+        WARNING("Unsupported sorted index version %u!", version);
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Unsupported index version");
+    }
+    if (fanout[255] != sortedCount ||
+        sortedLen != SORTED_HDRSIZE + sortedCount * IndexEntry::SIZE +
+                     SORTED_CHECKSUMSIZE) {
+        _closeSorted();
+        WARNING("Sorted index is truncated please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    sortedEntries = sortedMap + SORTED_HDRSIZE;
+}
 
 void
-Index::_writeEntry(const IndexEntry &e)
+Index::_closeSorted()
+{
+    if (sortedMap != NULL) {
+        munmap(sortedMap, sortedLen);
+    }
+    sortedMap = NULL;
+    sortedLen = 0;
+    sortedCount = 0;
+    sortedEntries = NULL;
+    memset(fanout, 0, sizeof(fanout));
+}
+
+/*
+ * Binary search the sorted index.  The fanout table narrows the search to
+ * the entries that share the first byte of the hash.
+ */
+bool
+Index::_findSorted(const ObjectHash &objId, IndexEntry *entry) const
+{
+    if (sortedCount == 0)
+        return false;
+
+    uint8_t first = objId.hash[0];
+    size_t lo = (first == 0) ? 0 : fanout[first - 1];
+    size_t hi = fanout[first];
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = sortedEntries + mid * IndexEntry::SIZE;
+        int cmp = memcmp(objId.hash, e + ENTRY_HASHOFF, ObjectHash::SIZE);
+
+        if (cmp == 0) {
+            if (_isPurged(e))
+                return false;
+            if (entry != NULL)
+                *entry = _decodeEntry(e);
+            return true;
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return false;
+}
+
+string
+Index::_encodeEntry(const IndexEntry &e)
 {
     strwstream ss;
 
@@ -259,11 +720,34 @@ Index::_writeEntry(const IndexEntry &e)
     ss.writeUInt32(e.packed_size);
     ss.writeUInt32(e.packfile);
 
-    ObjectHash checksum = OriCrypt_HashString(ss.str());
-    ss.write(checksum.hash, 16);
+    ASSERT(ss.str().size() == IndexEntry::SIZE);
+    return ss.str();
+}
 
-    const string &final = ss.str();
-    ASSERT(final.size() == TOTAL_ENTRYSIZE);
-    write(fd, final.data(), final.size());
+IndexEntry
+Index::_decodeEntry(const uint8_t *buf)
+{
+    IndexEntry entry;
+    string entry_str((const char *)buf, IndexEntry::SIZE);
+
+    entry.info.fromString(entry_str.substr(0, ObjectInfo::SIZE));
+
+    strstream ss(entry_str, ObjectInfo::SIZE);
+    entry.offset = ss.readUInt32();
+    entry.packed_size = ss.readUInt32();
+    entry.packfile = ss.readUInt32();
+
+    return entry;
 }
 
+void
+Index::_writeEntry(const IndexEntry &e)
+{
+    string final = _encodeEntry(e);
+
+    ObjectHash checksum = OriCrypt_HashString(final);
+    final.append((const char *)checksum.hash, 16);
+
+    ASSERT(final.size() == TOTAL_ENTRYSIZE);
+    pending.append(final);
+}
@@ -27,6 +27,10 @@
 #include <errno.h>
 
 #include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
@@ -40,6 +44,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/oricrypt.h>
 #include <ori/largeblob.h>
+#include <ori/objectpipeline.h>
 
 #ifdef ORI_USE_RK
 #include "rkchunker.h"
@@ -51,6 +56,20 @@
 
 using namespace std;
 
+#ifdef ORI_USE_RK
+typedef RKChunker<4096, 2048, 8192> FileChunker;
+#endif /* ORI_USE_RK */
+
+#ifdef ORI_USE_FIXED
+//typedef FChunker<4096> FileChunker;
+typedef FChunker<32*1024> FileChunker;
+#endif /* ORI_USE_FIXED */
+
+// A tail this short is a single part for the chunker as well
+#define RECHUNK_MINTAIL 2048
+// Bytes read at a time while looking for a kept part, read past it are wasted
+#define RECHUNK_READSIZE (64 * 1024)
+
 /********************************************************************
  *
  *
@@ -90,62 +109,187 @@ LargeBlob::~LargeBlob()
 {
 }
 
+/********************************************************************
+ *
+ *
+ * LargeBlobFile
+ *
+ *
+ ********************************************************************/
+
+LargeBlobFile::LargeBlobFile()
+    : fd(-1), fileSize(0)
+{
+}
+
+LargeBlobFile::~LargeBlobFile()
+{
+    if (fd != -1)
+        ::close(fd);
+}
+
+int
+LargeBlobFile::open(const string &path)
+{
+    struct stat sb;
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &sb) < 0) {
+        int err = errno;
+
+        ::close(fd);
+        fd = -1;
+        return -err;
+    }
+    fileSize = sb.st_size;
+
+    return 0;
+}
+
+uint64_t
+LargeBlobFile::size()
+{
+    return fileSize;
+}
+
+ssize_t
+LargeBlobFile::read(uint8_t *buf, size_t len, uint64_t off)
+{
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t status = pread(fd, buf + total, len - total, off + total);
+
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (status == 0)
+            break;
+        total += status;
+    }
+
+    return total;
+}
+
 class FileChunkerCB : public ChunkerCB
 {
 public:
-    FileChunkerCB(LargeBlob *l)
+    /// @param s Add the fragments to the repository, or only hash them
+    FileChunkerCB(LargeBlob *l, ObjectPipeline *p, bool s = true)
     {
         lb = l;
-        lbOff = 0;
-        buf = NULL;
+        bufLen = 8 * 1024 * 1024;
+        buf = new uint8_t[bufLen];
+        src = NULL;
+        pipe = p;
+        store = s;
+        stops = NULL;
+        readSize = bufLen;
+        matchOff = 0;
+        stopped = false;
     }
     ~FileChunkerCB()
     {
-        if (buf)
-            delete[] buf;
-        if (srcFd > 0)
-            ::close(srcFd);
+        delete[] buf;
     }
     int open(const string &path)
     {
-        struct stat sb;
+        int status = file.open(path);
 
-        bufLen = 8 * 1024 * 1024;
-        buf = new uint8_t[bufLen];
-        if (buf == NULL)
-            return -ENOMEM;
-
-        srcFd = ::open(path.c_str(), O_RDONLY);
-        if (srcFd < 0)
-            return -errno;
+        if (status < 0)
+            return status;
 
-        if (fstat(srcFd, &sb) < 0) {
-            close(srcFd);
-            return -errno;
-        }
-        fileLen = sb.st_size;
+        setSource(&file);
+        return 0;
+    }
+    void setSource(LargeBlobSource *s)
+    {
+        src = s;
+        fileLen = src->size();
         fileOff = 0;
+    }
+    uint64_t size() const
+    {
+        return fileLen;
+    }
+    /// Chunk the bytes from start to end instead of the whole file
+    void setRange(uint64_t start, uint64_t end)
+    {
+        fileOff = start;
+        fileLen = end;
+        matchOff = start;
+        stopped = false;
+    }
+    /// Stop at the first fragment that ends at one of the offsets in s
+    void setStops(const map<uint64_t, size_t> *s)
+    {
+        stops = s;
+        readSize = RECHUNK_READSIZE;
+    }
+    /// End of the last fragment reported
+    uint64_t position() const
+    {
+        return matchOff;
+    }
+    /// Report the range as a single fragment
+    void matchRange()
+    {
+        uint64_t len = fileLen - fileOff;
 
-        return 0;
+        ASSERT(len <= bufLen);
+        readRange(buf, len);
+        match(buf, len);
+        fileOff = fileLen;
     }
     virtual void match(const uint8_t *b, uint32_t l)
     {
+        // The chunker finishes its buffer after a stop
+        if (stopped)
+            return;
+        matchOff += l;
+        if (stops != NULL && stops->find(matchOff) != stops->end())
+            stopped = true;
+
         // Add the fragment into the repository
         // XXX: Journal for cleanup!
         string blob = string((const char *)b, l);
+
+        if (pipe != NULL) {
+            // Hashed by the pipeline, the parts are filled in by finish
+            hashes.push_back(ObjectHash());
+            lengths.push_back(l);
+            pipe->add(ObjectInfo::Blob, blob, &hashes.back());
+            return;
+        }
+
         ObjectHash hash = OriCrypt_HashString(blob);
-        lb->repo->addObject(ObjectInfo::Blob, hash, blob);
+        if (store)
+            lb->repo->addObject(ObjectInfo::Blob, hash, blob);
 
         // Add the fragment to the LargeBlob object.
-        lb->parts.insert(make_pair(lbOff, LBlobEntry(hash, l)));
-        lbOff += l;
+        lb->addPart(hash, l);
+    }
+    void finish()
+    {
+        if (pipe == NULL)
+            return;
+
+        pipe->drain();
+        for (size_t i = 0; i < hashes.size(); i++) {
+            lb->addPart(hashes[i], lengths[i]);
+        }
     }
     virtual int load(uint8_t **b, uint64_t *l, uint64_t *o)
     {
         if (*b == NULL)
             *b = buf;
 
-        if (fileOff == fileLen)
+        if (fileOff == fileLen || stopped)
             return 0;
 
         // Sanity checking
@@ -161,49 +305,64 @@ public:
             *o = 32;
         }
 
-        uint64_t toRead = MIN(bufLen - *l, fileLen - fileOff);
-        int status;
+        uint64_t toRead = MIN(MIN(bufLen - *l, fileLen - fileOff), readSize);
 
-        status = read(srcFd, buf + *l, toRead);
-        if (status < 0) {
-            perror("Cannot read large file");
-            PANIC();
-            return -1;
-        }
-        ASSERT(status == (int)toRead);
+        readRange(buf + *l, toRead);
 
-        fileOff += status;
-        *l += status;
+        fileOff += toRead;
+        *l += toRead;
         //*o = 32;
 
         return 1;
     }
 private:
+    void readRange(uint8_t *b, uint64_t len)
+    {
+        ssize_t status;
+
+        status = src->read(b, len, fileOff);
+        if (status < 0) {
+            LOG("Cannot read large file: %s", strerror(-status));
+            PANIC();
+            return;
+        }
+
+        /*
+         * Only a file being written shrinks while it is chunked, the missing
+         * bytes read as zeros and the caller chunks them again.
+         */
+        ASSERT(status == (ssize_t)len || !store);
+        if (status < (ssize_t)len)
+            memset(b + status, 0, len - status);
+    }
     // Output large blob
     LargeBlob *lb;
-    uint64_t lbOff;
     // Input file
-    int srcFd;
+    LargeBlobFile file;
+    LargeBlobSource *src;
     uint64_t fileLen;
     uint64_t fileOff;
     // RK buffer
     uint8_t *buf;
     uint64_t bufLen;
+    // Fragments queued in the pipeline
+    ObjectPipeline *pipe;
+    bool store;
+    // Offsets to stop at, see LargeBlob::rechunk
+    const map<uint64_t, size_t> *stops;
+    uint64_t readSize;
+    uint64_t matchOff;
+    bool stopped;
+    deque<ObjectHash> hashes;
+    vector<uint32_t> lengths;
 };
 
 void
-LargeBlob::chunkFile(const string &path)
+LargeBlob::chunkFile(const string &path, ObjectPipeline *pipe)
 {
     int status;
-    FileChunkerCB cb = FileChunkerCB(this);
-#ifdef ORI_USE_RK
-    RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
-#endif /* ORI_USE_RK */
-
-#ifdef ORI_USE_FIXED
-    //FChunker<4096> c = FChunker<4096>();
-    FChunker<32*1024> c = FChunker<32*1024>();
-#endif /* ORI_USE_FIXED */
+    FileChunkerCB cb(this, pipe);
+    FileChunker c = FileChunker();
 
     status = cb.open(path);
     if (status < 0) {
@@ -215,13 +374,121 @@ LargeBlob::chunkFile(const string &path)
     totalHash = OriCrypt_HashFile(path);
 
     c.chunk(&cb);
+    cb.finish();
+}
+
+/*
+ * Compute the SHA 256 hash of the source.
+ */
+static ObjectHash
+hashSource(LargeBlobSource *src)
+{
+    vector<uint8_t> buf(1024 * 1024);
+    uint64_t off = 0, size = src->size();
+    SHA256_CTX state;
+    ObjectHash hash;
+
+    SHA256_Init(&state);
+    while (off < size) {
+        ssize_t status = src->read(&buf[0], MIN(buf.size(), size - off), off);
+
+        if (status < 0) {
+            LOG("Cannot read large file: %s", strerror(-status));
+            PANIC();
+        }
+        if (status == 0)
+            break;
+        SHA256_Update(&state, &buf[0], status);
+        off += status;
+    }
+    SHA256_Final(hash.hash, &state);
+
+    return hash;
+}
+
+void
+LargeBlob::rechunkFile(const string &path, const LargeBlob &base,
+                       const map<uint64_t, uint64_t> &dirty)
+{
+    LargeBlobFile file;
+    int status;
+
+    status = file.open(path);
+    if (status < 0) {
+        LOG("Cannot open large file for chunking: %s", strerror(-status));
+        PANIC();
+        return;
+    }
+
+    rechunk(&file, base, dirty);
+}
+
+/*
+ * Same as rechunkFile for a file read through src.  Chunking starts at the
+ * first changed part and goes on past the dirty ranges until the chunker
+ * cuts where a kept part starts, so the parts still end at the chunker's
+ * own cut points.
+ */
+void
+LargeBlob::rechunk(LargeBlobSource *src, const LargeBlob &base,
+                   const map<uint64_t, uint64_t> &dirty)
+{
+    FileChunkerCB cb(this, NULL, /*store*/false);
+    FileChunker c = FileChunker();
+    map<uint64_t, uint64_t>::const_iterator d = dirty.begin();
+    // Start of each part of base that is kept to its index
+    map<uint64_t, size_t> keep;
+    uint64_t size, off = 0;
+
+    ASSERT(parts.empty());
+
+    cb.setSource(src);
+    cb.setStops(&keep);
+    size = cb.size();
+
+    for (size_t i = 0; i < base.parts.size(); i++) {
+        uint64_t partStart = base.offsets[i];
+        uint64_t partEnd = partStart + base.parts[i].length;
+
+        // The short last part of a file that grew is chunked with the new
+        // bytes, appending does not leave a short part behind each time
+        if (partEnd > size || (partEnd == base.totalSize() && size > partEnd))
+            break;
+
+        while (d != dirty.end() && (*d).second <= partStart)
+            d++;
+        if (d != dirty.end() && (*d).first < partEnd)
+            continue;
+
+        keep[partStart] = i;
+    }
+
+    while (off < size) {
+        map<uint64_t, size_t>::iterator k = keep.find(off);
+
+        if (k != keep.end()) {
+            addPart(base.parts[k->second].hash, base.parts[k->second].length);
+            off += base.parts[k->second].length;
+            continue;
+        }
+
+        cb.setRange(off, size);
+        if (size - off < RECHUNK_MINTAIL) {
+            cb.matchRange();
+        } else {
+            c.chunk(&cb);
+        }
+        off = cb.position();
+    }
+
+    totalHash = hashSource(src);
 }
 
 void
 LargeBlob::extractFile(const string &path)
 {
     int fd;
-    map<uint64_t, LBlobEntry>::iterator it;
+    vector<LBlobEntry>::iterator it;
 
     fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -236,9 +503,9 @@ LargeBlob::extractFile(const string &path)
         int status;
         string tmp;
 
-        Object::sp o(repo->getObject((*it).second.hash));
+        Object::sp o(repo->getObject((*it).hash));
         tmp = o->getPayload();
-        ASSERT(tmp.length() == (*it).second.length);
+        ASSERT(tmp.length() == (*it).length);
 
         status = ::write(fd, tmp.data(), tmp.length());
         if (status < 0) {
@@ -259,50 +526,33 @@ LargeBlob::extractFile(const string &path)
 ssize_t
 LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
 {
-    map<uint64_t, LBlobEntry>::const_iterator it;
-    // XXX: Using upper/lower_bound should be faster
-
-    for (it = parts.begin(); it != parts.end(); it++) {
-        if ((*it).first <= off && ((*it).first + (*it).second.length) > off)
-            break;
-    }
+    size_t total = 0;
 
-    if (it == parts.end()) {
-        LOG("offset %" PRIu64 " larger than large blob", off);
-        return 0;
-    }
+    for (size_t i = findPart(off); i < parts.size() && total < s; i++) {
+        uint64_t partOff = off + total - offsets[i];
+        size_t toRead = MIN(s - total, parts[i].length - partOff);
 
-    off_t part_off = off - (*it).first;
-    if (part_off >= (*it).second.length) {
-        LOG("offset %" PRIu64 " larger than last blob in LB", off);
-        ASSERT(false);
-        return 0;
-    }
-    if (part_off < 0) {
-        LOG("part_off less than 0");
-        ASSERT(false);
-        return -EIO;
-    }
+        Object::sp o(repo->getObject(parts[i].hash));
+        if (!o) {
+            LOG("part %s of large blob missing", parts[i].hash.hex().c_str());
+            return -EIO;
+        }
+        ASSERT(o->getInfo().type == ObjectInfo::Blob);
+        const std::string &payload = o->getPayload();
+        if (payload.size() < partOff + toRead) {
+            LOG("part %s shorter than its entry", parts[i].hash.hex().c_str());
+            return -EIO;
+        }
 
-    int left = (*it).second.length - part_off;
-    if (left <= 0) {
-        LOG("incorrect computation of left! (%d)", left);
-        ASSERT(false);
-        return -EIO;
+        memcpy(buf + total, payload.data() + partOff, toRead);
+        total += toRead;
     }
 
-    size_t to_read = MIN((size_t)left, s);
-
-    Object::sp o(repo->getObject((*it).second.hash));
-    ASSERT(o->getInfo().type == ObjectInfo::Blob);
-    const std::string &payload = o->getPayload();
-    memcpy(buf, payload.data()+part_off, to_read);
-
-    return to_read;
+    return total;
 }
 
 const string
-LargeBlob::getBlob()
+LargeBlob::getBlob() const
 {
     strwstream ss;
     ss.writeHash(totalHash);
@@ -311,8 +561,8 @@ LargeBlob::getBlob()
     ss.writeUInt64(num);
 
     for (auto &it : parts) {
-        ss.writeHash(it.second.hash);
-        ss.writeUInt16(it.second.length);
+        ss.writeHash(it.hash);
+        ss.writeUInt16(it.length);
     }
 
     return ss.str();
@@ -326,26 +576,45 @@ LargeBlob::fromBlob(const string &blob)
 
     size_t num = ss.readUInt64();
 
-    uint64_t off = 0;
+    parts.clear();
+    offsets.clear();
+    parts.reserve(num);
+    offsets.reserve(num);
     for (size_t i = 0; i < num; i++) {
         ObjectHash hash;
         ss.readHash(hash);
         size_t length = ss.readUInt16();
 
-        parts.insert(make_pair(off, LBlobEntry(hash, length)));
-
-        off += length;
+        addPart(hash, length);
     }
 }
 
 size_t
 LargeBlob::totalSize() const
 {
-    size_t total = 0;
-    for (auto const &it : parts) {
-        total += it.second.length;
-    }
+    if (parts.empty())
+        return 0;
 
-    return total;
+    return offsets.back() + parts.back().length;
+}
+
+void
+LargeBlob::addPart(const ObjectHash &hash, uint16_t length)
+{
+    offsets.push_back(totalSize());
+    parts.push_back(LBlobEntry(hash, length));
+}
+
+size_t
+LargeBlob::findPart(uint64_t off) const
+{
+    if (off >= totalSize())
+        return parts.size();
+
+    // The last part starting at or before off
+    vector<uint64_t>::const_iterator it;
+    it = upper_bound(offsets.begin(), offsets.end(), off);
+
+    return (it - offsets.begin()) - 1;
 }
 
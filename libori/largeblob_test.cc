@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * LargeBlob random read benchmark: builds chunk tables for files from 1 MB
+ * to 4 GB, times looking up the part at random offsets against a map keyed
+ * by offset, and times and verifies random reads that span parts.  Checks
+ * that rechunking a modified file keeps the parts outside of the changes and
+ * cuts where chunking the whole file does.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <ori/localrepo.h>
+#include <ori/largeblob.h>
+#include <ori/objectpipeline.h>
+
+using namespace std;
+
+// Distinct chunk payloads, parts reuse them with varying lengths
+#define TEST_PAYLOADS 8
+#define TEST_PAYLOADSIZE 8192
+#define TEST_LOOKUPS (1024*1024)
+#define TEST_READS (64*1024)
+#define TEST_READSIZE (16*1024)
+#define TEST_FILESIZE (4*1024*1024)
+
+static double
+now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static uint64_t
+randomOffset(unsigned int *seed, uint64_t size)
+{
+    uint64_t r = ((uint64_t)rand_r(seed) << 31) | rand_r(seed);
+
+    return r % size;
+}
+
+static int
+run(LocalRepo *repo, const vector<ObjectHash> &hashes,
+    const vector<string> &payloads, uint64_t fileSize)
+{
+    unsigned int seed = 42;
+    LargeBlob lb(repo);
+    map<uint64_t, size_t> byOffset;
+    vector<uint8_t> buf(TEST_READSIZE);
+    uint64_t sum = 0;
+    int errors = 0;
+
+    // Chunks average 5 KB like the Rabin-Karp chunker's
+    while (lb.totalSize() < fileSize) {
+        size_t p = lb.parts.size() % TEST_PAYLOADS;
+        uint16_t len = 2048 + rand_r(&seed) % (TEST_PAYLOADSIZE - 2048 + 1);
+
+        byOffset[lb.totalSize()] = lb.parts.size();
+        lb.addPart(hashes[p], len);
+    }
+    fileSize = lb.totalSize();
+
+    double start = now();
+    for (int i = 0; i < TEST_LOOKUPS; i++) {
+        map<uint64_t, size_t>::iterator it;
+
+        it = byOffset.upper_bound(randomOffset(&seed, fileSize));
+        it--;
+        sum += (*it).second;
+    }
+    double tMap = now() - start;
+
+    start = now();
+    for (int i = 0; i < TEST_LOOKUPS; i++) {
+        sum += lb.findPart(randomOffset(&seed, fileSize));
+    }
+    double tArray = now() - start;
+
+    start = now();
+    for (int i = 0; i < TEST_READS; i++) {
+        uint64_t off = randomOffset(&seed, fileSize);
+        ssize_t n = lb.read(&buf[0], TEST_READSIZE, off);
+
+        if (n != (ssize_t)MIN((uint64_t)TEST_READSIZE, fileSize - off)) {
+            errors++;
+            continue;
+        }
+
+        // Check the first byte of each part covered by the read
+        for (size_t j = lb.findPart(off);
+                j < lb.parts.size() && lb.offsets[j] < off + n;
+                j++) {
+            uint64_t from = MAX(lb.offsets[j], off);
+            const string &payload = payloads[j % TEST_PAYLOADS];
+
+            if (buf[from - off] != (uint8_t)payload[from - lb.offsets[j]])
+                errors++;
+        }
+    }
+    double tRead = now() - start;
+
+    printf("Size %6" PRIu64 " MB, Parts %8zu, Map %4.0f ns, Array %4.0f ns, "
+           "Read %6.0f ns, Errors %d (%" PRIu64 ")\n",
+           fileSize / (1024*1024), lb.parts.size(),
+           tMap * 1e9 / TEST_LOOKUPS, tArray * 1e9 / TEST_LOOKUPS,
+           tRead * 1e9 / TEST_READS, errors, sum % 10);
+
+    return errors;
+}
+
+/*
+ * Rechunk the file after a change, store it and compare it with the file.
+ * @returns the number of errors
+ */
+static int
+rechunk(LocalRepo *repo, const string &path, LargeBlob *lb,
+        const map<uint64_t, uint64_t> &dirty)
+{
+    LargeBlob nb(repo);
+    ObjectPipeline pipe(repo);
+    ObjectHash hash, largeHash;
+    size_t kept = 0, changed = 0;
+    int errors = 0;
+
+    nb.rechunkFile(path, *lb, dirty);
+    repo->addChunkedFile(path, nb, &pipe, &hash, &largeHash);
+    pipe.drain();
+
+    for (size_t i = 0; i < lb->parts.size(); i++) {
+        map<uint64_t, uint64_t>::const_iterator it;
+        bool clean = true;
+
+        for (it = dirty.begin(); it != dirty.end(); it++) {
+            if ((*it).first < lb->offsets[i] + lb->parts[i].length &&
+                (*it).second > lb->offsets[i])
+                clean = false;
+        }
+        if (clean && lb->offsets[i] + lb->parts[i].length < lb->totalSize())
+            kept++;
+    }
+    for (size_t i = 0; i < nb.parts.size(); i++) {
+        size_t j = lb->findPart(nb.offsets[i]);
+
+        if (j == lb->parts.size() || lb->offsets[j] != nb.offsets[i] ||
+            lb->parts[j].hash != nb.parts[i].hash)
+            changed++;
+    }
+
+    FILE *f = fopen(path.c_str(), "r");
+    string data(nb.totalSize(), '\0');
+    string stored(nb.totalSize(), '\0');
+
+    if (fread(&data[0], 1, data.size(), f) != data.size())
+        errors++;
+    fclose(f);
+
+    LargeBlob sb(repo);
+    sb.fromBlob(repo->getPayload(hash));
+    if (sb.read((uint8_t *)&stored[0], stored.size(), 0) !=
+            (ssize_t)stored.size() || stored != data)
+        errors++;
+    if (largeHash != OriCrypt_HashFile(path) || sb.totalHash != largeHash)
+        errors++;
+    // The parts not touched by the change are all kept
+    if (nb.parts.size() - changed < kept)
+        errors++;
+
+    // Cut where chunking the whole file cuts
+    LargeBlob wb(repo);
+    wb.chunkFile(path);
+    if (wb.parts.size() != nb.parts.size())
+        errors++;
+    for (size_t i = 0; i < wb.parts.size() && i < nb.parts.size(); i++) {
+        if (wb.parts[i].hash != nb.parts[i].hash)
+            errors++;
+    }
+
+    printf("Rechunk %zu parts, %zu changed, Errors %d\n",
+           nb.parts.size(), changed, errors);
+
+    lb->parts.clear();
+    lb->offsets.clear();
+    lb->fromBlob(repo->getPayload(hash));
+
+    return errors;
+}
+
+static int
+rechunkTest(LocalRepo *repo, const string &dir)
+{
+    string path = dir + "/file";
+    unsigned int seed = 3;
+    LargeBlob lb(repo);
+    map<uint64_t, uint64_t> dirty;
+    int errors = 0;
+
+    string data(TEST_FILESIZE, '\0');
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = rand_r(&seed) % 256;
+
+    FILE *f = fopen(path.c_str(), "w");
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    lb.chunkFile(path);
+
+    // Overwrite in the middle and append
+    f = fopen(path.c_str(), "r+");
+    fseek(f, TEST_FILESIZE / 2, SEEK_SET);
+    fwrite("overwritten", 1, 11, f);
+    fseek(f, 0, SEEK_END);
+    fwrite(data.data(), 1, 10000, f);
+    fclose(f);
+    dirty[TEST_FILESIZE / 2] = TEST_FILESIZE / 2 + 11;
+    dirty[TEST_FILESIZE] = TEST_FILESIZE + 10000;
+    errors += rechunk(repo, path, &lb, dirty);
+
+    // Truncate
+    dirty.clear();
+    if (truncate(path.c_str(), TEST_FILESIZE * 3 / 4) < 0)
+        errors++;
+    dirty[TEST_FILESIZE * 3 / 4] = TEST_FILESIZE + 10000;
+    errors += rechunk(repo, path, &lb, dirty);
+
+    return errors;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char tmpl[] = "/tmp/largeblob_test.XXXXXX";
+    unsigned int seed = 7;
+    vector<ObjectHash> hashes;
+    vector<string> payloads;
+    int errors = 0;
+
+    if (mkdtemp(tmpl) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    string dir = tmpl;
+    if (LocalRepo_Init(dir, true) != 0) {
+        printf("Failed to create a repository in %s\n", tmpl);
+        return 1;
+    }
+
+    {
+        LocalRepo repo(dir);
+
+        repo.open();
+        for (int i = 0; i < TEST_PAYLOADS; i++) {
+            string payload(TEST_PAYLOADSIZE, '\0');
+
+            for (size_t j = 0; j < payload.size(); j++)
+                payload[j] = rand_r(&seed) % 256;
+            payloads.push_back(payload);
+            hashes.push_back(repo.addBlob(ObjectInfo::Blob, payload));
+        }
+        repo.sync();
+
+        errors += rechunkTest(&repo, dir);
+
+        for (uint64_t size = 1024*1024;
+                size <= 4ULL*1024*1024*1024;
+                size *= 8) {
+            errors += run(&repo, hashes, payloads, size);
+        }
+
+        repo.close();
+    }
+
+    if (system(("rm -rf " + dir).c_str()) != 0) {
+        printf("Could not remove %s\n", dir.c_str());
+        errors++;
+    }
+
+    return errors == 0 ? 0 : 1;
+}
+
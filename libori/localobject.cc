@@ -43,6 +43,7 @@
 #include "tuneables.h"
 
 #include <oriutil/debug.h>
+#include <oriutil/zipcodec.h>
 #include <ori/object.h>
 #include <ori/localobject.h>
 
@@ -52,13 +53,14 @@ using namespace std;
  * Object
  */
 LocalObject::LocalObject(PfTransaction::sp transaction, size_t ix)
-    : Object(transaction->infos[ix]), transaction(transaction), ix_tr(ix),
-      packfile()
+    : Object(transaction->infos[ix]), transaction(transaction),
+      stored(transaction->payloads[ix]), packfile(), cache(NULL)
 {
 }
 
-LocalObject::LocalObject(Packfile::sp packfile, const IndexEntry &entry)
-    : Object(entry.info), packfile(packfile), entry(entry)
+LocalObject::LocalObject(Packfile::sp packfile, const IndexEntry &entry,
+                         ObjectCache *cache)
+    : Object(entry.info), packfile(packfile), entry(entry), cache(cache)
 {
 }
 
@@ -66,26 +68,63 @@ LocalObject::~LocalObject()
 {
 }
 
-// XXX: Eliminate duplicate compression code!
 bytestream *LocalObject::getPayloadStream() {
     if (packfile.get()) {
+        if (cache != NULL) {
+            ObjectCache::Payload p = cache->get(info.hash);
+            if (p)
+                return new strstream(*p);
+        }
         return packfile->getPayload(entry);
     }
     if (transaction.get()) {
-        switch(info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                return new strstream(transaction->payloads[ix_tr]);
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                return new zipstream(new strstream(transaction->payloads[ix_tr]),
-                                     DECOMPRESS, info.payload_size);
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
+        return ZipCodec_Decode(new strstream(stored),
+                               info);
     }
     return NULL;
 }
 
+/*
+ * Read the payload through the object cache so repeated reads of the same
+ * tree or commit skip the pread and decompression.
+ */
+std::string LocalObject::getPayload() {
+    if (!packfile.get() || cache == NULL)
+        return Object::getPayload();
+
+    ObjectCache::Payload p = cache->get(info.hash);
+    if (!p) {
+        bytestream::ap bs(packfile->getPayload(entry));
+        p.reset(new std::string(bs->readAll()));
+        cache->put(info.hash, p);
+    }
+
+    return *p;
+}
+
+ssize_t LocalObject::readPayload(uint8_t *buf, size_t n, size_t off) {
+    if (off >= info.payload_size)
+        return 0;
+    n = MIN(n, info.payload_size - off);
+
+    ObjectCache::Payload p;
+    if (cache != NULL)
+        p = cache->get(info.hash);
+
+    if (!p && packfile.get() &&
+        (info.isFramed() || info.getAlgo() == ObjectInfo::ZIPALGO_NONE)) {
+        bytestream::ap bs(packfile->getPayload(entry, off));
+        if (!bs->readExact(buf, n))
+            return -1;
+        return n;
+    }
+
+    if (!p)
+        p.reset(new std::string(getPayload()));
+    memcpy(buf, p->data() + off, n);
+    return n;
+}
+
 /*
  * Static methods
  */
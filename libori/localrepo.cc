@@ -34,6 +34,11 @@
 #include <iomanip>
 #include <iostream>
 #include <functional>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+
+#include "tuneables.h"
 
 #include <ori/version.h>
 #include <oriutil/debug.h>
@@ -45,9 +50,12 @@
 #include <oriutil/oristr.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
+#include <oriutil/thread.h>
 #include <oriutil/zeroconf.h>
 #include <ori/largeblob.h>
 #include <ori/localrepo.h>
+#include <ori/objectpipeline.h>
+#include <ori/repacker.h>
 #include <ori/sshrepo.h>
 #include <ori/remoterepo.h>
 
@@ -197,6 +205,12 @@ LocalRepoLock::~LocalRepoLock()
 
 LocalRepo::LocalRepo(const string &root)
     : opened(false),
+      objCache(OBJCACHE_DEFAULTSIZE),
+      groupCommit(false),
+      purgeCount(0),
+      transmitCalls(0),
+      transmitObjects(0),
+      transmitRuns(0),
       remoteRepo(NULL)
 {
     rootPath = (root == "") ? findRootPath() : root;
@@ -272,6 +286,11 @@ LocalRepo::open(const string &root)
     }
     packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS));
 
+    const char *cacheSize = getenv("ORI_OBJCACHE");
+    if (cacheSize != NULL) {
+        objCache.setMaxSize(strtoul(cacheSize, NULL, 10) * 1024 * 1024);
+    }
+
     // Scan for peers
     string peer_path = rootPath + ORI_PATH_REMOTES;
     DirIterate(peer_path.c_str(), this, LocalRepo_PeerHelper);
@@ -302,9 +321,11 @@ LocalRepo::close()
     sync();
 
     currTransaction.reset();
+    unsyncedPacks.clear();
     index.close();
     snapshots.close();
     packfiles.reset();
+    objCache.clear();
     opened = false;
 }
 
@@ -381,6 +402,36 @@ LocalRepo::hasRemote()
     return (remoteRepo != NULL);
 }
 
+/*
+ * Reading the objects after they are received does not cost a round trip
+ * each.  The response is buffered so the caller can store it without waiting
+ * on the network.  Returns NULL unless remote objects are cached locally.
+ */
+bytestream *
+LocalRepo::fetchObjects(const ObjectHashVec &objs)
+{
+    ObjectHashVec missing;
+    // getObject stores remote objects with the lock held
+    Monitor lock(remoteLock);
+
+    if (remoteRepo == NULL || !cacheRemoteObjects)
+        return NULL;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (!isObjectStored(objs[i]))
+            missing.push_back(objs[i]);
+    }
+    if (missing.empty())
+        return NULL;
+
+    LOG("Instaclone fetching %zu objects", missing.size());
+    bytestream::ap bs(remoteRepo->getObjects(missing));
+    if (!bs.get())
+        return NULL;
+
+    return new strstream(bs->readAll());
+}
+
 /*
  * Object Operations
  */
@@ -425,6 +476,7 @@ Object::sp LocalRepo::getObject(const ObjectHash &objId)
 LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
 {
     ASSERT(opened);
+    RWKey::sp key = storeLock.readLock();
 
     if (currTransaction.get()) {
         if (currTransaction->has(objId)) {
@@ -442,7 +494,44 @@ LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
 
     const IndexEntry &ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
-    return LocalObject::sp(new LocalObject(packfile, ie));
+    return LocalObject::sp(new LocalObject(packfile, ie, &objCache));
+}
+
+ObjectCache &
+LocalRepo::getObjectCache()
+{
+    return objCache;
+}
+
+LocalRepo::TransmitStats
+LocalRepo::getTransmitStats()
+{
+    TransmitStats st;
+
+    st.calls = transmitCalls;
+    st.objects = transmitObjects;
+    st.runs = transmitRuns;
+
+    return st;
+}
+
+void
+LocalRepo::setZipPolicy(const ZipPolicy &policy)
+{
+    RWKey::sp key = storeLock.writeLock();
+
+    zipPolicy = policy;
+    // The open transaction captured the old policy
+    if (currTransaction.get()) {
+        currTransaction->commit();
+        currTransaction.reset();
+    }
+}
+
+const ZipPolicy &
+LocalRepo::getZipPolicy() const
+{
+    return zipPolicy;
 }
 
 void
@@ -490,26 +579,11 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
 {
     ASSERT(opened);
     ASSERT(!hash.isEmpty());
+    RWKey::sp key = storeLock.writeLock();
 
-    purged.erase(hash);
+    if (isStored(hash)) return 0;
 
-    if (isObjectStored(hash)) return 0;
-
-    if (!currPackfile.get()) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (!currTransaction.get()) {
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (currTransaction->full()) {
-        currTransaction->commit();
-        currTransaction.reset();
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
+    prepareTransaction();
 
     ObjectInfo info(hash);
     info.type = type;
@@ -535,6 +609,104 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
     return 0;
 }
 
+bool
+LocalRepo::encodeObject(ObjectInfo &info, const string &payload,
+                        string &stored)
+{
+    PfTransaction::encodePayload(zipPolicy, info, payload, stored);
+    return true;
+}
+
+int
+LocalRepo::addEncodedObject(const ObjectInfo &info, string &stored)
+{
+    ASSERT(opened);
+    ASSERT(!info.hash.isEmpty());
+    RWKey::sp key = storeLock.writeLock();
+
+    if (isStored(info.hash)) return 0;
+
+    prepareTransaction();
+    currTransaction->addStored(info, stored);
+
+    return 0;
+}
+
+void
+LocalRepo::addChunkedFile(const string &path, const LargeBlob &lb,
+                          ObjectPipeline *pipe, ObjectHash *hash,
+                          ObjectHash *largeHash)
+{
+    size_t sz = OriFile_GetSize(path);
+
+    if (sz <= LARGEFILE_MINIMUM || sz != lb.totalSize()) {
+        addFile(path, pipe, hash, largeHash);
+        return;
+    }
+
+    LargeBlobFile file;
+    int status = file.open(path);
+    if (status < 0)
+        throw SystemException(-status);
+
+    addChunkedFile(&file, lb, pipe, hash, largeHash);
+}
+
+void
+LocalRepo::addChunkedFile(LargeBlobSource *src, const LargeBlob &lb,
+                          ObjectPipeline *pipe, ObjectHash *hash,
+                          ObjectHash *largeHash)
+{
+    // Chunked again as a whole when it changed since
+    if (src->size() != lb.totalSize()) {
+        LargeBlob whole(this);
+
+        whole.rechunk(src, LargeBlob(this), map<uint64_t, uint64_t>());
+        addChunkedFile(src, whole, pipe, hash, largeHash);
+        return;
+    }
+
+    for (size_t i = 0; i < lb.parts.size(); i++) {
+        if (isObjectStored(lb.parts[i].hash))
+            continue;
+
+        string payload(lb.parts[i].length, '\0');
+        ssize_t status = src->read((uint8_t *)&payload[0], payload.size(),
+                                   lb.offsets[i]);
+        if (status != (ssize_t)payload.size())
+            throw SystemException(status < 0 ? -status : EIO);
+        pipe->add(ObjectInfo::Blob, payload, NULL);
+    }
+
+    string blob = lb.getBlob();
+    pipe->add(ObjectInfo::LargeBlob, blob, hash);
+    *largeHash = lb.totalHash;
+}
+
+/*
+ * Make sure there is a transaction with room for another object.  The
+ * caller holds storeLock for writing.
+ */
+void
+LocalRepo::prepareTransaction()
+{
+    if (!currPackfile.get()) {
+        currPackfile = newPackfile();
+        currTransaction = currPackfile->begin(&index, zipPolicy);
+    }
+
+    if (!currTransaction.get()) {
+        currTransaction = currPackfile->begin(&index, zipPolicy);
+    }
+
+    if (currTransaction->full()) {
+        currTransaction->commit();
+        currTransaction.reset();
+        currPackfile = newPackfile();
+        currTransaction = currPackfile->begin(&index, zipPolicy);
+    }
+}
+
 /*
  * Add a tree to the repository.
  */
@@ -612,8 +784,27 @@ LocalRepo::getPayload(const ObjectHash &objId)
     // TODO: if object is a LargeBlob, this will only return the LargeBlob
     // object, not the full contents of all the referenced blobs
 
-    auto_ptr<bytestream> bs(o->getPayloadStream());
-    return bs->readAll();
+    return o->getPayload();
+}
+
+/*
+ * Read part of an object, for large objects this avoids decompressing the
+ * whole payload.
+ */
+ssize_t
+LocalRepo::readPayload(const ObjectHash &objId, uint8_t *buf, size_t n,
+                       size_t off)
+{
+    LocalObject::sp o(getLocalObject(objId));
+    if (o)
+        return o->readPayload(buf, n, off);
+
+    string payload = getPayload(objId);
+    if (off >= payload.size())
+        return 0;
+    n = MIN(n, payload.size() - off);
+    memcpy(buf, payload.data() + off, n);
+    return n;
 }
 
 /*
@@ -706,10 +897,10 @@ LocalRepo::verifyObject(const ObjectHash &objId)
         {
             LargeBlob lb(this);
             lb.fromBlob(o->getPayload());
-            for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+            for (vector<LBlobEntry>::iterator it = lb.parts.begin();
                  it != lb.parts.end(); it++)
             {
-                if (it->second.hash.isEmpty()) {
+                if (it->hash.isEmpty()) {
                     return "LargeBlob contains an empty hash!";
                 }
             }
@@ -761,6 +952,8 @@ LocalRepo::copyObject(const ObjectHash &objId, const string &path)
 set<ObjectInfo>
 LocalRepo::listObjects()
 {
+    RWKey::sp key = storeLock.readLock();
+
     return index.getList();
 }
 
@@ -770,47 +963,78 @@ LocalRepo::listObjects()
 void
 LocalRepo::sync()
 {
+    RWKey::sp key = storeLock.writeLock();
     bool full = false;
+    bool committed = false;
     if (currTransaction.get()) {
         full = currTransaction->full();
         currTransaction->commit();
         currTransaction.reset();
+        committed = true;
+    }
+    if (groupCommit) {
+        // Payloads must reach the disk before the index entries
+        for (size_t i = 0; i < unsyncedPacks.size(); i++) {
+            unsyncedPacks[i]->sync();
+        }
+        unsyncedPacks.clear();
+        if (currPackfile.get())
+            unsyncedPacks.push_back(currPackfile);
+        index.sync();
+        metadata.sync();
+    } else if (committed) {
         index.sync();
         metadata.sync();
     }
     if (full) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+        currPackfile = newPackfile();
+        currTransaction = currPackfile->begin(&index, zipPolicy);
     }
 }
 
-struct RebuildIndexStruct
+void
+LocalRepo::setGroupCommit(bool enable)
 {
-    Index *idx;
-    packid_t id;
-};
+    if (!enable)
+        sync();
 
-void
-rebuildIndexCb(const ObjectInfo &info, offset_t off, void *arg)
+    RWKey::sp key = storeLock.writeLock();
+    groupCommit = enable;
+    index.setGroupCommit(enable);
+    metadata.setGroupCommit(enable);
+    unsyncedPacks.clear();
+    if (currPackfile.get()) {
+        currPackfile->setGroupCommit(enable);
+        if (enable)
+            unsyncedPacks.push_back(currPackfile);
+    }
+}
+
+Packfile::sp
+LocalRepo::newPackfile()
 {
-    RebuildIndexStruct *ris = (RebuildIndexStruct *)arg;
-    struct IndexEntry entry;
+    Packfile::sp pf = packfiles->newPackfile();
 
-    entry.info = info;
-    entry.offset = off;
-    entry.packed_size = info.payload_size;
-    entry.packfile = ris->id;
+    if (groupCommit) {
+        pf->setGroupCommit(true);
+        unsyncedPacks.push_back(pf);
+    }
 
-    ris->idx->updateEntry(info.hash, entry);
+    return pf;
 }
 
 bool
 LocalRepo::rebuildIndex()
 {
+    RWKey::sp key = storeLock.writeLock();
     string indexPath = rootPath + ORI_PATH_INDEX;
+    vector<ObjectHash> purgedList = index.getPurged();
+    unordered_set<ObjectHash> purged(purgedList.begin(), purgedList.end());
     index.close();
 
     OriFile_Delete(indexPath);
+    if (OriFile_Exists(indexPath + INDEX_SORTED))
+        OriFile_Delete(indexPath + INDEX_SORTED);
 
     index.open(indexPath);
 
@@ -819,14 +1043,21 @@ LocalRepo::rebuildIndex()
 
     for (it = pfIds.begin(); it != pfIds.end(); it++)
     {
-        RebuildIndexStruct ris;
         Packfile::sp pf = packfiles->getPackfile(*it);
+        vector<IndexEntry> entries = pf->getEntries();
+        vector<IndexEntry> live;
 
-        ris.idx = &index;
-        ris.id = *it;
-        pf->readEntries(rebuildIndexCb, (void *)&ris);
+        // Purged objects stay in the packfiles until they are compacted
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (purged.find(entries[i].info.hash) == purged.end())
+                live.push_back(entries[i]);
+        }
+        index.updateEntries(live);
     }
-    
+    index.removeEntries(purgedList);
+
+    index.rewrite();
+
     return true;
 }
 
@@ -904,89 +1135,286 @@ LocalRepo::lookupSnapshot(const string &name)
  */
 
 /*
- * Pull changes from the source repository.
+ * State of a pull shared by the thread requesting objects and the thread
+ * storing them.  The requesting thread coalesces the wanted objects into
+ * batches of up to PULL_BATCHOBJS objects or PULL_BATCHBYTES estimated
+ * bytes and queues the response stream of each.  The receiver stores the
+ * responses as it reads them and wants the objects referred to by the
+ * commits, trees and LargeBlobs received.  Up to window responses, counting
+ * the one being stored, are requested at once so that the next batches are
+ * on the wire meanwhile.
  */
-void
-LocalRepo::pull(Repo *r)
-{
-    vector<Commit> remoteCommits = r->listCommits();
-    deque<ObjectHash> toPull;
+struct PullOp {
+    struct Wanted {
+        ObjectHash hash;
+        size_t size;
+        // Commits, trees and LargeBlobs refer to other objects
+        bool expand;
+    };
+    struct Batch {
+        vector<Wanted> objs;
+        bytestream *bs;
+    };
+
+    PullOp(LocalRepo *repo, int window)
+        : repo(repo), window(window), receiving(false), exiting(false)
+    {
+    }
+    ~PullOp()
+    {
+        while (!received.empty()) {
+            delete received.front().bs;
+            received.pop_front();
+        }
+    }
 
-    deque<Commit> newCommits;
+    void want(const vector<Wanted> &objs)
+    {
+        unique_lock<mutex> l(lock);
 
-    for (size_t i = 0; i < remoteCommits.size(); i++) {
-        ObjectHash hash = remoteCommits[i].hash();
-        if (!hasObject(hash)) {
-            toPull.push_back(hash);
+        for (size_t i = 0; i < objs.size(); i++) {
+            if (requested.insert(objs[i].hash).second)
+                wanted.push_back(objs[i]);
+        }
+        cv.notify_all();
+    }
 
-            // TODO: partial pull
+    /*
+     * Waits for objects to request and for room in the window.  @returns
+     * false once everything wanted has been received.
+     */
+    bool nextBatch(vector<Wanted> *batch)
+    {
+        unique_lock<mutex> l(lock);
+        size_t bytes = 0;
+
+        while (!exiting &&
+               (received.size() + (receiving ? 1 : 0) >= (size_t)window ||
+                (wanted.empty() && (receiving || !received.empty()))))
+            cv.wait(l);
+        if (exiting)
+            return false;
+
+        while (!wanted.empty() && batch->size() < PULL_BATCHOBJS &&
+               (batch->empty() || bytes + wanted.front().size <= PULL_BATCHBYTES)) {
+            bytes += wanted.front().size;
+            batch->push_back(wanted.front());
+            wanted.pop_front();
         }
+
+        return !batch->empty();
     }
 
-    //LocalRepoLock::sp _lock(lock());
+    /// Queues a response for the receiver
+    void queue(const Batch &b)
+    {
+        unique_lock<mutex> l(lock);
 
-    bytestream::ap objs(r->getObjects(toPull));
-    receive(objs.get());
+        if (exiting) {
+            delete b.bs;
+            return;
+        }
+        received.push_back(b);
+        cv.notify_all();
+    }
 
-    // Perform the pull
-    while (!toPull.empty()) {
-        ObjectHash hash = toPull.front();
-        toPull.pop_front();
+    /// Stops the receiver once the queued responses are stored
+    void finish()
+    {
+        unique_lock<mutex> l(lock);
 
-        Object::sp o(getObject(hash));
-        if (!o) {
-            printf("Error getting object %s\n", hash.hex().c_str());
-            continue;
+        exiting = true;
+        cv.notify_all();
+    }
+
+    void receiveAll()
+    {
+        while (true) {
+            Batch b;
+
+            {
+                unique_lock<mutex> l(lock);
+
+                while (received.empty() && !exiting)
+                    cv.wait(l);
+                if (received.empty() || !error.empty())
+                    return;
+                b = received.front();
+                received.pop_front();
+                receiving = true;
+                cv.notify_all();
+            }
+
+            try {
+                bytestream::ap bs(b.bs);
+                repo->receive(bs.get());
+                want(expand(b.objs));
+            } catch (exception &e) {
+                unique_lock<mutex> l(lock);
+                error = e.what();
+                exiting = true;
+            }
+
+            unique_lock<mutex> l(lock);
+            receiving = false;
+            cv.notify_all();
         }
+    }
+
+    /*
+     * @returns the objects referred to by the received objects that are
+     * not stored yet.
+     */
+    vector<Wanted> expand(const vector<Wanted> &objs)
+    {
+        vector<Wanted> refs;
+
+        for (size_t i = 0; i < objs.size(); i++) {
+            if (!objs[i].expand)
+                continue;
 
-        // Enqueue the object's references
-        ObjectType t = o->getInfo().type;
-        /*printf("Pulling object %s (%s)\n", hash.c_str(),
-                Object::getStrForType(t));*/
-
-        vector<ObjectHash> newObjs;
-        if (t == ObjectInfo::Commit) {
-            Commit c;
-            c.fromBlob(o->getPayload());
-            if (!hasObject(c.getTree())) {
-                toPull.push_back(c.getTree());
-                newObjs.push_back(c.getTree());
+            Object::sp o(repo->getObject(objs[i].hash));
+            if (!o) {
+                printf("Error getting object %s\n", objs[i].hash.hex().c_str());
+                continue;
             }
-            newCommits.push_back(c);
-        } else if (t == ObjectInfo::Tree) {
-            Tree t;
-            t.fromBlob(o->getPayload());
-            for (map<string, TreeEntry>::iterator it = t.tree.begin();
-                    it != t.tree.end();
-                    it++) {
-                const ObjectHash &entry_hash = (*it).second.hash;
-                if (!hasObject(entry_hash)) {
-                    if ((*it).second.type != TreeEntry::Blob) {
-                        toPull.push_back(entry_hash);
-                    }
-                    newObjs.push_back(entry_hash);
+
+            ObjectType t = o->getInfo().type;
+            if (t == ObjectInfo::Commit) {
+                Commit c;
+                c.fromBlob(o->getPayload());
+                addRef(&refs, c.getTree(), PULL_OBJSIZE, true);
+                newCommits.push_back(c);
+            } else if (t == ObjectInfo::Tree) {
+                Tree t;
+                t.fromBlob(o->getPayload());
+                for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                        it != t.tree.end();
+                        it++) {
+                    const TreeEntry &te = (*it).second;
+                    size_t size = PULL_OBJSIZE;
+
+                    if (te.type == TreeEntry::Blob &&
+                        te.attrs.has(ATTR_FILESIZE))
+                        size = te.attrs.getAs<size_t>(ATTR_FILESIZE);
+                    addRef(&refs, te.hash, size, te.type != TreeEntry::Blob);
                 }
-            }
-        } else if (t == ObjectInfo::LargeBlob) {
-            LargeBlob lb(this);
-            lb.fromBlob(o->getPayload());
+            } else if (t == ObjectInfo::LargeBlob) {
+                LargeBlob lb(repo);
+                lb.fromBlob(o->getPayload());
 
-            for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
-                    pit != lb.parts.end();
-                    pit++) {
-                const ObjectHash &h = (*pit).second.hash;
-                if (!hasObject(h)) {
-                    //toPull.push_back(h);
-                    newObjs.push_back(h);
+                for (vector<LBlobEntry>::iterator pit = lb.parts.begin();
+                        pit != lb.parts.end();
+                        pit++) {
+                    addRef(&refs, (*pit).hash, (*pit).length, false);
                 }
             }
         }
 
-        if (newObjs.size() > 0) {
-            objs.reset(r->getObjects(newObjs));
-            receive(objs.get());
+        return refs;
+    }
+
+    void addRef(vector<Wanted> *refs, const ObjectHash &hash, size_t size,
+                bool expand)
+    {
+        if (repo->hasObject(hash))
+            return;
+
+        Wanted w;
+        w.hash = hash;
+        w.size = size;
+        w.expand = expand;
+        refs->push_back(w);
+    }
+
+    LocalRepo *repo;
+    int window;
+
+    mutex lock;
+    condition_variable cv;
+    deque<Wanted> wanted;
+    unordered_set<ObjectHash> requested;
+    deque<Batch> received;
+    // The receiver is storing a response and may want more objects
+    bool receiving;
+    bool exiting;
+    string error;
+
+    // Written by the receiver only
+    deque<Commit> newCommits;
+};
+
+class PullReceiver : public Thread
+{
+public:
+    PullReceiver(PullOp *op) : Thread("PullReceiver"), op(op)
+    {
+    }
+    virtual void run()
+    {
+        op->receiveAll();
+    }
+private:
+    PullOp *op;
+};
+
+/*
+ * The heads of the history, each followed by its first parent ancestors 1,
+ * 2, 4, 8... commits back.  A remote that does not know a head still finds
+ * a common ancestor at most twice as far back as the newest one.
+ */
+static ObjectHashVec
+LocalRepo_CommitFrontier(const vector<Commit> &commits)
+{
+    unordered_map<ObjectHash, const Commit *> byHash;
+    unordered_set<ObjectHash> parents;
+    ObjectHashVec haves;
+
+    for (size_t i = 0; i < commits.size(); i++) {
+        pair<ObjectHash, ObjectHash> p = commits[i].getParents();
+
+        byHash[commits[i].hash()] = &commits[i];
+        parents.insert(p.first);
+        parents.insert(p.second);
+    }
+
+    // Newest heads first
+    for (size_t i = commits.size(); i-- > 0 && haves.size() < PULL_MAXHAVES;) {
+        ObjectHash hash = commits[i].hash();
+        size_t dist = 0, next = 0;
+
+        if (parents.find(hash) != parents.end())
+            continue;
+
+        while (haves.size() < PULL_MAXHAVES) {
+            unordered_map<ObjectHash, const Commit *>::iterator it;
+
+            it = byHash.find(hash);
+            if (it == byHash.end())
+                break;
+            if (dist == next) {
+                haves.push_back(hash);
+                next = (next == 0) ? 1 : next * 2;
+            }
+            hash = (*it).second->getParents().first;
+            dist++;
         }
     }
+
+    return haves;
+}
+
+/*
+ * Pull changes from the source repository.
+ */
+void
+LocalRepo::pull(Repo *r)
+{
+    deque<Commit> newCommits;
+
+    if (!pullMissing(r, &newCommits))
+        pullObjects(r, &newCommits);
+
     while (!newCommits.empty()) {
         Commit nc = newCommits.front();
         newCommits.pop_front();
@@ -1006,6 +1434,95 @@ LocalRepo::pull(Repo *r)
     }
 }
 
+/*
+ * Receives the objects missing here from the remote in a single exchange.
+ * @returns false if the remote cannot tell which objects are missing.
+ */
+bool
+LocalRepo::pullMissing(Repo *r, deque<Commit> *newCommits)
+{
+    vector<Commit> commits = listCommits();
+    unordered_set<ObjectHash> known;
+
+    bytestream::ap bs(r->getMissingObjects(LocalRepo_CommitFrontier(commits)));
+    if (!bs.get())
+        return false;
+
+    receive(bs.get());
+
+    for (size_t i = 0; i < commits.size(); i++) {
+        known.insert(commits[i].hash());
+    }
+    commits = listCommits();
+    for (size_t i = 0; i < commits.size(); i++) {
+        if (known.find(commits[i].hash()) == known.end())
+            newCommits->push_back(commits[i]);
+    }
+
+    return true;
+}
+
+/*
+ * Walks the remote history and requests the objects missing here.
+ */
+void
+LocalRepo::pullObjects(Repo *r, deque<Commit> *newCommits)
+{
+    vector<Commit> remoteCommits = r->listCommits();
+    vector<PullOp::Wanted> toPull;
+    PullOp op(this, min(PULL_WINDOW, r->getObjectsStreams()));
+
+    for (size_t i = 0; i < remoteCommits.size(); i++) {
+        ObjectHash hash = remoteCommits[i].hash();
+        if (!hasObject(hash)) {
+            PullOp::Wanted w;
+            w.hash = hash;
+            w.size = PULL_OBJSIZE;
+            w.expand = true;
+            toPull.push_back(w);
+
+            // TODO: partial pull
+        }
+    }
+
+    //LocalRepoLock::sp _lock(lock());
+
+    // Perform the pull
+    op.want(toPull);
+    PullReceiver receiver(&op);
+    receiver.start();
+
+    try {
+        PullOp::Batch b;
+
+        while (op.nextBatch(&b.objs)) {
+            ObjectHashVec hashes;
+
+            for (size_t i = 0; i < b.objs.size(); i++) {
+                hashes.push_back(b.objs[i].hash);
+            }
+
+            b.bs = r->getObjects(hashes);
+            if (b.bs == NULL)
+                throw runtime_error("Could not get objects from the remote");
+            op.queue(b);
+            b.objs.clear();
+        }
+    } catch (...) {
+        op.finish();
+        receiver.wait();
+        throw;
+    }
+    op.finish();
+    receiver.wait();
+
+    if (!op.error.empty()) {
+        throw runtime_error(op.error);
+    }
+
+    newCommits->swap(op.newCommits);
+}
+
 
 struct MultiPullOp {
     MultiPullOp(LocalRepo &r)
@@ -1173,10 +1690,10 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
                     LargeBlob lb(this);
                     lb.fromBlob(obj->getPayload());
 
-                    for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
+                    for (vector<LBlobEntry>::iterator pit = lb.parts.begin();
                             pit != lb.parts.end();
                             pit++) {
-                        const ObjectHash &h = (*pit).second.hash;
+                        const ObjectHash &h = (*pit).hash;
                         mpo.enqueue(h);
                     }
                 }
@@ -1189,16 +1706,99 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
     printf("Speed-up: %lu of %lu objects\n", closerObjs, totalObjs);
 }
 
+/*
+ * The objects of each packfile (see Packfile::transmit) followed by an empty
+ * section that ends the transmit.
+ */
+class LocalTransmitStream : public bytestream
+{
+public:
+    LocalTransmitStream()
+        : curr(0), size(0)
+    {
+        strwstream ss;
+
+        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+        ss.writeUInt32(0);
+        trailer = ss.str();
+    }
+    ~LocalTransmitStream()
+    {
+        for (size_t i = 0; i < parts.size(); i++)
+            delete parts[i];
+    }
+    void add(Packfile::sp pf, bytestream *bs)
+    {
+        packs.push_back(pf);
+        parts.push_back(bs);
+        size += bs->sizeHint();
+    }
+    void finish()
+    {
+        parts.push_back(new strstream(trailer));
+        size += trailer.size();
+    }
+    bool ended()
+    {
+        return curr == parts.size() || error();
+    }
+    size_t read(uint8_t *buf, size_t n)
+    {
+        size_t total = 0;
+
+        while (total < n && curr < parts.size()) {
+            total += parts[curr]->read(buf + total, n - total);
+            if (inheritError(parts[curr]))
+                return total;
+            if (parts[curr]->ended())
+                curr++;
+        }
+
+        return total;
+    }
+    size_t sizeHint() const
+    {
+        return size;
+    }
+
+private:
+    std::string trailer;
+    // Keeps the packfiles open while they are read
+    std::vector<Packfile::sp> packs;
+    std::vector<bytestream *> parts;
+    size_t curr;
+    size_t size;
+};
+
 void
 LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
+{
+    bytestream::ap ts(transmitStream(objs));
+    vector<uint8_t> buf(MIN(ts->sizeHint(), (size_t)TRANSMIT_BUFSIZE));
+
+    while (!ts->ended()) {
+        size_t len = ts->read(&buf[0], buf.size());
+        if (ts->error()) {
+            DLOG("Exception: %s", ts->error());
+            break;
+        }
+        bs->write(&buf[0], len);
+    }
+}
+
+bytestream *
+LocalRepo::transmitStream(const ObjectHashVec &objs)
 {
     DLOG("local transmit");
     unordered_set<ObjectHash> includedHashes;
 
     typedef std::vector<IndexEntry> IndexEntryVec;
     std::map<Packfile::sp, IndexEntryVec> packs;
+    auto_ptr<LocalTransmitStream> ts(new LocalTransmitStream());
 
     try {
+        RWKey::sp key = storeLock.readLock();
+
         for (size_t i = 0; i < objs.size(); i++) {
             if (includedHashes.find(objs[i]) == includedHashes.end()) {
                 const IndexEntry &ie = index.getEntry(objs[i]);
@@ -1214,32 +1814,154 @@ LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
                 it != packs.end();
                 it++) {
             const Packfile::sp &pf = (*it).first;
-            //fprintf(stderr, "Transmitting %lu objects from %p\n",
-            //        (*it).second.size(), pf.get());
-            pf->transmit(bs, (*it).second);
+            PfTransmitStream *ps = pf->transmitStream((*it).second);
+
+            ts->add(pf, ps);
+            transmitRuns += ps->runs();
+            transmitObjects += (*it).second.size();
         }
+        transmitCalls++;
     } catch (RuntimeException& e) {
         if (e.getCode() == ORIEC_INDEXNOTFOUND) {
             DLOG("failed to find objects, ending stream...");
         } else {
             DLOG("Exception: %s", e.what());
         }
+        ts.reset(new LocalTransmitStream());
     } catch (...)  {
         DLOG("unexpected exception in transmit");
+        ts.reset(new LocalTransmitStream());
+    }
+    ts->finish();
+
+    return ts.release();
+}
+
+/*
+ * Commits not reachable from haves are missing.  The objects of the newest
+ * commits the caller has are not sent again, so only the objects changed
+ * since then are sent.
+ */
+bytestream *
+LocalRepo::getMissingObjects(const ObjectHashVec &haves)
+{
+    vector<Commit> commits = listCommits();
+    unordered_map<ObjectHash, const Commit *> byHash;
+    unordered_set<ObjectHash> common;
+    deque<ObjectHash> toVisit(haves.begin(), haves.end());
+
+    for (size_t i = 0; i < commits.size(); i++) {
+        byHash[commits[i].hash()] = &commits[i];
+    }
+
+    // Commits the caller has
+    while (!toVisit.empty()) {
+        ObjectHash hash = toVisit.front();
+        unordered_map<ObjectHash, const Commit *>::iterator it;
+
+        toVisit.pop_front();
+        it = byHash.find(hash);
+        if (it == byHash.end() || !common.insert(hash).second)
+            continue;
+
+        pair<ObjectHash, ObjectHash> p = (*it).second->getParents();
+        toVisit.push_back(p.first);
+        if (!p.second.isEmpty())
+            toVisit.push_back(p.second);
+    }
+
+    // Objects of the common commits that missing commits build on
+    unordered_set<ObjectHash> none;
+    unordered_set<ObjectHash> have;
+    for (size_t i = 0; i < commits.size(); i++) {
+        if (common.find(commits[i].hash()) != common.end())
+            continue;
+
+        pair<ObjectHash, ObjectHash> p = commits[i].getParents();
+        ObjectHash parents[2] = { p.first, p.second };
+        for (int j = 0; j < 2; j++) {
+            if (common.find(parents[j]) != common.end()) {
+                addStoredObjects(byHash[parents[j]]->getTree(), none, &have,
+                                 NULL);
+            }
+        }
+    }
+
+    unordered_set<ObjectHash> seen;
+    ObjectHashVec objs;
+    for (size_t i = 0; i < commits.size(); i++) {
+        if (common.find(commits[i].hash()) != common.end())
+            continue;
+
+        objs.push_back(commits[i].hash());
+        addStoredObjects(commits[i].getTree(), have, &seen, &objs);
+    }
+
+    DLOG("%zu of %zu commits missing, sending %zu objects",
+         commits.size() - common.size(), commits.size(), objs.size());
+
+    return transmitStream(objs);
+}
+
+/*
+ * Walks the stored objects reachable from hash that are not in have or seen,
+ * adding each to seen and, if objs is not NULL, to objs.
+ */
+void
+LocalRepo::addStoredObjects(const ObjectHash &hash,
+                            const unordered_set<ObjectHash> &have,
+                            unordered_set<ObjectHash> *seen,
+                            ObjectHashVec *objs)
+{
+    ObjectType type;
+
+    if (have.find(hash) != have.end() || !seen->insert(hash).second)
+        return;
+    {
+        RWKey::sp key = storeLock.readLock();
+
+        if (!index.hasObject(hash))
+            return;
+        type = index.getEntry(hash).info.type;
+    }
+    if (objs != NULL)
+        objs->push_back(hash);
+
+    if (type == ObjectInfo::Tree) {
+        Tree tree = getTree(hash);
+
+        for (map<string, TreeEntry>::iterator it = tree.tree.begin();
+                it != tree.tree.end();
+                it++) {
+            addStoredObjects((*it).second.hash, have, seen, objs);
+        }
+    } else if (type == ObjectInfo::LargeBlob) {
+        LargeBlob lb = getLargeBlob(hash);
+
+        for (vector<LBlobEntry>::iterator it = lb.parts.begin();
+                it != lb.parts.end();
+                it++) {
+            addStoredObjects((*it).hash, have, seen, objs);
+        }
     }
-    /* Write (numobjs_t)0 */
-    bs->writeUInt32(0);
 }
 
 void
 LocalRepo::receive(bytestream *bs)
 {
+    ObjectPipeline verifier(this);
+    RWKey::sp key = storeLock.writeLock();
     bool cont = true;
     while (cont) {
         if (!currPackfile.get() || currPackfile->full()) {
-            currPackfile = packfiles->newPackfile();
+            // The open transaction points at the packfile being replaced
+            if (currTransaction.get()) {
+                currTransaction->commit();
+                currTransaction.reset();
+            }
+            currPackfile = newPackfile();
         }
-        cont = currPackfile->receive(bs, &index);
+        cont = currPackfile->receive(bs, &index, &verifier);
     }
 }
 
@@ -1258,10 +1980,10 @@ LocalRepo::getObjects(const ObjectHashVec &objs)
 void
 LocalRepo::addLargeBlobBackrefs(const LargeBlob &lb, MdTransaction::sp tr)
 {
-    for (map<uint64_t, LBlobEntry>::const_iterator it = lb.parts.begin();
+    for (vector<LBlobEntry>::const_iterator it = lb.parts.begin();
             it != lb.parts.end();
             it++) {
-        const LBlobEntry &lbe = (*it).second;
+        const LBlobEntry &lbe = *it;
 
         metadata.addRef(lbe.hash, tr);
     }
@@ -1314,10 +2036,10 @@ LocalRepo::addCommitBackrefs(const Commit &c, MdTransaction::sp tr)
 void
 LocalRepo::copyObjectsFromLargeBlob(Repo *other, const LargeBlob &lb)
 {
-    for (map<uint64_t, LBlobEntry>::const_iterator it = lb.parts.begin();
+    for (vector<LBlobEntry>::const_iterator it = lb.parts.begin();
             it != lb.parts.end();
             it++) {
-        const LBlobEntry &lbe = (*it).second;
+        const LBlobEntry &lbe = *it;
         if (hasObject(lbe.hash)) {
             continue;
         }
@@ -1445,40 +2167,39 @@ LocalRepo::commitFromObjects(const ObjectHash &treeHash, Repo *objects,
 
 /*
  * Garbage Collect. Attempt to reduce wasted space from deleted objects and 
- * metadata.
+ * metadata.  Reordering rewrites every packfile in snapshot traversal order
+ * so reads and transfers of a snapshot are mostly sequential.
  */
 void
-LocalRepo::gc()
+LocalRepo::gc(bool reorder)
 {
-    // Commit all ongoing transactions
-    if (currTransaction.get()) {
-        currTransaction->commit();
+    // Commit all ongoing transactions, the rewrites below are durable
+    sync();
+
+    // Later writes go to a new packfile so the current one can be compacted
+    {
+        RWKey::sp key = storeLock.writeLock();
+
         currTransaction.reset();
+        currPackfile.reset();
     }
 
-    // Compact the index
-    index.rewrite();
-
     // Compact the metadata log
     metadata.rewrite();
 
-    // Do purges
-    std::set<packid_t> purgePacks;
-    for (std::set<ObjectHash>::iterator it = purged.begin();
-            it != purged.end();
-            it++) {
-        const IndexEntry &ie = index.getEntry((*it));
-        purgePacks.insert(ie.packfile);
-    }
-
-    for (std::set<packid_t>::iterator it = purgePacks.begin();
-            it != purgePacks.end();
-            it++) {
-        Packfile::sp pack = packfiles->getPackfile((*it));
-        pack->purge(purged, &index);
+    // Compact every packfile holding purged objects
+    Repacker repacker(this);
+    repacker.setMinDead(0.0);
+    repacker.setRate(0);
+    if (reorder) {
+        repacker.reorder();
+    } else {
+        repacker.repack();
     }
 
-    purged.clear();
+    // Merge the index log into the sorted index, dropping purged entries
+    RWKey::sp key = storeLock.writeLock();
+    index.rewrite(true);
 }
 
 /*
@@ -1486,6 +2207,17 @@ LocalRepo::gc()
  */
 bool
 LocalRepo::isObjectStored(const ObjectHash &objId)
+{
+    RWKey::sp key = storeLock.readLock();
+
+    return isStored(objId);
+}
+
+/*
+ * isObjectStored with storeLock already held.
+ */
+bool
+LocalRepo::isStored(const ObjectHash &objId)
 {
     if (currTransaction.get() && currTransaction->has(objId)) {
         return true;
@@ -1515,8 +2247,12 @@ LocalRepo::hasObject(const ObjectHash &objId)
 ObjectInfo
 LocalRepo::getObjectInfo(const ObjectHash &objId)
 {
-    if (index.hasObject(objId)) {
-        return index.getInfo(objId);
+    {
+        RWKey::sp key = storeLock.readLock();
+
+        if (index.hasObject(objId)) {
+            return index.getInfo(objId);
+        }
     }
     
     Monitor lock(remoteLock);
@@ -1584,10 +2320,10 @@ LocalRepo::recomputeRefCounts()
                 Object::sp o(getObject(hash));
                 lb.fromBlob(o->getPayload());
 
-                for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
+                for (vector<LBlobEntry>::iterator pit = lb.parts.begin();
                         pit != lb.parts.end();
                         pit++) {
-                    ObjectHash h = (*pit).second.hash;
+                    ObjectHash h = (*pit).hash;
                     rval[h] += 1;
                 }
                 break;
@@ -1623,15 +2359,17 @@ bool
 LocalRepo::purgeObject(const ObjectHash &objId)
 {
     ASSERT(metadata.getRefCount(objId) == 0);
+    RWKey::sp key = storeLock.writeLock();
 
     if (currTransaction.get())
         currTransaction.reset();
 
-    /*const IndexEntry &ie = index.getEntry(objId);
-    Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
-    packfile->purge(objId);*/
-
-    purged.insert(objId);
+    // The space is reclaimed once the packfile is compacted by a Repacker
+    if (index.hasObject(objId)) {
+        index.removeEntries(vector<ObjectHash>(1, objId));
+        purgeCount++;
+    }
+    objCache.invalidate(objId);
 
     return true;
 }
@@ -1647,10 +2385,10 @@ LocalRepo::decrefLB(const ObjectHash &lbhash, MdTransaction::sp tr)
         // Going to be purged, decref children
         LargeBlob lb(this);
         lb.fromBlob(getPayload(lbhash));
-        for (std::map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+        for (std::vector<LBlobEntry>::iterator it = lb.parts.begin();
                 it != lb.parts.end();
                 it++) {
-            const LBlobEntry &entry = (*it).second;
+            const LBlobEntry &entry = *it;
             tr->decRef(entry.hash);
         }
     }
@@ -1792,9 +2530,9 @@ LocalRepo::getSubtreeObjects(const ObjectHash &treeId)
                     treeQ.push(e.hash);
                 } else if (e.type == TreeEntry::LargeBlob) {
                     LargeBlob lb = getLargeBlob(e.hash);
-                    std::map<uint64_t, LBlobEntry>::iterator it;
+                    std::vector<LBlobEntry>::iterator it;
                     for (it = lb.parts.begin(); it != lb.parts.end(); it++) {
-                        rval.insert(it->second.hash);
+                        rval.insert(it->hash);
                     }
                 }
                 rval.insert(e.hash);
@@ -72,13 +72,14 @@ void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
  */
 
 MetadataLog::MetadataLog()
-    : fd(-1)
+    : fd(-1), groupCommit(false)
 {
 }
 
 MetadataLog::~MetadataLog()
 {
     if (fd != -1) {
+        flush();
         ::close(fd);
     }
 }
@@ -159,9 +160,36 @@ MetadataLog::open(const string &filename)
 void
 MetadataLog::sync()
 {
+    flush();
     ::fsync(fd);
 }
 
+void
+MetadataLog::setGroupCommit(bool enable)
+{
+    groupCommit = enable;
+    if (!enable)
+        flush();
+}
+
+void
+MetadataLog::flush()
+{
+    size_t off = 0;
+
+    while (off < pending.size()) {
+        ssize_t n = ::write(fd, pending.data() + off, pending.size() - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            WARNING("MetadataLog write failed!");
+            throw SystemException();
+        }
+        off += n;
+    }
+    pending.clear();
+}
+
 void
 MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
 {
@@ -180,14 +208,21 @@ MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
     int oldFd = fd;
     fd = newFd;
 
+    // The new log replaces anything not yet appended to the old one
+    pending.clear();
+
     ftruncate(fd, 0);
     lseek(fd, 0, SEEK_SET);
-    MdTransaction::sp tr = begin();
-    tr->counts = *refs;
-    tr->metadata = *data;
+    {
+        MdTransaction::sp tr = begin();
+        tr->counts = *refs;
+        tr->metadata = *data;
 
-    refcounts.clear();
-    metadata.clear();
+        refcounts.clear();
+        metadata.clear();
+    }
+    flush();
+    ::fsync(fd);
 
     OriFile_Rename(tmpFilename, filename);
     ::close(oldFd);
@@ -284,8 +319,10 @@ MetadataLog::commit(MdTransaction *tr)
 
     const string &str = ws.str();
     uint32_t nbytes = str.size();
-    write(fd, &nbytes, sizeof(uint32_t));
-    write(fd, str.data(), str.size());
+    pending.append((const char *)&nbytes, sizeof(uint32_t));
+    pending.append(str);
+    if (!groupCommit)
+        flush();
 
     tr->counts.clear();
     tr->metadata.clear();
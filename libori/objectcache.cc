@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <string>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <ori/objectcache.h>
+
+using namespace std;
+
+ObjectCache::ObjectCache(size_t maxBytes)
+    : cache(maxBytes, OBJCACHE_SHARDS)
+{
+}
+
+ObjectCache::~ObjectCache()
+{
+}
+
+ObjectCache::Payload
+ObjectCache::get(const ObjectHash &hash)
+{
+    return cache.get(hash);
+}
+
+void
+ObjectCache::put(const ObjectHash &hash, const Payload &payload)
+{
+    size_t shardBytes = cache.getCapacity() / OBJCACHE_SHARDS;
+
+    // Large payloads would flush the whole shard for a single entry
+    if (payload->size() > (shardBytes >> OBJCACHE_MAXENTRY_SHIFT))
+        return;
+
+    cache.put(hash, payload, payload->size());
+}
+
+void
+ObjectCache::invalidate(const ObjectHash &hash)
+{
+    cache.invalidate(hash);
+}
+
+void
+ObjectCache::clear()
+{
+    cache.clear();
+}
+
+void
+ObjectCache::setMaxSize(size_t newMax)
+{
+    cache.setCapacity(newMax);
+}
+
+size_t
+ObjectCache::getMaxSize() const
+{
+    return cache.getCapacity();
+}
+
+ObjectCache::Stats
+ObjectCache::getStats()
+{
+    ConcurrentCache<ObjectHash, const string>::Stats cs = cache.getStats();
+    Stats st;
+
+    st.hits = cs.hits;
+    st.misses = cs.misses;
+    st.evictions = cs.evictions;
+    st.bytes = cs.weight;
+    st.entries = cs.entries;
+
+    return st;
+}
+
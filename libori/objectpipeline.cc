@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <unistd.h>
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/thread.h>
+#include <oriutil/zipcodec.h>
+#include <ori/repo.h>
+#include <ori/objectpipeline.h>
+
+using namespace std;
+
+class PipelineWorker : public Thread
+{
+public:
+    PipelineWorker(ObjectPipeline *pipe) : Thread("PipelineWorker"), pipe(pipe)
+    {
+    }
+    virtual void run()
+    {
+        ObjectPipeline::Job *job;
+
+        while ((job = pipe->nextJob()) != NULL) {
+            pipe->process(job);
+            pipe->complete(job);
+        }
+    }
+private:
+    ObjectPipeline *pipe;
+};
+
+ObjectPipeline::ObjectPipeline(Repo *repo, int threads)
+    : repo(repo), failed(false), exiting(false), pendingBytes(0)
+{
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > OBJPIPE_MAXTHREADS) ? OBJPIPE_MAXTHREADS : cpus;
+    }
+
+    // A single processor gains nothing from handing work to another thread
+    if (threads <= 1)
+        return;
+
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(new PipelineWorker(this));
+        workers.back()->start();
+    }
+}
+
+ObjectPipeline::~ObjectPipeline()
+{
+    try {
+        drain();
+    } catch (exception &e) {
+        WARNING("ObjectPipeline: %s", e.what());
+    }
+
+    {
+        unique_lock<mutex> l(lock);
+        exiting = true;
+    }
+    workCV.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+}
+
+void
+ObjectPipeline::add(ObjectType type, string &payload, ObjectHash *hash)
+{
+    Job *job = new Job();
+
+    job->kind = Job::Add;
+    job->info.type = type;
+    job->info.payload_size = payload.size();
+    job->payload.swap(payload);
+    job->hash = hash;
+
+    submit(job);
+}
+
+void
+ObjectPipeline::verify(const ObjectInfo &info, const uint8_t *buf,
+                       size_t len)
+{
+    Job *job = new Job();
+
+    job->kind = Job::Verify;
+    job->info = info;
+    job->stored.assign((const char *)buf, len);
+    job->hash = NULL;
+
+    submit(job);
+}
+
+void
+ObjectPipeline::drain()
+{
+    writeCompleted(true, 0, 0);
+}
+
+bool
+ObjectPipeline::ok() const
+{
+    return !failed;
+}
+
+void
+ObjectPipeline::reset()
+{
+    failed = false;
+}
+
+/*
+ * Hash and encode an object, or check a received object.  Runs on the
+ * workers without the pipeline lock held.
+ */
+void
+ObjectPipeline::process(Job *job)
+{
+    job->present = false;
+    job->encoded = false;
+    job->ok = false;
+
+    try {
+        if (job->kind == Job::Add) {
+            job->info.hash = OriCrypt_HashString(job->payload);
+            {
+                unique_lock<mutex> l(repoLock);
+                job->present = repo->isObjectStored(job->info.hash);
+            }
+            if (job->present) {
+                string().swap(job->payload);
+            } else {
+                job->encoded = repo->encodeObject(job->info, job->payload,
+                                                  job->stored);
+            }
+            job->ok = true;
+        } else {
+            bytestream::ap bs(ZipCodec_Decode(new strstream(job->stored),
+                                              job->info));
+            string payload = bs->readAll();
+
+            job->ok = !bs->error() &&
+                      payload.size() == job->info.payload_size &&
+                      OriCrypt_HashString(payload) == job->info.hash;
+        }
+    } catch (exception &e) {
+        WARNING("ObjectPipeline: %s", e.what());
+    }
+}
+
+void
+ObjectPipeline::submit(Job *job)
+{
+    bool serial = workers.size() == 0;
+
+    if (serial)
+        process(job);
+
+    job->bytes = job->payload.size() + job->stored.size();
+    job->done = serial;
+    {
+        unique_lock<mutex> l(lock);
+        pending.push_back(job);
+        pendingBytes += job->bytes;
+        if (!serial)
+            work.push_back(job);
+    }
+    workCV.notify_one();
+
+    writeCompleted(false, OBJPIPE_MAXJOBS, OBJPIPE_MAXBYTES);
+}
+
+void
+ObjectPipeline::complete(Job *job)
+{
+    {
+        unique_lock<mutex> l(lock);
+        size_t bytes = job->payload.size() + job->stored.size();
+
+        // Objects already present no longer count against the bound
+        pendingBytes = pendingBytes - job->bytes + bytes;
+        job->bytes = bytes;
+        job->done = true;
+    }
+    doneCV.notify_all();
+}
+
+ObjectPipeline::Job *
+ObjectPipeline::nextJob()
+{
+    unique_lock<mutex> l(lock);
+    Job *job;
+
+    while (work.empty() && !exiting)
+        workCV.wait(l);
+    if (work.empty())
+        return NULL;
+
+    job = work.front();
+    work.pop_front();
+    return job;
+}
+
+void
+ObjectPipeline::write(Job *job)
+{
+    if (job->kind == Job::Verify) {
+        if (!job->ok) {
+            WARNING("Object %s failed verification",
+                    job->info.hash.hex().c_str());
+            failed = true;
+        }
+        return;
+    }
+
+    // Redo the work on this thread if the worker failed
+    if (!job->ok)
+        job->info.hash = OriCrypt_HashString(job->payload);
+    {
+        unique_lock<mutex> l(repoLock);
+
+        if (job->present) {
+            // Already stored
+        } else if (job->encoded) {
+            repo->addEncodedObject(job->info, job->stored);
+        } else {
+            repo->addObject(job->info.type, job->info.hash, job->payload);
+        }
+    }
+    if (job->hash != NULL)
+        *job->hash = job->info.hash;
+}
+
+/*
+ * Hand completed jobs to the repository in submission order.  Stops at the
+ * first job that is still being processed unless wait is set, or the
+ * pipeline holds more than maxJobs jobs or maxBytes of payload.
+ */
+void
+ObjectPipeline::writeCompleted(bool wait, size_t maxJobs, size_t maxBytes)
+{
+    unique_lock<mutex> l(lock);
+
+    while (!pending.empty()) {
+        Job *job = pending.front();
+        bool mustWait = wait || pending.size() > maxJobs ||
+                        pendingBytes > maxBytes;
+
+        if (!job->done) {
+            if (!mustWait)
+                break;
+            doneCV.wait(l);
+            continue;
+        }
+
+        pending.pop_front();
+        pendingBytes -= job->bytes;
+        l.unlock();
+
+        try {
+            write(job);
+        } catch (exception &e) {
+            delete job;
+            throw;
+        }
+        delete job;
+
+        l.lock();
+    }
+}
+
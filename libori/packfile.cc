@@ -15,15 +15,19 @@
  */
 
 
+#include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <string>
 #include <set>
 #include <list>
+#include <map>
 #include <vector>
 #include <sstream>
 #include <stdexcept>
@@ -38,19 +42,36 @@
 #include <oriutil/orifile.h>
 #include <oriutil/scan.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/zipcodec.h>
 #include <ori/packfile.h>
 #include <ori/index.h>
+#include <ori/objectpipeline.h>
 
 using namespace std;
 
-PfTransaction::PfTransaction(Packfile *pf, Index *idx)
-    : totalSize(0), committed(false), pf(pf), idx(idx)
+ZipPolicy::ZipPolicy()
+    : fastAlgo(ZIPALGO_DEFAULT), denseAlgo(ZIPALGO_DENSE),
+      denseMinimum(ZIP_DENSE_MINIMUM)
+{
+}
+
+ObjectInfo::ZipAlgo
+ZipPolicy::select(ObjectType type, size_t size) const
+{
+    if (type == ObjectInfo::Blob && size >= denseMinimum)
+        return denseAlgo;
+    return fastAlgo;
+}
+
+PfTransaction::PfTransaction(Packfile *pf, Index *idx, const ZipPolicy &policy)
+    : totalSize(0), committed(false), pf(pf), idx(idx), policy(policy)
 {
 }
 
 PfTransaction::~PfTransaction()
 {
-    if (!committed)
+    // Transactions without an index are written with Packfile::append
+    if (!committed && idx != NULL)
         commit();
 }
 
@@ -60,14 +81,74 @@ bool PfTransaction::full() const
         totalSize >= PACKFILE_MAXSIZE;
 }
 
+/*
+ * Estimate the compression ratio from a sample at the start of the payload,
+ * so incompressible data skips compressing the full payload.
+ */
 float
-PfTransaction::_checkCompressionRatio(const string &payload)
+PfTransaction::_checkCompressionRatio(const ZipCodec *codec,
+                                      const string &payload)
+{
+    string sample;
+
+    if (payload.size() <= 2 * COMPCHECK_BYTES)
+        return 0.0f;
+
+    if (!codec->compress(payload.data(), COMPCHECK_BYTES, sample))
+        return 1.0f;
+
+    return (float)sample.size() / (float)COMPCHECK_BYTES;
+}
+
+/*
+ * Choose the codec for an object and produce its stored form.  Sets the
+ * codec flags in info.  Only reads the policy so it may be called from
+ * other threads while the transaction is in use.
+ */
+void
+PfTransaction::encodePayload(const ZipPolicy &policy, ObjectInfo &info,
+                             const string &payload, string &stored)
 {
-    return 1.5f;
+    ObjectInfo::ZipAlgo algo = policy.select(info.type, payload.size());
+    const ZipCodec *codec = ZipCodec_Get(algo);
+    bool compress = false;
+    bool framed = payload.size() >= ZIP_FRAME_MINIMUM;
+
+    if (codec != NULL && payload.size() > ZIP_MINIMUM_SIZE &&
+        _checkCompressionRatio(codec, payload) <= COMPCHECK_RATIO) {
+        bool ok;
+        if (framed) {
+            ok = ZipCodec_EncodeFramed(codec, payload.data(), payload.size(),
+                                       ZIP_FRAME_BLOCKSIZE, stored);
+        } else {
+            ok = codec->compress(payload.data(), payload.size(), stored);
+        }
+        if (ok && stored.size() <= payload.size() * COMPCHECK_RATIO) {
+            compress = true;
+        }
+    }
+
+    if (compress) {
+        info.setAlgo(algo);
+        info.setFramed(framed);
+    } else {
+        info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        info.setFramed(false);
+        stored = payload;
+    }
 }
 
 void
 PfTransaction::addPayload(ObjectInfo info, const string &payload)
+{
+    string stored;
+
+    encodePayload(policy, info, payload, stored);
+    addStored(info, stored);
+}
+
+void
+PfTransaction::addStored(const ObjectInfo &info, string &stored)
 {
     if (committed) {
         throw runtime_error("Adding payload to already-committed transaction!");
@@ -83,51 +164,9 @@ PfTransaction::addPayload(ObjectInfo info, const string &payload)
     }
 #endif
 
-    ObjectInfo::ZipAlgo defaultAlgo = ObjectInfo::ZIPALGO_FASTLZ;
-    switch (defaultAlgo) {
-        case ObjectInfo::ZIPALGO_NONE:
-        {
-            info.setAlgo(defaultAlgo);
-            payloads.push_back(payload);
-            totalSize += payload.size();
-            break;
-        }
-        case ObjectInfo::ZIPALGO_FASTLZ:
-        {
-            zipstream ls(new strstream(payload), COMPRESS);
-            uint8_t buf[COMPCHECK_BYTES];
-            size_t compSize = 0;
-            bool compress = false;
-
-            if (payload.size() > ZIP_MINIMUM_SIZE) {
-                compSize = ls.read(buf, COMPCHECK_BYTES);
-                float ratio = (float)compSize / (float)ls.inputConsumed();
-
-                if (ratio <= COMPCHECK_RATIO) {
-                    compress = true;
-                }
-            }
-
-            if (compress) {
-                // Okay to compress
-                info.setAlgo(defaultAlgo);
-                // Reuse compression test data
-                strwstream ss(string((char*)buf, compSize));
-                ss.copyFrom(&ls);
-
-                payloads.push_back(ss.str());
-                totalSize += ss.str().size();
-            } else {
-                info.setAlgo(ObjectInfo::ZIPALGO_NONE);
-                payloads.push_back(payload);
-                totalSize += payload.size();
-            }
-            break;
-        }
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
-    }
+    payloads.push_back(string());
+    payloads.back().swap(stored);
+    totalSize += payloads.back().size();
 
     infos.push_back(info);
     hashToIx[info.hash] = infos.size()-1;
@@ -150,10 +189,11 @@ void PfTransaction::commit()
 // stored length + offset
 #define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
 
-Packfile::Packfile(const string &filename, packid_t id)
-    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0)
+Packfile::Packfile(const string &filename, packid_t id, bool create)
+    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0),
+      groupCommit(false), dirty(false)
 {
-    fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    fd = ::open(filename.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
     if (fd < 0) {
         perror("Packfile open");
         throw SystemException();
@@ -176,6 +216,12 @@ Packfile::~Packfile()
         close(fd);
 }
 
+packid_t
+Packfile::getPackfileID() const
+{
+    return packid;
+}
+
 bool Packfile::full() const
 {
     return numObjects >= PACKFILE_MAXOBJS ||
@@ -183,20 +229,78 @@ bool Packfile::full() const
 }
 
 PfTransaction::sp
-Packfile::begin(Index *idx)
+Packfile::begin(Index *idx, const ZipPolicy &policy)
 {
-    return PfTransaction::sp(new PfTransaction(this, idx));
+    return PfTransaction::sp(new PfTransaction(this, idx, policy));
+}
+
+static struct iovec
+_makeIovec(const string &buf)
+{
+    struct iovec v;
+
+    v.iov_base = (void *)buf.data();
+    v.iov_len = buf.size();
+    return v;
+}
+
+/*
+ * Write all of the buffers in iov, restarting after short writes.
+ */
+static void
+_writeVector(int fd, vector<struct iovec> &iov)
+{
+    size_t i = 0;
+
+    while (i < iov.size()) {
+        int cnt = (int)min(iov.size() - i, (size_t)IOV_MAX);
+        ssize_t n = ::writev(fd, &iov[i], cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw SystemException();
+        }
+
+        // Skip the buffers that were fully written
+        while (i < iov.size() && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if (n > 0) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
 }
 
 void
 Packfile::commit(PfTransaction *t, Index *idx)
+{
+    vector<IndexEntry> entries = append(t);
+
+    // Payloads must be durable before the index refers to them
+    if (!groupCommit)
+        sync();
+
+    idx->updateEntries(entries);
+}
+
+vector<IndexEntry>
+Packfile::append(PfTransaction *t)
 {
     if (t->infos.size() != t->payloads.size()) {
         throw runtime_error("PfTransaction infos.size() != payloads.size())");
     }
 
+    vector<IndexEntry> entries;
+
+    // An empty group would only add a header for readers to skip
+    if (t->infos.size() == 0) {
+        t->committed = true;
+        return entries;
+    }
+
     lseek(fd, 0, SEEK_END);
-    vector<offset_t> offsets;
     size_t headers_size = t->infos.size() * ENTRYSIZE;
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     
@@ -209,145 +313,171 @@ Packfile::commit(PfTransaction *t, Index *idx)
         ASSERT(sizeof(uint32_t) == sizeof(offset_t));
         headers_ss.writeUInt32(off);
 
-        offsets.push_back(off);
-        off += t->payloads[i].size();
-    }
-
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
-
-    for (size_t i = 0; i < t->payloads.size(); i++) {
-        write(fd, t->payloads[i].data(), t->payloads[i].size());
-        fileSize += t->payloads[i].size();
-        numObjects++;
-
         IndexEntry ie;
         ie.info = t->infos[i];
-        ie.offset = offsets[i];
+        ie.offset = off;
         ie.packed_size = t->payloads[i].size();
         ie.packfile = packid;
+        entries.push_back(ie);
+
+        off += t->payloads[i].size();
+    }
 
-        idx->updateEntry(ie.info.hash, ie);
+    // Gather the headers and payloads into a single write
+    const string &headers = headers_ss.str();
+    vector<struct iovec> iov;
+    iov.reserve(t->payloads.size() + 1);
+    iov.push_back(_makeIovec(headers));
+    for (size_t i = 0; i < t->payloads.size(); i++) {
+        if (t->payloads[i].size() == 0)
+            continue;
+        iov.push_back(_makeIovec(t->payloads[i]));
     }
+    _writeVector(fd, iov);
 
-    ::fsync(fd);
+    fileSize = off;
+    numObjects += t->infos.size();
+    dirty = true;
     t->committed = true;
+
+    return entries;
 }
 
-bytestream *Packfile::getPayload(const IndexEntry &entry)
+void
+Packfile::setGroupCommit(bool enable)
 {
-    ASSERT(entry.packfile == packid);
-    bytestream *stored = new fdstream(fd, entry.offset, entry.packed_size);
-   
-    switch (entry.info.getAlgo()) {
-        case ObjectInfo::ZIPALGO_NONE:
-            return stored;
-        case ObjectInfo::ZIPALGO_FASTLZ:
-            return new zipstream(stored, DECOMPRESS, entry.info.payload_size);
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
-    }
-    return 0;
+    groupCommit = enable;
+    if (!enable)
+        sync();
 }
 
-bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
+bool
+Packfile::isDirty() const
 {
-    PfTransaction::sp tr = begin(idx);
-    
-    // Read the current contents
-    lseek(fd, 0, SEEK_SET);
-    vector<uint32_t> storedSizes;
-
-    fdstream fs(fd, 0);
-    while (!fs.ended()) {
-        string payload;
-        set<size_t> skip;
-
-        numobjs_t num;
-        try {
-            num = fs.readUInt32();
-        } catch (ios_base::failure &e) {
-            break;
-        }
-
-        storedSizes.resize(num);
-
-        // Read headers
-        for (size_t i = 0; i < num; i++) {
-            ObjectInfo info;
-            fs.readInfo(info);
-            uint32_t ssize = fs.readUInt32();
-            offset_t off = fs.readUInt32();
-            (void)off;
+    return dirty;
+}
 
-            storedSizes[i] = ssize;
+void
+Packfile::sync()
+{
+    if (dirty) {
+        ::fsync(fd);
+        dirty = false;
+    }
+}
 
-            if (hset.find(info.hash) != hset.end()) {
-                skip.insert(i);
-            }
-            else {
-                tr->infos.push_back(info);
-            }
-        }
+bytestream *Packfile::getPayload(const IndexEntry &entry)
+{
+    ASSERT(entry.packfile == packid);
+    if (entry.info.isFramed()) {
+        return new framedstream(fd, entry.offset, entry.packed_size,
+                                entry.info.getAlgo(), entry.info.payload_size);
+    }
 
-        // Read payloads
-        for (size_t i = 0; i < num; i++) {
-            payload.resize(storedSizes[i]);
-            fs.read((uint8_t*)&payload[0], storedSizes[i]);
+    bytestream *stored = new pfdstream(fd, entry.offset, entry.packed_size);
 
-            if (skip.find(i) != skip.end()) {
-                continue;
-            }
+    return ZipCodec_Decode(stored, entry.info);
+}
 
-            tr->payloads.push_back(payload);
-        }
+bytestream *Packfile::getPayload(const IndexEntry &entry, size_t offset)
+{
+    ASSERT(entry.packfile == packid);
+    ASSERT(offset <= entry.info.payload_size);
+
+    if (entry.info.isFramed()) {
+        framedstream *fs = new framedstream(fd, entry.offset,
+                                            entry.packed_size,
+                                            entry.info.getAlgo(),
+                                            entry.info.payload_size);
+        fs->seek(offset);
+        return fs;
+    }
+    if (entry.info.getAlgo() == ObjectInfo::ZIPALGO_NONE) {
+        return new pfdstream(fd, entry.offset + offset,
+                             entry.packed_size - offset);
     }
 
-    // Make a tempfile
-    string tmpFilename = filename + ".tmp";
-    int oldFd = fd;
-    fd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("Packfile::purge open");
-        throw SystemException();
+    // Unframed objects have to be decoded from the start
+    bytestream *bs = getPayload(entry);
+    vector<uint8_t> buf(min(offset, (size_t)COPYFILE_BUFSZ));
+    while (offset > 0) {
+        size_t len = min(offset, buf.size());
+        if (!bs->readExact(&buf[0], len))
+            break;
+        offset -= len;
     }
+    return bs;
+}
 
-    ::close(oldFd);
-    OriFile_Rename(tmpFilename, filename);
+void
+Packfile::readStored(const IndexEntry &entry, string &stored)
+{
+    ASSERT(entry.packfile == packid);
 
-    // Commit the transaction
-    bool empty = tr->payloads.size() == 0;
-    tr.reset();
+    stored.resize(entry.packed_size);
+    if (entry.packed_size == 0)
+        return;
 
-    return empty;
+    pfdstream ps(fd, entry.offset, entry.packed_size);
+    if (!ps.readExact((uint8_t *)&stored[0], entry.packed_size)) {
+        throw SystemException(ps.errnum());
+    }
 }
 
-void
-Packfile::readEntries(ReadEntryCb cb, void *arg)
+/*
+ * Walk the group headers.  The size is taken from the file rather than
+ * fileSize, which is stale for a reader opened while the packfile was still
+ * being written.
+ */
+vector<IndexEntry>
+Packfile::getEntries()
 {
+    vector<IndexEntry> entries;
     offset_t groupOffset = 0;
-    
-    while (groupOffset < fileSize) {
-        fdstream readStream(fd, groupOffset);
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0) {
+        perror("Packfile fstat");
+        throw SystemException();
+    }
+
+    while (groupOffset < (size_t)sb.st_size) {
+        pfdstream readStream(fd, groupOffset);
         numobjs_t objs = readStream.readUInt32();
 
+        // Empty transactions used to write a bare header
+        if (objs == 0) {
+            groupOffset += sizeof(numobjs_t);
+            continue;
+        }
+
         for (size_t i = 0; i < objs; i++) {
-            ObjectInfo info;
-            uint32_t size;
-            offset_t off;
+            IndexEntry entry;
 
             ASSERT(sizeof(offset_t) == sizeof(uint32_t));
 
-            readStream.readInfo(info);
-            size = readStream.readUInt32();
-            off = readStream.readUInt32();
-            cb(info, off, arg);
+            readStream.readInfo(entry.info);
+            entry.packed_size = readStream.readUInt32();
+            entry.offset = readStream.readUInt32();
+            entry.packfile = packid;
+            entries.push_back(entry);
 
-            ASSERT(groupOffset <= size + off);
-            groupOffset = size + off;
+            ASSERT(groupOffset <= entry.packed_size + entry.offset);
+            groupOffset = entry.packed_size + entry.offset;
         }
     }
+
+    return entries;
+}
+
+void
+Packfile::readEntries(ReadEntryCb cb, void *arg)
+{
+    vector<IndexEntry> entries = getEntries();
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        cb(entries[i].info, entries[i].offset, arg);
+    }
 }
 
 bool
@@ -356,13 +486,42 @@ _offsetCmp(const IndexEntry &ie1, const IndexEntry &ie2)
     return ie1.offset < ie2.offset;
 }
 
-void
+size_t
 Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
 {
     DLOG("packfile transmit");
+    PfTransmitStream ts(fd, objects);
+    vector<uint8_t> buf(MIN(ts.sizeHint(), (size_t)TRANSMIT_BUFSIZE));
+
+    while (!ts.ended()) {
+        size_t len = ts.read(&buf[0], buf.size());
+        if (ts.error()) {
+            throw SystemException(ts.errnum());
+        }
+        bs->write(&buf[0], len);
+    }
+    ASSERT(!bs->error());
+
+    return ts.runs();
+}
+
+PfTransmitStream *
+Packfile::transmitStream(const vector<IndexEntry> &objects)
+{
+    return new PfTransmitStream(fd, objects);
+}
+
+
+/*
+ * PfTransmitStream
+ */
+
+PfTransmitStream::PfTransmitStream(int fd, vector<IndexEntry> objects)
+    : fd(fd), size(0), pos(0), curr(0), off(0)
+{
     // Find contiguous blocks
     sort(objects.begin(), objects.end(), _offsetCmp);
-    map<offset_t, offset_t> blocks;
+    map<offset_t, offset_t> blockMap;
     for (size_t i = 0; i < objects.size(); i++) {
         offset_t offset = objects[i].offset;
         offset_t off_end = offset + objects[i].packed_size;
@@ -371,36 +530,36 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
             continue;
         }
 
-        if (blocks.size() == 0) {
-            blocks[offset] = off_end;
+        if (blockMap.size() == 0) {
+            blockMap[offset] = off_end;
         }
         else {
-            map<offset_t, offset_t>::iterator it = blocks.upper_bound(offset);
-            if (it == blocks.begin()) {
-                blocks[offset] = off_end;
+            map<offset_t, offset_t>::iterator it = blockMap.upper_bound(offset);
+            if (it == blockMap.begin()) {
+                blockMap[offset] = off_end;
             }
             else {
                 it--;
                 if ((*it).second == offset) {
                     offset = (*it).first;
-                    blocks[offset] = off_end;
+                    blockMap[offset] = off_end;
                 }
                 else {
-                    blocks[offset] = off_end;
+                    blockMap[offset] = off_end;
                 }
             }
             
             // Fix the rest of the array
-            while (blocks.find(off_end) != blocks.end()) {
+            while (blockMap.find(off_end) != blockMap.end()) {
                 offset_t off_end_old = off_end;
-                off_end = blocks[off_end_old];
-                blocks.erase(off_end_old);
-                blocks[offset] = off_end;
+                off_end = blockMap[off_end_old];
+                blockMap.erase(off_end_old);
+                blockMap[offset] = off_end;
             }
         }
     }
 
-    // Transmit object infos
+    // Object infos
     unordered_set<ObjectHash> includedHashes;
     numobjs_t totalObjs = 0;
 
@@ -417,47 +576,96 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
         string info_str = objects[i].info.toString();
         infos_ss.write(info_str.data(), info_str.size());
         infos_ss.writeUInt32(objects[i].packed_size);
-
-        //fprintf(stderr, "Obj %lu packed size %u\n", i, objects[i].packed_size);
     }
 
     ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
-    bs->writeUInt32(totalObjs);
-    bs->write(infos_ss.str().data(), infos_ss.str().size());
-
-    // Transmit objects
-    vector<uint8_t> buf;
-    for (map<offset_t, offset_t>::iterator it = blocks.begin();
-            it != blocks.end();
+    strwstream header_ss;
+    header_ss.writeUInt32(totalObjs);
+    header_ss.write(infos_ss.str().data(), infos_ss.str().size());
+    header = header_ss.str();
+    size = header.size();
+
+    for (map<offset_t, offset_t>::iterator it = blockMap.begin();
+            it != blockMap.end();
             it++) {
-        lseek(fd, (*it).first, SEEK_SET);
-	ASSERT((*it).second >= (*it).first);
-        ssize_t len = (*it).second - (*it).first;
-        buf.resize(len);
-        ssize_t n = read(fd, &buf[0], len);
-        if (n < 0 || n != len) {
-            throw SystemException();
+        ASSERT((*it).second >= (*it).first);
+        blocks.push_back(*it);
+        size += (*it).second - (*it).first;
+    }
+}
+
+bool
+PfTransmitStream::ended()
+{
+    return pos == size || error();
+}
+
+size_t
+PfTransmitStream::read(uint8_t *buf, size_t n)
+{
+    size_t total = 0;
+
+    if (pos < header.size()) {
+        total = MIN(n, header.size() - pos);
+        memcpy(buf, header.data() + pos, total);
+        pos += total;
+    }
+
+    while (total < n && curr < blocks.size()) {
+        offset_t start = blocks[curr].first + off;
+        size_t len = MIN(n - total, (size_t)(blocks[curr].second - start));
+        ssize_t status = ::pread(fd, buf + total, len, start);
+
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            setErrno("pread");
+            return total;
+        }
+        if (status == 0) {
+            errno = EIO;
+            setErrno("Packfile truncated");
+            return total;
         }
-        ASSERT(n == len);
-        //fprintf(stderr, "Wrote block size %ld\n", len);
 
-        bs->write(&buf[0], len);
+        total += status;
+        pos += status;
+        off += status;
+        if (blocks[curr].first + off == blocks[curr].second) {
+            curr++;
+            off = 0;
+        }
     }
-    ASSERT(!bs->error());
+
+    return total;
+}
+
+size_t
+PfTransmitStream::sizeHint() const
+{
+    return size;
+}
+
+size_t
+PfTransmitStream::runs() const
+{
+    return blocks.size();
 }
 
 
 bool
-Packfile::receive(bytestream *bs, Index *idx)
+Packfile::receive(bytestream *bs, Index *idx, ObjectPipeline *verifier)
 {
     ASSERT(sizeof(uint32_t) == sizeof(numobjs_t));
     numobjs_t num = bs->readUInt32();
     if (num == 0) return false;
 
+    size_t oldSize = fileSize;
     lseek(fd, 0, SEEK_END);
     size_t headers_size = num * ENTRYSIZE;
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     vector<size_t> obj_sizes;
+    vector<IndexEntry> entries;
     
     strwstream headers_ss;
     ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
@@ -469,6 +677,14 @@ Packfile::receive(bytestream *bs, Index *idx)
         info.fromString(info_str);
         //info.print();
 
+        // Payloads are stored as received, refuse codecs we cannot read back
+        if (info.getAlgo() != ObjectInfo::ZIPALGO_NONE &&
+            ZipCodec_Get(info.getAlgo()) == NULL) {
+            WARNING("Received object %s with unsupported codec %s",
+                    info.hash.hex().c_str(), ZipCodec_Name(info.getAlgo()));
+            throw runtime_error("Received object with unsupported codec");
+        }
+
         uint32_t obj_size = bs->readUInt32();
         obj_sizes.push_back(obj_size);
 
@@ -478,7 +694,7 @@ Packfile::receive(bytestream *bs, Index *idx)
         headers_ss.writeUInt32(off);
 
         IndexEntry ie = {info, off, obj_size, packid};
-        idx->updateEntry(info.hash, ie);
+        entries.push_back(ie);
 
         off += obj_size;
     }
@@ -495,8 +711,34 @@ Packfile::receive(bytestream *bs, Index *idx)
         write(fd, &data[0], obj_sizes[i]);
         fileSize += obj_sizes[i];
         numObjects++;
+
+        if (verifier != NULL) {
+            verifier->verify(entries[i].info, data.data(), obj_sizes[i]);
+        }
+    }
+
+    // Drop the objects if any of them is corrupt, nothing refers to them yet
+    if (verifier != NULL) {
+        verifier->drain();
+        if (!verifier->ok()) {
+            verifier->reset();
+            if (::ftruncate(fd, oldSize) < 0) {
+                perror("ftruncate");
+            }
+            fileSize = oldSize;
+            numObjects -= num;
+            throw runtime_error("Received corrupt objects");
+        }
+    }
+
+    if (groupCommit) {
+        dirty = true;
+    } else {
+        ::fsync(fd);
     }
 
+    idx->updateEntries(entries);
+
     return true;
 }
 
@@ -508,7 +750,8 @@ Packfile::receive(bytestream *bs, Index *idx)
  */
 
 PackfileManager::PackfileManager(const string &rootPath)
-    : rootPath(rootPath)
+    : rootPath(rootPath),
+      _packfileCache(PACKFILE_CACHESIZE, PACKFILE_CACHESHARDS)
 {
     if (!_loadFreeList()) {
         _recomputeFreeList();
@@ -524,14 +767,16 @@ PackfileManager::~PackfileManager()
 Packfile::sp
 PackfileManager::getPackfile(packid_t id)
 {
-    if (!_packfileCache.hasKey(id)) {
-        Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    Packfile::sp pf = _packfileCache.get(id);
 
-        _packfileCache.put(id, pf);
+    if (pf.get())
         return pf;
-    }
 
-    return _packfileCache.get(id);
+    // A removed packfile must not be recreated empty
+    pf.reset(new Packfile(_getPackfileName(id), id, false));
+    _packfileCache.put(id, pf);
+
+    return pf;
 }
 
 Packfile::sp
@@ -539,6 +784,8 @@ PackfileManager::newPackfile()
 {
     ASSERT(freeList.size() > 0);
     packid_t id = freeList[0];
+    // Drop a copy of a removed packfile with this id cached by a reader
+    _packfileCache.invalidate(id);
     Packfile::sp pf(new Packfile(_getPackfileName(id), id));
     if (freeList.size() == 1) {
         freeList[0] += 1;
@@ -549,6 +796,18 @@ PackfileManager::newPackfile()
     return pf;
 }
 
+void
+PackfileManager::removePackfile(packid_t id)
+{
+    // Readers holding the packfile keep the unlinked file open
+    OriFile_Delete(_getPackfileName(id));
+    _packfileCache.invalidate(id);
+
+    // Hand the id out before allocating new ones
+    freeList.push_front(id);
+    _writeFreeList();
+}
+
 bool
 PackfileManager::hasPackfile(packid_t id)
 {
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Packfile stress test: reads random objects from a packfile using many
+ * threads and verifies each payload against its hash.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/thread.h>
+#include <ori/index.h>
+#include <ori/packfile.h>
+
+using namespace std;
+
+#define TEST_OBJECTS 4096
+#define TEST_THREADS 16
+#define TEST_READS 4000
+#define TEST_TXOBJS 256
+
+class ReaderThread : public Thread
+{
+public:
+    ReaderThread(Packfile *pf, Index *idx, const vector<ObjectHash> *hashes,
+                 unsigned int seed)
+        : pf(pf), idx(idx), hashes(hashes), seed(seed), errors(0), bytes(0)
+    {
+    }
+    virtual void run()
+    {
+        for (int i = 0; i < TEST_READS; i++) {
+            const ObjectHash &hash = (*hashes)[rand_r(&seed) % hashes->size()];
+            IndexEntry ie = idx->getEntry(hash);
+            bytestream::ap bs(pf->getPayload(ie));
+            string payload = bs->readAll();
+
+            if (OriCrypt_HashString(payload) != hash) {
+                errors++;
+            }
+            bytes += payload.size();
+
+            // Mix in transmits of a few neighbouring objects
+            if (i % 64 == 0) {
+                vector<IndexEntry> objs;
+                strwstream ss;
+
+                for (int j = 0; j < 8; j++) {
+                    size_t ix = rand_r(&seed) % hashes->size();
+                    objs.push_back(idx->getEntry((*hashes)[ix]));
+                }
+                pf->transmit(&ss, objs);
+                if (ss.error())
+                    errors++;
+            }
+        }
+    }
+    Packfile *pf;
+    Index *idx;
+    const vector<ObjectHash> *hashes;
+    unsigned int seed;
+    int errors;
+    uint64_t bytes;
+};
+
+string
+randomPayload(unsigned int *seed)
+{
+    size_t len = rand_r(seed) % (64 * 1024);
+    string payload(len, '\0');
+
+    // Half of the objects are compressible
+    if (rand_r(seed) % 2 == 0) {
+        for (size_t i = 0; i < len; i++)
+            payload[i] = 'a' + (i / 32) % 26;
+        if (len > 0)
+            payload[0] = rand_r(seed) % 256;
+    } else {
+        for (size_t i = 0; i < len; i++)
+            payload[i] = rand_r(seed) % 256;
+    }
+
+    return payload;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char tmpl[] = "/tmp/packfile_test.XXXXXX";
+    unsigned int seed = 42;
+    vector<ObjectHash> hashes;
+    int errors = 0;
+    uint64_t bytes = 0;
+
+    if (mkdtemp(tmpl) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    string dir = tmpl;
+    Index idx;
+    Packfile pf(dir + "/pack0.pak", 0);
+
+    idx.open(dir + "/index");
+
+    // Populate the packfile
+    PfTransaction::sp tr = pf.begin(&idx);
+    for (int i = 0; i < TEST_OBJECTS; i++) {
+        string payload = randomPayload(&seed);
+        ObjectInfo info(OriCrypt_HashString(payload));
+
+        if (tr->has(info.hash))
+            continue;
+
+        info.type = ObjectInfo::Blob;
+        info.payload_size = payload.size();
+        tr->addPayload(info, payload);
+        hashes.push_back(info.hash);
+
+        if (tr->infos.size() >= TEST_TXOBJS) {
+            tr->commit();
+            tr = pf.begin(&idx);
+        }
+    }
+    tr.reset();
+
+    // Read it back from many threads
+    vector<ReaderThread *> threads;
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+
+    for (int i = 0; i < TEST_THREADS; i++) {
+        threads.push_back(new ReaderThread(&pf, &idx, &hashes, i + 1));
+        threads.back()->start();
+    }
+    for (int i = 0; i < TEST_THREADS; i++) {
+        threads[i]->wait();
+        errors += threads[i]->errors;
+        bytes += threads[i]->bytes;
+        delete threads[i];
+    }
+
+    gettimeofday(&end, 0);
+
+    float tDiff = end.tv_sec - start.tv_sec;
+    tDiff += (float)(end.tv_usec - start.tv_usec) / 1000000.0;
+
+    printf("Threads %d, Reads %d, Errors %d\n", TEST_THREADS,
+           TEST_THREADS * TEST_READS, errors);
+    printf("Time %3.3f, Speed %3.2fMB/s\n", tDiff,
+           bytes / (1024.0 * 1024.0) / tDiff);
+
+    idx.close();
+    unlink((dir + "/index").c_str());
+    unlink((dir + "/pack0.pak").c_str());
+    rmdir(dir.c_str());
+
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <set>
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+#include <condition_variable>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/rwlock.h>
+#include <ori/index.h>
+#include <ori/packfile.h>
+#include <ori/commit.h>
+#include <ori/tree.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/repacker.h>
+
+using namespace std;
+
+struct Repacker::Traversal
+{
+    // Packfiles being rewritten
+    set<packid_t> packs;
+    unordered_set<ObjectHash> seen;
+    // Objects to copy in the order they are visited
+    vector<IndexEntry> order;
+};
+
+Repacker::Repacker(LocalRepo *repo, RWLock *lock)
+    : Thread("Repacker"), repo(repo), lock(lock), minDead(REPACK_MINDEAD),
+      rate(REPACK_RATE), exiting(false)
+{
+}
+
+Repacker::~Repacker()
+{
+}
+
+void
+Repacker::setMinDead(float ratio)
+{
+    minDead = ratio;
+}
+
+void
+Repacker::setRate(size_t bytesPerSec)
+{
+    rate = bytesPerSec;
+}
+
+size_t
+Repacker::repack()
+{
+    vector<packid_t> ids;
+    size_t removed = 0;
+
+    {
+        RWKey::sp key = readLock();
+        RWKey::sp store = repo->storeLock.readLock();
+        ids = repo->packfiles->getPackfileList();
+    }
+    sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size() && !stopping(); i++) {
+        vector<IndexEntry> live;
+
+        if (!scan(ids[i], &live))
+            continue;
+        if (copy(live) && remove(ids[i]))
+            removed++;
+    }
+
+    return removed;
+}
+
+size_t
+Repacker::reorder()
+{
+    Traversal t;
+    vector<packid_t> ids;
+    vector<Commit> commits;
+    size_t removed = 0;
+
+    {
+        RWKey::sp key = readLock();
+        {
+            RWKey::sp store = repo->storeLock.readLock();
+            ids = repo->packfiles->getPackfileList();
+            for (size_t i = 0; i < ids.size(); i++) {
+                if (isEligible(ids[i]))
+                    t.packs.insert(ids[i]);
+            }
+        }
+        commits = repo->listCommits();
+    }
+
+    // Newest snapshots first, they are read the most
+    for (vector<Commit>::reverse_iterator it = commits.rbegin();
+            it != commits.rend();
+            it++) {
+        if (visitObject((*it).hash(), &t))
+            visitTree((*it).getTree(), &t);
+    }
+
+    // Objects not reachable from a snapshot keep their order at the end
+    for (set<packid_t>::iterator it = t.packs.begin();
+            it != t.packs.end();
+            it++) {
+        Packfile::sp pack = repo->packfiles->getPackfile(*it);
+        vector<IndexEntry> entries = pack->getEntries();
+        RWKey::sp key = readLock();
+        RWKey::sp store = repo->storeLock.readLock();
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (t.seen.find(entries[i].info.hash) != t.seen.end())
+                continue;
+            if (isLive(entries[i])) {
+                t.seen.insert(entries[i].info.hash);
+                t.order.push_back(entries[i]);
+            }
+        }
+    }
+
+    if (!copy(t.order))
+        return 0;
+
+    for (set<packid_t>::iterator it = t.packs.begin();
+            it != t.packs.end();
+            it++) {
+        if (remove(*it))
+            removed++;
+    }
+
+    return removed;
+}
+
+void
+Repacker::run()
+{
+    uint64_t seen = 0;
+    bool first = true;
+
+    while (!stopping()) {
+        uint64_t purges;
+
+        {
+            RWKey::sp key = readLock();
+            purges = repo->purgeCount;
+        }
+
+        // The first pass finishes the work of an earlier process
+        if (first || purges != seen) {
+            try {
+                size_t removed = repack();
+                if (removed > 0)
+                    LOG("Repacker: removed %zu packfiles", removed);
+                seen = purges;
+                first = false;
+            } catch (exception &e) {
+                WARNING("Repacker: %s", e.what());
+            }
+        }
+
+        unique_lock<mutex> l(stopLock);
+        if (!exiting)
+            stopCV.wait_for(l, chrono::seconds(REPACK_INTERVAL));
+    }
+
+    output.reset();
+}
+
+void
+Repacker::stop()
+{
+    {
+        unique_lock<mutex> l(stopLock);
+        exiting = true;
+    }
+    stopCV.notify_all();
+
+    wait();
+}
+
+/*
+ * Find the live objects of a packfile.  @returns false if the packfile is
+ * still being written or not worth compacting.
+ */
+bool
+Repacker::scan(packid_t id, vector<IndexEntry> *live)
+{
+    RWKey::sp key = readLock();
+    RWKey::sp store = repo->storeLock.readLock();
+    vector<IndexEntry> entries;
+    size_t liveBytes = 0;
+    size_t deadBytes = 0;
+
+    if (!isEligible(id))
+        return false;
+
+    entries = repo->packfiles->getPackfile(id)->getEntries();
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (isLive(entries[i])) {
+            live->push_back(entries[i]);
+            liveBytes += entries[i].packed_size;
+        } else {
+            deadBytes += entries[i].packed_size;
+        }
+    }
+
+    // Packfiles without live objects are removed without copying
+    if (live->empty())
+        return true;
+    if (deadBytes == 0)
+        return false;
+
+    return (float)deadBytes / (float)(deadBytes + liveBytes) >= minDead;
+}
+
+/*
+ * Packfiles still being written are left alone.  The caller holds the lock
+ * and the repository's storeLock.
+ */
+bool
+Repacker::isEligible(packid_t id)
+{
+    if (repo->currPackfile.get() &&
+        repo->currPackfile->getPackfileID() == id)
+        return false;
+    if (output.get() && output->getPackfileID() == id)
+        return false;
+
+    return repo->packfiles->hasPackfile(id);
+}
+
+/*
+ * Copy the objects to the output packfile in order and point the index at
+ * the copies.  @returns false if stopped before all objects were copied.
+ */
+bool
+Repacker::copy(const vector<IndexEntry> &live)
+{
+    size_t i = 0;
+
+    while (i < live.size()) {
+        vector<IndexEntry> batch;
+        vector<IndexEntry> copies;
+        size_t bytes = 0;
+
+        if (stopping())
+            return false;
+
+        if (!output.get() || output->full()) {
+            RWKey::sp key = writeLock();
+            RWKey::sp store = repo->storeLock.writeLock();
+            output = repo->packfiles->newPackfile();
+        }
+
+        // Nothing else writes the output or deletes packfiles, so copying
+        // does not need the lock
+        PfTransaction::sp tr = output->begin(NULL);
+        while (i < live.size() && !tr->full() &&
+               (batch.empty() ||
+                bytes + live[i].packed_size <= REPACK_BATCHBYTES)) {
+            Packfile::sp pack = repo->packfiles->getPackfile(live[i].packfile);
+            string stored;
+
+            pack->readStored(live[i], stored);
+            tr->addStored(live[i].info, stored);
+            batch.push_back(live[i]);
+            bytes += live[i].packed_size;
+            i++;
+        }
+        copies = output->append(tr.get());
+        output->sync();
+
+        {
+            RWKey::sp key = writeLock();
+            RWKey::sp store = repo->storeLock.writeLock();
+            vector<IndexEntry> moved;
+
+            // Objects purged during the copy leave a dead copy behind
+            for (size_t j = 0; j < batch.size(); j++) {
+                if (isLive(batch[j]))
+                    moved.push_back(copies[j]);
+            }
+            repo->index.relocateEntries(moved);
+        }
+
+        throttle(bytes);
+    }
+
+    return true;
+}
+
+/*
+ * Delete a packfile once the index no longer refers to it.
+ */
+bool
+Repacker::remove(packid_t id)
+{
+    // Nothing is added to the packfile, its headers can be read unlocked
+    vector<IndexEntry> entries = repo->packfiles->getPackfile(id)->getEntries();
+    RWKey::sp key = writeLock();
+
+    {
+        RWKey::sp store = repo->storeLock.readLock();
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (isLive(entries[i]))
+                return false;
+        }
+    }
+
+    // The relocated entries must be durable before the packfile goes away
+    repo->sync();
+    RWKey::sp store = repo->storeLock.writeLock();
+    repo->index.sync();
+    repo->packfiles->removePackfile(id);
+
+    return true;
+}
+
+/*
+ * An object is live while the index refers to this copy of it.  Purged
+ * objects (see LocalRepo::purgeObject) and duplicates are dead.  The caller
+ * holds the repository's storeLock.
+ */
+bool
+Repacker::isLive(const IndexEntry &entry)
+{
+    if (!repo->index.hasObject(entry.info.hash))
+        return false;
+
+    IndexEntry current = repo->index.getEntry(entry.info.hash);
+
+    return current.packfile == entry.packfile &&
+           current.offset == entry.offset;
+}
+
+/*
+ * Add an object to the traversal if it is in a packfile being rewritten.
+ * @returns true the first time a locally stored object is visited.
+ */
+bool
+Repacker::visitObject(const ObjectHash &hash, Traversal *t)
+{
+    RWKey::sp key = readLock();
+    RWKey::sp store = repo->storeLock.readLock();
+
+    if (!t->seen.insert(hash).second)
+        return false;
+    if (!repo->index.hasObject(hash))
+        return false;
+
+    IndexEntry entry = repo->index.getEntry(hash);
+    if (t->packs.find(entry.packfile) != t->packs.end())
+        t->order.push_back(entry);
+
+    return true;
+}
+
+void
+Repacker::visitTree(const ObjectHash &hash, Traversal *t)
+{
+    vector<ObjectHash> subtrees;
+    Tree tree;
+
+    if (!visitObject(hash, t))
+        return;
+
+    {
+        RWKey::sp key = readLock();
+        tree = repo->getTree(hash);
+    }
+
+    // Files go right after their directory and subdirectories follow
+    for (map<string, TreeEntry>::iterator it = tree.tree.begin();
+            it != tree.tree.end();
+            it++) {
+        const TreeEntry &te = (*it).second;
+
+        if (te.type == TreeEntry::Tree) {
+            subtrees.push_back(te.hash);
+        } else if (te.type == TreeEntry::LargeBlob) {
+            visitLargeBlob(te.hash, t);
+        } else {
+            visitObject(te.hash, t);
+        }
+    }
+
+    for (size_t i = 0; i < subtrees.size(); i++) {
+        visitTree(subtrees[i], t);
+    }
+}
+
+void
+Repacker::visitLargeBlob(const ObjectHash &hash, Traversal *t)
+{
+    LargeBlob lb(repo);
+
+    if (!visitObject(hash, t))
+        return;
+
+    {
+        RWKey::sp key = readLock();
+        lb.fromBlob(repo->getPayload(hash));
+    }
+
+    // Chunks in file order
+    for (vector<LBlobEntry>::iterator it = lb.parts.begin();
+            it != lb.parts.end();
+            it++) {
+        visitObject((*it).hash, t);
+    }
+}
+
+RWKey::sp
+Repacker::readLock()
+{
+    if (lock == NULL)
+        return RWKey::sp();
+    return lock->readLock();
+}
+
+RWKey::sp
+Repacker::writeLock()
+{
+    if (lock == NULL)
+        return RWKey::sp();
+    return lock->writeLock();
+}
+
+/*
+ * Sleep long enough to keep the copy rate at the limit.
+ */
+void
+Repacker::throttle(size_t bytes)
+{
+    if (rate == 0)
+        return;
+
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+        chrono::microseconds((uint64_t)bytes * 1000000 / rate);
+    unique_lock<mutex> l(stopLock);
+
+    while (!exiting) {
+        if (stopCV.wait_until(l, deadline) == cv_status::timeout)
+            break;
+    }
+}
+
+bool
+Repacker::stopping()
+{
+    unique_lock<mutex> l(stopLock);
+
+    return exiting;
+}
+
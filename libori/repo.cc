@@ -32,6 +32,7 @@
 
 #include <ori/object.h>
 #include <ori/largeblob.h>
+#include <ori/objectpipeline.h>
 #include <ori/repo.h>
 
 using namespace std;
@@ -75,6 +76,31 @@ Repo::hasObjects(const ObjectHashVec &ids)
     return rval;
 }
 
+int
+Repo::getObjectsStreams()
+{
+    return 1;
+}
+
+bool
+Repo::isObjectStored(const ObjectHash &id)
+{
+    return false;
+}
+
+bool
+Repo::encodeObject(ObjectInfo &info, const string &payload, string &stored)
+{
+    return false;
+}
+
+int
+Repo::addEncodedObject(const ObjectInfo &info, string &stored)
+{
+    NOT_IMPLEMENTED(false);
+    return -1;
+}
+
 /*
  * High-level operations
  */
@@ -122,22 +148,27 @@ Repo::addSmallFile(const string &path)
  * Add a file to the repository. This is a low-level interface.
  */
 pair<ObjectHash, ObjectHash>
-Repo::addLargeFile(const string &path)
+Repo::addLargeFile(const string &path, ObjectPipeline *pipe)
 {
     string blob;
     string hash;
     LargeBlob lb = LargeBlob(this);
 
-    lb.chunkFile(path);
+    if (pipe != NULL) {
+        lb.chunkFile(path, pipe);
+    } else {
+        ObjectPipeline localPipe(this);
+        lb.chunkFile(path, &localPipe);
+    }
     blob = lb.getBlob();
 
     // TODO: this should only be called when committing,
     // we'll take care of backrefs then
     /*if (!hasObject(hash)) {
-        map<uint64_t, LBlobEntry>::iterator it;
+        vector<LBlobEntry>::iterator it;
 
         for (it = lb.parts.begin(); it != lb.parts.end(); it++) {
-            addBackref((*it).second.hash);
+            addBackref((*it).hash);
         }
     }*/
 
@@ -159,6 +190,25 @@ Repo::addFile(const string &path)
         return make_pair(addSmallFile(path), ObjectHash());
 }
 
+void
+Repo::addFile(const string &path, ObjectPipeline *pipe,
+              ObjectHash *hash, ObjectHash *largeHash)
+{
+    size_t sz = OriFile_GetSize(path);
+
+    if (sz > LARGEFILE_MINIMUM) {
+        pair<ObjectHash, ObjectHash> hashes = addLargeFile(path, pipe);
+        *hash = hashes.first;
+        *largeHash = hashes.second;
+    } else {
+        diskstream ds(path);
+        string blob = ds.readAll();
+
+        *largeHash = ObjectHash();
+        pipe->add(ObjectInfo::Blob, blob, hash);
+    }
+}
+
 
 
 
@@ -279,6 +329,12 @@ Repo::receive(bytestream *bs)
     NOT_IMPLEMENTED(false);
 }
 
+bytestream *
+Repo::getMissingObjects(const ObjectHashVec &haves)
+{
+    return NULL;
+}
+
 set<string>
 Repo::listExt()
 {
@@ -30,7 +30,9 @@ private:
     //uint64_t hashLen;
     uint64_t b;
     uint64_t bTok;
-    uint8_t lut[256];
+    // Weight of a byte leaving the window, cut points only depend on the
+    // last hashLen bytes
+    uint64_t lut[256];
 };
 
 //#define b (31)
@@ -45,7 +47,7 @@ RKChunker<target, min, max>::RKChunker()
     //hashLen = 32;
     b = 31;
 
-    for (int i = 0; i < hashLen; i++) {
+    for (int i = 0; i < hashLen - 1; i++) {
         bTon *= b;
     }
 
@@ -89,8 +91,11 @@ fastPath:
 
         for (; off < start + max && off < len; off++) {
             hash = (hash - lut[in[off-hashLen]]) * b + in[off];
-            if (hash % target == 1)
+            // Cut after the byte, it must not be hashed twice
+            if (hash % target == 1) {
+                off++;
                 break;
+            }
         }
 
         cb->match(in + start, off - start);
@@ -102,12 +107,13 @@ fastPath:
         goto fastPath;
     }
 
+    // Cut as the fast path does, the cuts do not depend on where it stops
     for (; off < len; off++) {
         hash = (hash - lut[in[off-hashLen]]) * b + in[off];
-        if (((off - start > min) && (hash % target == 1))
-                || (off - start >= max)) {
-            cb->match(in + start, off - start);
-            start = off;
+        if (((off - start >= min) && (hash % target == 1))
+                || (off + 1 - start >= max)) {
+            cb->match(in + start, off + 1 - start);
+            start = off + 1;
         }
     }
 
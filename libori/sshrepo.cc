@@ -32,6 +32,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/stopwatch.h>
+#include <oriutil/zipcodec.h>
 #include <ori/packfile.h>
 #include <ori/sshclient.h>
 #include <ori/sshrepo.h>
@@ -123,18 +124,13 @@ Object::sp SshRepo::getObject(const ObjectHash &id)
         num = bs->readUInt32();
         ASSERT(num == 0);
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-                break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        bytestream::ap zs(ZipCodec_Decode(new strstream(payload), info));
+        payloads[info.hash] = zs->readAll();
+        if (zs->error()) {
+            WARNING("Cannot decode object %s: %s", info.hash.hex().c_str(),
+                    zs->error());
+            payloads.erase(info.hash);
+            return Object::sp();
         }
         return Object::sp(new SshObject(this, info));
     }
@@ -162,6 +158,42 @@ SshRepo::getObjects(const ObjectHashVec &objs)
     return NULL;
 }
 
+/*
+ * Servers before protocol version 1.1 do not know getmissing and would
+ * misread the commits sent with it.
+ */
+bytestream *
+SshRepo::getMissingObjects(const ObjectHashVec &haves)
+{
+    if (protoVersion.empty()) {
+        client->sendCommand("hello");
+        bool ok = client->respIsOK();
+        bytestream::ap bs(client->getStream());
+        if (ok) {
+            bs->readPStr(protoVersion);
+        }
+    }
+    if (protoVersion.empty() || protoVersion == "1.0")
+        return NULL;
+
+    client->sendCommand("getmissing");
+
+    strwstream ss;
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
+    }
+    client->sendData(ss.str());
+    DLOG("Requesting missing objects, %lu commits known", haves.size());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (ok) {
+        return bs.release();
+    }
+    return NULL;
+}
+
 ObjectInfo
 SshRepo::getObjectInfo(const ObjectHash &id)
 {
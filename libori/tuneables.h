@@ -33,6 +33,56 @@
 #define PACKFILE_MAXSIZE (1024*1024*64)
 #define PACKFILE_MAXOBJS (2048)
 
+// Open packfiles kept by the PackfileManager
+#define PACKFILE_CACHESIZE 96
+#define PACKFILE_CACHESHARDS 4
+
+// Bytes of a transmit read from the packfile at a time
+#define TRANSMIT_BUFSIZE (256*1024)
+
+// Index log entries kept before they are merged into the sorted index
+#define INDEX_LOG_MAXENTRIES (64*1024)
+
+// Decompressed object cache (default 32 MB split across the shards)
+#define OBJCACHE_DEFAULTSIZE (32*1024*1024)
+#define OBJCACHE_SHARDS 16
+// Largest payload cached as a fraction of a shard (1/4)
+#define OBJCACHE_MAXENTRY_SHIFT 2
+
+// Object pipeline workers and the payload queued before add blocks
+#define OBJPIPE_MAXTHREADS 8
+#define OBJPIPE_MAXJOBS 4096
+#define OBJPIPE_MAXBYTES (64*1024*1024)
+
+// Objects requested at once by a pull, bounded by count and estimated size
+#define PULL_BATCHOBJS 4096
+#define PULL_BATCHBYTES (8*1024*1024)
+// Size assumed for objects of unknown size (commits and trees)
+#define PULL_OBJSIZE 1024
+// Responses a pull requests at once, counting the one being stored
+#define PULL_WINDOW 4
+// Commits sent to summarize the local history when negotiating a pull
+#define PULL_MAXHAVES 1024
+
+// Keep-alive connections an HttpClient opens to its remote
+#define HTTPCLIENT_MAXCONNS 4
+// Wait for the end of a response whose body was read in full (ms)
+#define HTTPCLIENT_ENDTIMEOUT 100
+
+// Event loops serving connections in ori_httpd
+#define HTTPD_THREADS 8
+// Interval at which server event loops check for a stop request (ms)
+#define HTTPD_CHECKINTERVAL 250
+
+// Packfiles with at least this fraction of dead bytes are compacted
+#define REPACK_MINDEAD 0.3
+// Live objects copied between index updates, bounds the repacker's memory
+#define REPACK_BATCHBYTES (4*1024*1024)
+// Default copy rate of the repacker in bytes per second
+#define REPACK_RATE (16*1024*1024)
+// Seconds between background checks for purged objects
+#define REPACK_INTERVAL 60
+
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
 //#define ORI_USE_SKEIN
@@ -40,11 +90,32 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
+// Choose the default compression codec (choose one or none)
 //#define ORI_USE_LZMA
 //#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
+//#define ORI_USE_SNAPPY
+#if defined(ORI_USE_LZMA)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_LZMA
+#elif defined(ORI_USE_SNAPPY)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_SNAPPY
+#elif defined(ORI_USE_FASTLZ)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_FASTLZ
+#else
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_NONE
+#endif
+
+// Objects of at least this size are compressed in independent blocks so they
+// can be decoded incrementally and read at any offset
+#define ZIP_FRAME_MINIMUM (128 * 1024)
+#define ZIP_FRAME_BLOCKSIZE (64 * 1024)
+
+// Blobs of at least this size are cold data and use the dense codec
+#define ZIP_DENSE_MINIMUM (64 * 1024)
+#if defined(ORI_HAVE_LZMA) && \
+    (defined(ORI_USE_FASTLZ) || defined(ORI_USE_SNAPPY))
+#define ZIPALGO_DENSE ObjectInfo::ZIPALGO_LZMA
+#else
+#define ZIPALGO_DENSE ZIPALGO_DEFAULT
 #endif
 
 #endif /* __TUNEABLES_H__ */
@@ -28,6 +28,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/stopwatch.h>
+#include <oriutil/zipcodec.h>
 #include <oriutil/runtimeexception.h>
 #include <ori/packfile.h>
 #include <ori/udsclient.h>
@@ -142,18 +143,11 @@ Object::sp UDSRepo::getObject(const ObjectHash &id)
             throw RuntimeException(ORIEC_BSCORRUPT, "Object bytestream invalid");
         }
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-                break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        bytestream::ap zs(ZipCodec_Decode(new strstream(payload), info));
+        payloads[info.hash] = zs->readAll();
+        if (zs->error()) {
+            payloads.erase(info.hash);
+            throw RuntimeException(ORIEC_BSCORRUPT, zs->error());
         }
         return Object::sp(new UDSObject(this, info));
     }
@@ -181,6 +175,42 @@ UDSRepo::getObjects(const ObjectHashVec &objs)
     return NULL;
 }
 
+/*
+ * Servers before protocol version 1.1 do not know getmissing and would
+ * misread the commits sent with it.
+ */
+bytestream *
+UDSRepo::getMissingObjects(const ObjectHashVec &haves)
+{
+    if (protoVersion.empty()) {
+        client->sendCommand("hello");
+        bool ok = client->respIsOK();
+        bytestream::ap bs(client->getStream());
+        if (ok) {
+            bs->readPStr(protoVersion);
+        }
+    }
+    if (protoVersion.empty() || protoVersion == "1.0")
+        return NULL;
+
+    client->sendCommand("getmissing");
+
+    strwstream ss;
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
+    }
+    client->sendData(ss.str());
+    DLOG("Requesting missing objects, %lu commits known", haves.size());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (ok) {
+        return bs.release();
+    }
+    return NULL;
+}
+
 ObjectInfo
 UDSRepo::getObjectInfo(const ObjectHash &id)
 {
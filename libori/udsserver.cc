@@ -251,6 +251,9 @@ UDSSession::serve() {
         else if (command == "readobjs") {
             cmd_readObjs();
         }
+        else if (command == "getmissing") {
+            cmd_getMissing();
+        }
         else if (command == "getobjinfo") {
             cmd_getObjInfo();
         }
@@ -334,6 +337,25 @@ void UDSSession::cmd_readObjs()
     repo->transmit(&fs, objs);
 }
 
+void UDSSession::cmd_getMissing()
+{
+    // Read the commits the client has
+    fdstream in(fd, -1);
+    uint32_t numHaves = in.readUInt32();
+    ObjectHashVec haves;
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+    DLOG("getMissing: %u commits known", numHaves);
+
+    bytestream::ap objs(repo->getMissingObjects(haves));
+    fdwstream fs(fd);
+    fs.writeUInt8(OK);
+    fs.copyFrom(objs.get());
+}
+
 void UDSSession::cmd_getObjInfo()
 {
     fdstream in(fd, -1);
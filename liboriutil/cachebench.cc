@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compares LRUCache and ConcurrentCache with 1 to 64 threads doing a mix of
+ * lookups and inserts on a skewed key set.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+
+#include <oriutil/stopwatch.h>
+#include <oriutil/lrucache.h>
+#include <oriutil/concurrentcache.h>
+
+using namespace std;
+
+#define CACHE_SIZE	1024
+#define KEY_SPACE	4096
+#define OPS_PER_THREAD	200000
+// One in PUT_RATIO operations is an insert
+#define PUT_RATIO	10
+
+typedef shared_ptr<string> Value;
+
+/*
+ * Most lookups go to a hot eighth of the keys.
+ */
+static uint32_t
+nextKey(uint32_t *seed)
+{
+    uint32_t r = rand_r(seed);
+
+    if (r % 4 != 0)
+        return (r >> 2) % (KEY_SPACE / 8);
+    return (r >> 2) % KEY_SPACE;
+}
+
+static void
+lruWorker(LRUCache<uint32_t, Value, CACHE_SIZE> *cache, uint32_t seed,
+          uint64_t *hits)
+{
+    Value v(new string("value"));
+    Value out;
+
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        uint32_t key = nextKey(&seed);
+
+        if (i % PUT_RATIO == 0) {
+            cache->put(key, v);
+        } else if (cache->get(key, out)) {
+            (*hits)++;
+        }
+    }
+}
+
+static void
+concurrentWorker(ConcurrentCache<uint32_t, string> *cache, uint32_t seed,
+                 uint64_t *hits)
+{
+    Value v(new string("value"));
+
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        uint32_t key = nextKey(&seed);
+
+        if (i % PUT_RATIO == 0) {
+            cache->put(key, v);
+        } else if (cache->get(key).get() != NULL) {
+            (*hits)++;
+        }
+    }
+}
+
+template <class C, class F>
+static void
+run(const char *name, int threads, F worker)
+{
+    C cache;
+    vector<thread> workers;
+    vector<uint64_t> hits(threads, 0);
+    uint64_t totalHits = 0;
+    Stopwatch sw;
+
+    sw.start();
+    for (int i = 0; i < threads; i++)
+        workers.push_back(thread(worker, &cache, i + 1, &hits[i]));
+    for (int i = 0; i < threads; i++) {
+        workers[i].join();
+        totalHits += hits[i];
+    }
+    sw.stop();
+
+    double secs = (double)sw.getElapsedTime() / 1000000.0;
+    double ops = (double)threads * OPS_PER_THREAD;
+    printf("%-16s %3d threads %10.0f ops/s %5.1f%% hits\n", name, threads,
+           ops / secs,
+           100.0 * totalHits / (ops - ops / PUT_RATIO));
+}
+
+struct LRU : public LRUCache<uint32_t, Value, CACHE_SIZE> { };
+struct Concurrent : public ConcurrentCache<uint32_t, string> {
+    Concurrent() : ConcurrentCache<uint32_t, string>(CACHE_SIZE) { }
+};
+
+int
+main(int argc, char *argv[])
+{
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        run<LRU>("LRUCache", threads, lruWorker);
+        run<Concurrent>("ConcurrentCache", threads, concurrentWorker);
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <oriutil/debug.h>
+#include <oriutil/concurrentcache.h>
+
+using namespace std;
+
+typedef ConcurrentCache<string, string> StrCache;
+
+static StrCache::Handle
+mkval(const string &s)
+{
+    return StrCache::Handle(new string(s));
+}
+
+int
+ConcurrentCache_selfTest(void)
+{
+    // A single shard makes the eviction order predictable
+    StrCache cache(4, 1);
+
+    cout << "Testing ConcurrentCache ..." << endl;
+
+    cache.put("A", mkval("1"));
+    cache.put("B", mkval("2"));
+    cache.put("C", mkval("3"));
+    cache.put("D", mkval("4"));
+
+    assert(*cache.get("A") == "1");
+    assert(cache.hasKey("B"));
+    assert(cache.hasKey("C"));
+    assert(cache.hasKey("D"));
+
+    // Test eviction, A was used last so B goes
+    cache.put("E", mkval("5"));
+
+    assert(cache.hasKey("E"));
+    assert(cache.hasKey("A"));
+    assert(!cache.hasKey("B"));
+    assert(cache.get("B").get() == NULL);
+
+    // Handles stay valid after eviction
+    StrCache::Handle c = cache.get("C");
+    cache.put("F", mkval("6"));
+    cache.put("G", mkval("7"));
+    cache.put("H", mkval("8"));
+    cache.put("I", mkval("9"));
+    assert(!cache.hasKey("C"));
+    assert(*c == "3");
+
+    // Replacing a key does not evict
+    cache.put("F", mkval("NEW"));
+    assert(*cache.get("F") == "NEW");
+    assert(cache.getStats().entries == 4);
+
+    // Weighted entries
+    cache.put("X", mkval("heavy"), 3);
+    assert(cache.hasKey("X"));
+    assert(cache.hasKey("F"));
+    assert(cache.getStats().weight == 4);
+    assert(!cache.put("Y", mkval("too heavy"), 5));
+    assert(!cache.hasKey("Y"));
+
+    cache.invalidate("X");
+    assert(!cache.hasKey("X"));
+    assert(cache.getStats().weight == 1);
+
+    cache.setCapacity(0);
+    assert(cache.getStats().entries == 0);
+    assert(!cache.put("J", mkval("10")));
+
+    return 0;
+}
+
@@ -101,7 +101,7 @@ ObjectInfo::hasAllFields() const
 
 bool
 ObjectInfo::isCompressed() const {
-    return (flags & ORI_FLAG_ZIPMASK) == ORI_FLAG_UNCOMPRESSED;
+    return (flags & ORI_FLAG_ZIPMASK) != ORI_FLAG_UNCOMPRESSED;
 }
 
 ObjectInfo::ZipAlgo
@@ -113,6 +113,8 @@ ObjectInfo::getAlgo() const {
             return ZIPALGO_FASTLZ;
         case ORI_FLAG_LZMA:
             return ZIPALGO_LZMA;
+        case ORI_FLAG_SNAPPY:
+            return ZIPALGO_SNAPPY;
         default:
             return ZIPALGO_UNKNOWN;
     }
@@ -121,6 +123,7 @@ ObjectInfo::getAlgo() const {
 void
 ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
 {
+    flags &= ~ORI_FLAG_ZIPMASK;
     switch (algo) {
         case ZIPALGO_NONE:
             flags |= ORI_FLAG_UNCOMPRESSED;
@@ -131,6 +134,9 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
         case ZIPALGO_LZMA:
             flags |= ORI_FLAG_LZMA;
             break;
+        case ZIPALGO_SNAPPY:
+            flags |= ORI_FLAG_SNAPPY;
+            break;
         case ZIPALGO_UNKNOWN:
         default:
             NOT_IMPLEMENTED(false);
@@ -138,6 +144,21 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
     }
 }
 
+bool
+ObjectInfo::isFramed() const
+{
+    return (flags & ORI_FLAG_FRAMED) != 0;
+}
+
+void
+ObjectInfo::setFramed(bool framed)
+{
+    if (framed)
+        flags |= ORI_FLAG_FRAMED;
+    else
+        flags &= ~ORI_FLAG_FRAMED;
+}
+
 bool ObjectInfo::operator <(const ObjectInfo &other) const {
     if (hash < other.hash) return true;
     if (type < other.type) return true;
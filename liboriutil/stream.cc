@@ -27,10 +27,6 @@
 #include <fcntl.h>
 #endif
 
-#ifdef ORI_USE_FASTLZ
-#include "fastlz.h"
-#endif /* ORI_USE_FASTLZ */
-
 #include <string>
 
 #include "tuneables.h"
@@ -39,6 +35,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/stream.h>
+#include <oriutil/zipcodec.h>
 
 using namespace std;
 
@@ -481,6 +478,46 @@ size_t fdstream::sizeHint() const {
     return 0;
 }
 
+/*
+ * pfdstream
+ */
+
+pfdstream::pfdstream(int fd, off_t offset, size_t length)
+    : fd(fd), offset(offset), length(length), left(length)
+{
+    assert(offset >= 0);
+}
+
+bool pfdstream::ended() {
+    return left == 0 || error();
+}
+
+size_t pfdstream::read(uint8_t *buf, size_t n) {
+    size_t final_size = MIN(n, left);
+retry_read:
+    ssize_t read_bytes = ::pread(fd, buf, final_size, offset);
+    if (read_bytes < 0) {
+        if (errno == EINTR)
+            goto retry_read;
+        setErrno("pread");
+        return 0;
+    }
+    else if (read_bytes == 0) {
+        left = 0;
+        return 0;
+    }
+    left -= read_bytes;
+    offset += read_bytes;
+
+    return read_bytes;
+}
+
+size_t pfdstream::sizeHint() const {
+    if (length != (size_t)-1)
+        return length;
+    return 0;
+}
+
 /*
  * diskstream
  */
@@ -518,30 +555,23 @@ size_t diskstream::sizeHint() const {
     return source->sizeHint();
 }
 
-#ifdef ORI_USE_LZMA
-
 /*
- * LZMA zipstream
+ * zipstream
  */
 
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source), size_hint(size_hint), output_ended(false)
-{
-    assert(source != NULL);
+zipstream::zipstream(bytestream *source, ObjectInfo::ZipAlgo algo,
+                     bool compress, size_t size_hint)
+    : source(source),
+      algo(algo),
+      size_hint(size_hint),
 
-    lzma_stream strm2 = LZMA_STREAM_INIT;
-    memcpy(&strm, &strm2, sizeof(lzma_stream));
+      compress(compress),
+      input_processed(false),
 
-    if (compress) {
-        lzma_ret ret = lzma_easy_encoder(&strm, 0, LZMA_CHECK_NONE);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_easy_encoder", ret);
-    }
-    else {
-        lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_stream_decoder", ret);
-    }
+      offset(0),
+      output_ended(false)
+{
+    assert(source != NULL);
 }
 
 zipstream::~zipstream() {
@@ -555,35 +585,42 @@ bool zipstream::ended() {
 size_t zipstream::read(uint8_t *buf, size_t n) {
     if (output_ended) return 0;
 
-    lzma_action action = source->ended() ? LZMA_FINISH : LZMA_RUN;
-    size_t begin_total = strm.total_out;
-
-    strm.next_out = buf;
-    strm.avail_out = n;
-    while (strm.avail_out > 0) {
-        if (output_ended) break;
-
-        if (strm.avail_in == 0) {
-            size_t read_bytes = source->read(in_buf, COMPFILE_BUFSZ);
-            if (inheritError(source)) return 0;
-            action = read_bytes == 0 ? LZMA_FINISH : LZMA_RUN;
-
-            strm.next_in = in_buf;
-            strm.avail_in = read_bytes;
+    if (!input_processed) {
+        const ZipCodec *codec = ZipCodec_Get(algo);
+        if (codec == NULL) {
+            last_error = string("zipstream: codec not available: ") +
+                         ZipCodec_Name(algo);
+            return 0;
         }
 
-        lzma_ret ret = lzma_code(&strm, action);
-        if (ret == LZMA_STREAM_END) {
-            output_ended = true;
-            lzma_end(&strm);
+        input = source->readAll();
+        if (inheritError(source)) return 0;
+
+        bool ok;
+        if (compress) {
+            ok = codec->compress(input.data(), input.size(), output);
+        } else {
+            ok = codec->decompress(input.data(), input.size(), size_hint,
+                                   output);
         }
-        else if (ret != LZMA_OK) {
-            setLzmaErr("lzma_code", ret);
+        if (!ok) {
+            last_error = string("zipstream: ") + ZipCodec_Name(algo) +
+                         (compress ? " couldn't compress" :
+                                     " couldn't decompress");
             return 0;
         }
+
+	input_processed = true;
     }
 
-    return strm.total_out - begin_total;
+    size_t to_copy = MIN(n, output.size() - offset);
+    memcpy(buf, &output[offset], to_copy);
+    offset += to_copy;
+
+    if (offset == output.size())
+	output_ended = true;
+
+    return to_copy;
 }
 
 size_t zipstream::sizeHint() const {
@@ -591,127 +628,173 @@ size_t zipstream::sizeHint() const {
 }
 
 size_t zipstream::inputConsumed() const {
-    return strm.total_in;
-}
-
-const char *lzma_ret_str(lzma_ret ret) {
-    switch (ret) {
-    case LZMA_STREAM_END:
-        return "end of stream";
-    case LZMA_NO_CHECK:
-        return "input stream has no integrity check";
-    case LZMA_UNSUPPORTED_CHECK:
-        return "cannot calculate the integrity check";
-    case LZMA_GET_CHECK:
-        return "integrity check available";
-    case LZMA_MEM_ERROR:
-        return "cannot allocate memory";
-    case LZMA_MEMLIMIT_ERROR:
-        return "memory usage limit exceeded";
-    case LZMA_FORMAT_ERROR:
-        return "file format not recognized";
-    case LZMA_OPTIONS_ERROR:
-        return "invalid or unsupported options";
-    case LZMA_DATA_ERROR:
-        return "data is corrupt";
-    case LZMA_BUF_ERROR:
-        return "no progress is possible";
-    case LZMA_PROG_ERROR:
-        return "programming error";
-    default:
-        return "unknown";
-    }
-}
-
-void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
-{
-    char buf[512];
-    snprintf(buf, 512, "lzmastream %s: %s (%d)\n", msg, lzma_ret_str(ret), ret);
-    last_error.assign(buf);
-    last_errnum = ret;
+    return (size_t)((offset / (float)output.size()) * input.size());
 }
 
-#endif /* ORI_USE_LZMA */
-
-#ifdef ORI_USE_FASTLZ
-
 /*
- * FastLZ zipstream
+ * framedstream
  */
 
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source),
-      size_hint(size_hint),
-
-      compress(compress),
-      input_processed(false),
-
-      offset(0),
-      output_ended(false)
+framedstream::framedstream(bytestream *source, ObjectInfo::ZipAlgo algo,
+                           size_t size)
+    : source(source), fd(-1), base(0), length(0), algo(algo), size(size),
+      header_read(false), block_size(0), stored_pos(0), pos(0),
+      curr_block((size_t)-1)
 {
     assert(source != NULL);
-    if (size_hint > 0) {
-        output.resize(size_hint);
-    }
 }
 
-zipstream::~zipstream() {
+framedstream::framedstream(int fd, off_t offset, size_t length,
+                           ObjectInfo::ZipAlgo algo, size_t size)
+    : source(NULL), fd(fd), base(offset), length(length), algo(algo),
+      size(size), header_read(false), block_size(0), stored_pos(0), pos(0),
+      curr_block((size_t)-1)
+{
+}
+
+framedstream::~framedstream() {
     delete source;
 }
 
-bool zipstream::ended() {
-    return output_ended; // || error();
+bool framedstream::ended() {
+    return pos >= size || error();
 }
 
-size_t zipstream::read(uint8_t *buf, size_t n) {
-    if (output_ended) return 0;
+/*
+ * Read n bytes at offset off of the stored payload.  Sequential sources can
+ * only skip forward.
+ */
+bool framedstream::readStored(uint8_t *buf, size_t n, size_t off) {
+    if (source == NULL) {
+        if (off + n > length) {
+            last_error = "framedstream: block past end of payload";
+            return false;
+        }
+        pfdstream ps(fd, base + off, n);
+        if (!ps.readExact(buf, n)) {
+            inheritError(&ps);
+            return false;
+        }
+        return true;
+    }
 
-    if (!input_processed) {
-        input = source->readAll();
-        if (output.size() == 0) {
-            NOT_IMPLEMENTED(compress);
-            output.resize(input.size() * 1.3);
+    ASSERT(off >= stored_pos);
+    while (stored_pos < off) {
+        uint8_t skip[COMPFILE_BUFSZ];
+        size_t len = MIN(off - stored_pos, COMPFILE_BUFSZ);
+        if (!source->readExact(skip, len)) {
+            inheritError(source);
+            return false;
         }
+        stored_pos += len;
+    }
+    if (!source->readExact(buf, n)) {
+        inheritError(source);
+        return false;
+    }
+    stored_pos += n;
+    return true;
+}
 
-        int finalSize = 0;
-	if (compress) {
-	    finalSize = fastlz_compress(&input[0], input.size(), &output[0]);
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't compress";
-                return 0;
-            }
-	} else {
-	    finalSize = fastlz_decompress(&input[0], input.size(), &output[0],
-                    output.size());
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't decompress";
-                return 0;
-            }
-	}
+bool framedstream::readHeader() {
+    uint8_t hdr[ZIP_FRAME_HDRSIZE];
 
-        output.resize(finalSize);
-	input_processed = true;
+    if (ZipCodec_Get(algo) == NULL) {
+        last_error = string("framedstream: codec not available: ") +
+                     ZipCodec_Name(algo);
+        return false;
     }
 
-    size_t to_copy = MIN(n, output.size() - offset);
-    memcpy(buf, &output[offset], to_copy);
-    offset += to_copy;
+    if (!readStored(hdr, ZIP_FRAME_HDRSIZE, 0))
+        return false;
+    strstream hs(string((char *)hdr, ZIP_FRAME_HDRSIZE));
+    block_size = hs.readUInt32();
+    uint32_t numBlocks = hs.readUInt32();
+    if (block_size == 0 ||
+        numBlocks != ((uint64_t)size + block_size - 1) / block_size) {
+        last_error = "framedstream: corrupt frame header";
+        return false;
+    }
 
-    if (offset == output.size())
-	output_ended = true;
+    string table(numBlocks * sizeof(uint32_t), '\0');
+    if (!readStored((uint8_t *)&table[0], table.size(), ZIP_FRAME_HDRSIZE))
+        return false;
+
+    strstream ts(table);
+    size_t off = ZIP_FRAME_HDRSIZE + table.size();
+    block_sizes.resize(numBlocks);
+    block_offsets.resize(numBlocks);
+    for (size_t i = 0; i < numBlocks; i++) {
+        block_sizes[i] = ts.readUInt32();
+        block_offsets[i] = off;
+        off += block_sizes[i] & ~ZIP_FRAME_RAWBLOCK;
+    }
 
-    return to_copy;
+    header_read = true;
+    return true;
 }
 
-size_t zipstream::sizeHint() const {
-    return size_hint;
+bool framedstream::loadBlock(size_t block) {
+    size_t stored = block_sizes[block] & ~ZIP_FRAME_RAWBLOCK;
+    size_t expected = MIN((size_t)block_size, size - block * block_size);
+
+    input.resize(stored);
+    if (stored > 0 &&
+        !readStored((uint8_t *)&input[0], stored, block_offsets[block]))
+        return false;
+
+    if (block_sizes[block] & ZIP_FRAME_RAWBLOCK) {
+        output.swap(input);
+    } else if (!ZipCodec_Get(algo)->decompress(input.data(), input.size(),
+                                               expected, output)) {
+        last_error = string("framedstream: ") + ZipCodec_Name(algo) +
+                     " couldn't decompress";
+        return false;
+    }
+
+    if (output.size() != expected) {
+        last_error = "framedstream: block has the wrong size";
+        return false;
+    }
+
+    curr_block = block;
+    return true;
 }
 
-size_t zipstream::inputConsumed() const {
-    return (size_t)((offset / (float)output.size()) * input.size());
+size_t framedstream::read(uint8_t *buf, size_t n) {
+    size_t total = 0;
+
+    if (!header_read && !readHeader())
+        return 0;
+
+    while (total < n && pos < size) {
+        size_t block = pos / block_size;
+        if (block != curr_block && !loadBlock(block))
+            return 0;
+
+        size_t blockOff = pos - block * block_size;
+        size_t to_copy = MIN(n - total, output.size() - blockOff);
+        memcpy(buf + total, &output[blockOff], to_copy);
+        total += to_copy;
+        pos += to_copy;
+    }
+
+    return total;
 }
 
-#endif /* ORI_USE_FASTLZ */
+size_t framedstream::sizeHint() const {
+    return size - pos;
+}
+
+bool framedstream::seek(size_t off) {
+    if (off > size)
+        return false;
+    if (source != NULL && off < pos &&
+        off / block_size != curr_block)
+        return false;
+    pos = off;
+    return true;
+}
 
 /*
  * bytewstream
@@ -22,6 +22,7 @@ int OriStr_selfTest(void);
 int OriUtil_selfTest(void);
 int OriFile_selfTest(void);
 int LRUCache_selfTest(void);
+int ConcurrentCache_selfTest(void);
 int KVSerializer_selfTest(void);
 int OriCrypt_selfTest(void);
 int Key_selfTest(void);
@@ -34,6 +35,7 @@ main(int argc, const char *argv[])
     result += OriUtil_selfTest();
     result += OriFile_selfTest();
     result += LRUCache_selfTest();
+    result += ConcurrentCache_selfTest();
     result += KVSerializer_selfTest();
     result += OriCrypt_selfTest();
     //result += Key_selfTest();
@@ -28,12 +28,8 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
-//#define ORI_USE_LZMA
-//#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
-#endif
+// LZMA preset used by the LZMA codec (0-9, higher is denser but slower)
+#define ZIP_LZMA_PRESET 2
 
 #endif /* __TUNEABLES_H__ */
 
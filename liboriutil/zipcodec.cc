@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <string>
+
+#include "fastlz.h"
+#include "snappy.h"
+
+#ifdef ORI_HAVE_LZMA
+#include <lzma.h>
+#endif /* ORI_HAVE_LZMA */
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/zipcodec.h>
+
+using namespace std;
+
+/*
+ * FastLZ
+ */
+
+class FastLZCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_FASTLZ; }
+    bool compress(const char *buf, size_t len, string &out) const
+    {
+        // FastLZ requires 5% slack and at least 66 bytes of output
+        out.resize(len + len / 16 + 66);
+        int finalSize = fastlz_compress(buf, len, &out[0]);
+        if (finalSize == 0)
+            return false;
+        out.resize(finalSize);
+        return true;
+    }
+    bool decompress(const char *buf, size_t len, size_t size,
+                    string &out) const
+    {
+        out.resize(size);
+        if (size == 0)
+            return len == 0;
+        int finalSize = fastlz_decompress(buf, len, &out[0], size);
+        if (finalSize == 0)
+            return false;
+        out.resize(finalSize);
+        return true;
+    }
+};
+
+/*
+ * Snappy
+ */
+
+class SnappyCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_SNAPPY; }
+    bool compress(const char *buf, size_t len, string &out) const
+    {
+        snappy::Compress(buf, len, &out);
+        return true;
+    }
+    bool decompress(const char *buf, size_t len, size_t size,
+                    string &out) const
+    {
+        size_t outLen;
+        if (!snappy::GetUncompressedLength(buf, len, &outLen) ||
+            outLen != size)
+            return false;
+        return snappy::Uncompress(buf, len, &out);
+    }
+};
+
+#ifdef ORI_HAVE_LZMA
+
+/*
+ * LZMA (xz container without an integrity check, the object hash covers it)
+ */
+
+class LzmaCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_LZMA; }
+    bool compress(const char *buf, size_t len, string &out) const
+    {
+        size_t outPos = 0;
+
+        out.resize(lzma_stream_buffer_bound(len));
+        lzma_ret ret = lzma_easy_buffer_encode(ZIP_LZMA_PRESET,
+                                               LZMA_CHECK_NONE, NULL,
+                                               (const uint8_t *)buf, len,
+                                               (uint8_t *)&out[0], &outPos,
+                                               out.size());
+        if (ret != LZMA_OK) {
+            LOG("lzma_easy_buffer_encode failed (%d)", ret);
+            return false;
+        }
+        out.resize(outPos);
+        return true;
+    }
+    bool decompress(const char *buf, size_t len, size_t size,
+                    string &out) const
+    {
+        uint64_t memlimit = UINT64_MAX;
+        size_t inPos = 0;
+        size_t outPos = 0;
+
+        out.resize(size);
+        lzma_ret ret = lzma_stream_buffer_decode(&memlimit, 0, NULL,
+                                                 (const uint8_t *)buf, &inPos,
+                                                 len,
+                                                 (uint8_t *)&out[0], &outPos,
+                                                 out.size());
+        if (ret != LZMA_OK) {
+            LOG("lzma_stream_buffer_decode failed (%d)", ret);
+            return false;
+        }
+        out.resize(outPos);
+        return true;
+    }
+};
+
+#endif /* ORI_HAVE_LZMA */
+
+static FastLZCodec fastlzCodec;
+static SnappyCodec snappyCodec;
+#ifdef ORI_HAVE_LZMA
+static LzmaCodec lzmaCodec;
+#endif /* ORI_HAVE_LZMA */
+
+const ZipCodec *
+ZipCodec_Get(ObjectInfo::ZipAlgo algo)
+{
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_FASTLZ:
+            return &fastlzCodec;
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return &snappyCodec;
+#ifdef ORI_HAVE_LZMA
+        case ObjectInfo::ZIPALGO_LZMA:
+            return &lzmaCodec;
+#endif /* ORI_HAVE_LZMA */
+        default:
+            return NULL;
+    }
+}
+
+ObjectInfo::ZipAlgo
+ZipCodec_Lookup(const string &name)
+{
+    if (name == "none")
+        return ObjectInfo::ZIPALGO_NONE;
+    if (name == "fastlz")
+        return ObjectInfo::ZIPALGO_FASTLZ;
+    if (name == "snappy")
+        return ObjectInfo::ZIPALGO_SNAPPY;
+    if (name == "lzma")
+        return ObjectInfo::ZIPALGO_LZMA;
+    return ObjectInfo::ZIPALGO_UNKNOWN;
+}
+
+const char *
+ZipCodec_Name(ObjectInfo::ZipAlgo algo)
+{
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+            return "none";
+        case ObjectInfo::ZIPALGO_FASTLZ:
+            return "fastlz";
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return "snappy";
+        case ObjectInfo::ZIPALGO_LZMA:
+            return "lzma";
+        case ObjectInfo::ZIPALGO_UNKNOWN:
+        default:
+            return "unknown";
+    }
+}
+
+bool
+ZipCodec_EncodeFramed(const ZipCodec *codec, const char *buf, size_t len,
+                      size_t blockSize, string &out)
+{
+    size_t numBlocks = (len + blockSize - 1) / blockSize;
+    strwstream hdr;
+    string data;
+    string block;
+
+    ASSERT(blockSize < ZIP_FRAME_RAWBLOCK);
+
+    hdr.writeUInt32(blockSize);
+    hdr.writeUInt32(numBlocks);
+    for (size_t i = 0; i < numBlocks; i++) {
+        size_t off = i * blockSize;
+        size_t n = MIN(blockSize, len - off);
+
+        if (codec->compress(buf + off, n, block) && block.size() < n) {
+            hdr.writeUInt32(block.size());
+            data.append(block);
+        } else {
+            hdr.writeUInt32(n | ZIP_FRAME_RAWBLOCK);
+            data.append(buf + off, n);
+        }
+    }
+
+    out = hdr.str();
+    out.append(data);
+    return true;
+}
+
+bytestream *
+ZipCodec_Decode(bytestream *stored, const ObjectInfo &info)
+{
+    if (info.getAlgo() == ObjectInfo::ZIPALGO_NONE)
+        return stored;
+    if (info.isFramed())
+        return new framedstream(stored, info.getAlgo(), info.payload_size);
+    return new zipstream(stored, info.getAlgo(), DECOMPRESS,
+                         info.payload_size);
+}
+
@@ -15,6 +15,7 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 
 #include <string>
 #include <iostream>
@@ -26,12 +27,21 @@ using namespace std;
 extern LocalRepo repository;
 
 /*
- * Reclaim unused space.
+ * Reclaim unused space, --reorder also lays out objects in traversal order.
  */
 int
 cmd_gc(int argc, char * const argv[])
 {
-    repository.gc();
+    bool reorder = false;
+
+    if (argc == 2 && strcmp(argv[1], "--reorder") == 0) {
+        reorder = true;
+    } else if (argc != 1) {
+        cout << "Usage: gc [--reorder]" << endl;
+        return 1;
+    }
+
+    repository.gc(reorder);
 
     return 0;
 }
@@ -131,6 +131,9 @@ SshServer::serve() {
         else if (command == "readobjs") {
             cmd_readObjs();
         }
+        else if (command == "getmissing") {
+            cmd_getMissing();
+        }
         else if (command == "getobjinfo") {
             cmd_getObjInfo();
         }
@@ -210,6 +213,31 @@ SshServer::cmd_readObjs()
     repo->transmit(&fs, objs);
 }
 
+void
+SshServer::cmd_getMissing()
+{
+    // Read the commits the client has
+    fdstream in(STDIN_FILENO, -1);
+    uint32_t numHaves = in.readUInt32();
+    ObjectHashVec haves;
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+    DLOG("getMissing: %u commits known", numHaves);
+
+    bytestream::ap objs(repo->getMissingObjects(haves));
+    if (!objs.get()) {
+        printError("getmissing not supported");
+        return;
+    }
+
+    fdwstream fs(STDOUT_FILENO);
+    fs.writeUInt8(OK);
+    fs.copyFrom(objs.get());
+}
+
 void
 SshServer::cmd_getObjInfo()
 {
@@ -1,7 +1,7 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
-#define ORI_PROTO_VERSION "1.0"
+#define ORI_PROTO_VERSION "1.1"
 
 class SshServer
 {
@@ -18,6 +18,7 @@ public:
     void cmd_listObjs();
     void cmd_listCommits();
     void cmd_readObjs();
+    void cmd_getMissing();
     void cmd_getObjInfo();
     void cmd_getHead();
     void cmd_getFSID();
@@ -58,6 +58,9 @@ usage()
     cout << "Usage: ori_httpd [OPTIONS] FSNAME" << endl << endl;
     cout << "Options:" << endl;
     cout << "    -p port    Set the HTTP port number (default: 8080)" << endl;
+    cout << "    -c MB      Set the object cache size (default: 32)" << endl;
+    cout << "    -t threads Set the number of serving threads (default: 8)"
+         << endl;
 #if !defined(WITHOUT_MDNS)
     cout << "    -m         Enable mDNS (default)" << endl;
     cout << "    -n         Disable mDNS" << endl;
@@ -71,9 +74,11 @@ main(int argc, char *argv[])
     int ch;
     bool mDNS_flag = true;
     unsigned long port = 8080;
+    long objcache = -1;
+    long threads = 0;
     string rootPath;
 
-    while ((ch = getopt(argc, argv, "p:mnh")) != -1) {
+    while ((ch = getopt(argc, argv, "p:c:t:mnh")) != -1) {
         switch (ch) {
             case 'p':
             {
@@ -86,6 +91,28 @@ main(int argc, char *argv[])
                 }
                 break;
             }
+            case 'c':
+            {
+                char *p;
+                objcache = strtol(optarg, &p, 10);
+                if (*p != '\0' || objcache < 0) {
+                    cout << "Invalid cache size '" << optarg << "'" << endl;
+                    usage();
+                    return 1;
+                }
+                break;
+            }
+            case 't':
+            {
+                char *p;
+                threads = strtol(optarg, &p, 10);
+                if (*p != '\0' || threads < 1) {
+                    cout << "Invalid thread count '" << optarg << "'" << endl;
+                    usage();
+                    return 1;
+                }
+                break;
+            }
             case 'm':
                 mDNS_flag = true;
                 break;
@@ -121,11 +148,21 @@ main(int argc, char *argv[])
         return 1;
     }
 
+    if (objcache >= 0) {
+        repository.getObjectCache().setMaxSize((size_t)objcache * 1024 * 1024);
+    }
+
     ori_open_log(repository.getLogPath());
     LOG("libevent %s", event_get_version());
 
-    HTTPServer server = HTTPServer(repository, port);
-    server.start(mDNS_flag);
+    try {
+        HTTPServer server(repository, port, threads);
+        server.start(mDNS_flag);
+    } catch (std::exception &e) {
+        cout << e.what() << endl;
+        cout << "Could not start the server!" << endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -96,6 +96,13 @@ cmd_stats(int argc, char * const argv[])
     cout << left << setw(40) << "Large Blobs" << largeBlobs << endl;
     cout << left << setw(40) << "Purged Blobs" << purgedBlobs << endl;
 
+    ObjectCache::Stats cs = repository.getObjectCache().getStats();
+    cout << left << setw(40) << "Object Cache Size"
+         << repository.getObjectCache().getMaxSize() << endl;
+    cout << left << setw(40) << "  Hits" << cs.hits << endl;
+    cout << left << setw(40) << "  Misses" << cs.misses << endl;
+    cout << left << setw(40) << "  Evictions" << cs.evictions << endl;
+
     return 0;
 }
 
@@ -540,6 +540,9 @@ OriCommand::cmd_purgesnapshot(strstream &str)
     strwstream resp;
     uint8_t timeBased;
 
+    // Purging updates the index shared with the file system and the repacker
+    RWKey::sp lock = priv->nsLock.writeLock();
+
     timeBased = str.readUInt8();
     if (timeBased) {
         int64_t time = str.readInt64();
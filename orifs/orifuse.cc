@@ -35,10 +35,12 @@
 #include <fuse.h>
 
 #include <string>
+#include <vector>
 #include <map>
 #include <memory>
 
 #include <oriutil/debug.h>
+#include <oriutil/monitor.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
 #include <oriutil/systemexception.h>
@@ -53,6 +55,7 @@
 #include "oricmd.h"
 #include "oripriv.h"
 #include "oriopt.h"
+#include "orifuse.h"
 
 #ifdef DEBUG
 #define FSCK_A_LOT
@@ -60,11 +63,6 @@
 
 using namespace std;
 
-#define ORI_CONTROL_FILENAME ".ori_control"
-#define ORI_CONTROL_FILEPATH "/" ORI_CONTROL_FILENAME
-#define ORI_SNAPSHOT_DIRNAME ".snapshot"
-#define ORI_SNAPSHOT_DIRPATH "/" ORI_SNAPSHOT_DIRNAME
-
 #define OPT_KEY_CLONE_PARAM 0
 
 mount_ori_config config;
@@ -92,8 +90,25 @@ ori_destroy(void *userdata)
     OriPriv *priv = GetOriPriv();
     Commit c;
     c.setMessage("FUSE snapshot on unmount");
-    priv->commit(c);
+    {
+        // Wait for the write-back threads
+        RWKey::sp lock = priv->nsLock.writeLock();
+        priv->commit(c);
+    }
     priv->cleanup();
+
+    ObjectCache::Stats st = priv->getRepo()->getObjectCache().getStats();
+    FUSE_LOG("Object cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+             "%" PRIu64 " evictions",
+             st.hits, st.misses, st.evictions);
+
+    LocalRepo::TransmitStats ts = priv->getRepo()->getTransmitStats();
+    if (ts.calls > 0) {
+        FUSE_LOG("Transmit: %" PRIu64 " calls, %" PRIu64 " objects, "
+                 "%.1f contiguous runs per call",
+                 ts.calls, ts.objects, (double)ts.runs / ts.calls);
+    }
+
     delete priv;
 
     FUSE_LOG("File system unmounted");
@@ -126,6 +141,8 @@ ori_unlink(const char *path)
         return -EACCES;
     }
 
+    priv->preload(path);
+
     RWKey::sp lock = priv->nsLock.writeLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
@@ -156,8 +173,6 @@ static int
 ori_symlink(const char *target_path, const char *link_path)
 {
     OriPriv *priv = GetOriPriv();
-    OriDir *parentDir;
-    string parentPath;
 
 #ifdef FSCK_A_LOT
     priv->fsck();
@@ -165,10 +180,6 @@ ori_symlink(const char *target_path, const char *link_path)
 
     FUSE_LOG("FUSE ori_symlink(path=\"%s\")", link_path);
 
-    parentPath = OriFile_Dirname(link_path);
-    if (parentPath == "")
-        parentPath = "/";
-
     if (strcmp(link_path, ORI_CONTROL_FILEPATH) == 0) {
         return -EACCES;
     } else if (strncmp(link_path,
@@ -177,21 +188,13 @@ ori_symlink(const char *target_path, const char *link_path)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
-        parentDir = priv->getDir(parentPath);
+        priv->addSymlink(link_path, target_path);
     } catch (SystemException e) {
         return -e.getErrno();
     }
 
-    OriFileInfo *info = priv->addSymlink(link_path);
-    info->statInfo.st_mode |= 0755;
-    info->link = target_path;
-    info->statInfo.st_size = info->path.length();
-    info->type = FILETYPE_DIRTY;
-
-    parentDir->add(OriFile_Basename(link_path), info->id);
-
     return 0;
 }
 
@@ -242,6 +245,9 @@ ori_rename(const char *from_path, const char *to_path)
         return -EACCES;
     }
 
+    priv->preload(from_path);
+    priv->preload(to_path);
+
     RWKey::sp lock = priv->nsLock.writeLock();
     try {
         OriFileInfo *info = priv->getFileInfo(from_path);
@@ -291,8 +297,8 @@ static int
 ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     OriPriv *priv = GetOriPriv();
-    string parentPath;
-    OriDir *parentDir;
+    pair<OriFileInfo *, uint64_t> info;
+    OriFileInfo *old;
 
 #ifdef FSCK_A_LOT
     priv->fsck();
@@ -300,29 +306,19 @@ ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
     FUSE_LOG("FUSE ori_create(path=\"%s\")", path);
 
-    parentPath = OriFile_Dirname(path);
-    if (parentPath == "")
-        parentPath = "/";
-
     if (strncmp(path,
                 ORI_SNAPSHOT_DIRPATH,
                 strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
-        parentDir = priv->getDir(parentPath);
+        info = priv->addFile(path, mode, &old);
     } catch (SystemException e) {
         return -e.getErrno();
     }
 
-    pair<OriFileInfo *, uint64_t> info = priv->addFile(path);
-    info.first->statInfo.st_mode |= mode;
-    info.first->type = FILETYPE_DIRTY;
-
-    parentDir->add(OriFile_Basename(path), info.first->id);
-
     string journalArg = path;
     journalArg += ":" + info.first->path;
     priv->journal("create", journalArg);
@@ -330,6 +326,16 @@ ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     // Set fh
     fi->fh = info.second;
 
+    /*
+     * Delete any old temporary files.  Readers may still use the replaced
+     * file without a reference until the lock is held for writing.
+     */
+    if (old != NULL) {
+        lock.reset();
+        lock = priv->nsLock.writeLock();
+        old->release();
+    }
+
     return 0;
 }
 
@@ -355,14 +361,20 @@ ori_open(const char *path, struct fuse_file_info *fi)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        return writing ? -EPERM : 0;
+        if (writing)
+            return -EPERM;
+        /*
+         * A purged snapshot's name can be reused, so its pages are not
+         * kept.  Files here have no OriFileInfo to remember the hash by.
+         */
+        return 0;
     }
 
     parentPath = OriFile_Dirname(path);
     if (parentPath == "")
         parentPath = "/";
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         parentDir = priv->getDir(parentPath);
         info = priv->openFile(path, /*writing*/writing, /*trunc*/trunc);
@@ -370,8 +382,12 @@ ori_open(const char *path, struct fuse_file_info *fi)
         return -e.getErrno();
     }
 
-    if (writing)
+    fi->keep_cache = priv->keepCache(info.first, writing) ? 1 : 0;
+
+    if (writing) {
+        Monitor m(parentDir->lock);
         parentDir->setDirty();
+    }
 
     // Set fh
     fi->fh = info.second;
@@ -404,7 +420,7 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
         string parentPath, fileName;
         size_t pos = 0;
         Commit c;
-        Tree t;
+        shared_ptr<Tree> t;
         
         snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
         pos = snapshot.find('/', pos);
@@ -418,13 +434,18 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
         if (parentPath == "")
             parentPath = "/";
 
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
+        try {
+            c = priv->lookupSnapshot(snapshot);
+        } catch (SystemException e) {
+            return -e.getErrno();
+        }
         t = priv->getTree(c, parentPath);
+        if (!t)
+            return -ENOENT;
 
         // lookup tree
-        Tree::iterator it = t.find(fileName);
-        if (it == t.end())
+        Tree::iterator it = t->find(fileName);
+        if (it == t->end())
             return -ENOENT;
 
         // Read
@@ -444,11 +465,16 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    if (info->fd != -1) {
+    // Another handle may open the file for writing meanwhile
+    int fd;
+    {
+        Monitor m(info->lock);
+        fd = info->fd;
+    }
+
+    if (fd != -1) {
         // File in temporary directory
-        status = pread(info->fd, buf, size, offset);
-        if (status < 0)
-            return -errno;
+        status = priv->readTemp(info, fd, buf, size, offset);
     } else {
         // File in repository
         return priv->readFile(info, buf, size, offset);
@@ -484,11 +510,15 @@ ori_write(const char *path, const char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    info->type = FILETYPE_DIRTY;
+    // Writes to the same file proceed in parallel, only the size is locked
     status = pwrite(info->fd, buf, size, offset);
     if (status < 0)
         return -errno;
 
+    Monitor m(info->lock);
+    info->type = FILETYPE_DIRTY;
+    info->markDirty(offset, status);
+
     // Update size
     if (info->statInfo.st_size < (off_t)size + offset) {
         info->statInfo.st_size = size + offset;
@@ -514,15 +544,28 @@ ori_truncate(const char *path, off_t length)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
-    info = priv->getFileInfo(path);
+    RWKey::sp lock = priv->nsLock.readLock();
+    try {
+        info = priv->getFileInfo(path);
+    } catch (SystemException e) {
+        return -e.getErrno();
+    }
+
+    Monitor m(info->lock);
     if (info->type == FILETYPE_DIRTY) {
+        off_t oldSize = info->statInfo.st_size;
         int status;
 
         status = truncate(info->path.c_str(), length);
         if (status < 0)
             return -errno;
 
+        // The bytes cut off or zero filled
+        if (length < oldSize)
+            info->markDirty(length, oldSize - length);
+        else
+            info->markDirty(oldSize, length - oldSize);
+
         // Update size
         info->statInfo.st_size = length;
         info->statInfo.st_blocks = (length + (512-1))/512;
@@ -552,15 +595,24 @@ ori_ftruncate(const char *path, off_t length, struct fuse_file_info *fi)
         return -EIO;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     info = priv->getFileInfo(fi->fh);
+
+    Monitor m(info->lock);
     if (info->type == FILETYPE_DIRTY) {
+        off_t oldSize = info->statInfo.st_size;
         int status;
 
         status = ftruncate(info->fd, length);
         if (status < 0)
             return -errno;
 
+        // The bytes cut off or zero filled
+        if (length < oldSize)
+            info->markDirty(length, oldSize - length);
+        else
+            info->markDirty(oldSize, length - oldSize);
+
         // Update size
         info->statInfo.st_size = length;
         info->statInfo.st_blocks = (length + (512-1))/512;
@@ -588,7 +640,7 @@ ori_release(const char *path, struct fuse_file_info *fi)
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     // Decrement reference count (deletes temporary file for unlink)
     return priv->closeFH(fi->fh);
 }
@@ -612,10 +664,9 @@ ori_mkdir(const char *path, mode_t mode)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
-        OriFileInfo *info = priv->addDir(path);
-        info->statInfo.st_mode |= mode;
+        priv->addDir(path, mode);
     } catch (SystemException e) {
         return -e.getErrno();
     }
@@ -642,6 +693,8 @@ ori_rmdir(const char *path)
         return -EACCES;
     }
 
+    priv->preload(path);
+
     RWKey::sp lock = priv->nsLock.writeLock();
     try {
         OriDir *dir = priv->getDir(path);
@@ -676,6 +729,7 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     OriPriv *priv = GetOriPriv();
     OriDir *dir;
     OriDir::iterator it;
+    vector<string> names;
     string dirPath = path;
 
     if (dirPath != "/")
@@ -708,7 +762,7 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         string relPath;
         size_t pos = 0;
         Commit c;
-        Tree t;
+        shared_ptr<Tree> t;
         
         snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
         pos = snapshot.find('/', pos);
@@ -720,12 +774,17 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             snapshot = snapshot.substr(0, pos);
         }
 
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
+        try {
+            c = priv->lookupSnapshot(snapshot);
+        } catch (SystemException e) {
+            return -e.getErrno();
+        }
         t = priv->getTree(c, relPath);
+        if (!t)
+            return -ENOENT;
 
-        for (map<string, TreeEntry>::iterator it = t.tree.begin();
-             it != t.tree.end();
+        for (map<string, TreeEntry>::iterator it = t->tree.begin();
+             it != t->tree.end();
              it++) {
             filler(buf, (*it).first.c_str(), NULL, 0);
         }
@@ -733,22 +792,35 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         dir = priv->getDir(path);
     } catch (SystemException e) {
         return -e.getErrno();
     }
 
-    for (it = dir->begin(); it != dir->end(); it++) {
+    {
+        Monitor m(dir->lock);
+
+        for (it = dir->begin(); it != dir->end(); it++) {
+            names.push_back((*it).first);
+        }
+    }
+
+    for (size_t i = 0; i < names.size(); i++) {
         OriFileInfo *info;
+        struct stat st;
         
         try {
-            info = priv->getFileInfo(dirPath + (*it).first);
-            filler(buf, (*it).first.c_str(), &info->statInfo, 0);
+            info = priv->getFileInfo(dirPath + names[i]);
+            {
+                Monitor m(info->lock);
+                st = info->statInfo;
+            }
+            filler(buf, names[i].c_str(), &st, 0);
         } catch (SystemException e) {
             FUSE_LOG("Unexpected %s", e.what());
-            filler(buf, (*it).first.c_str(), NULL, 0);
+            filler(buf, names[i].c_str(), NULL, 0);
         }
     }
 
@@ -793,13 +865,18 @@ ori_getattr(const char *path, struct stat *stbuf)
         string parentPath, fileName;
         size_t pos = 0;
         Commit c;
-        Tree t;
+        shared_ptr<Tree> t;
         
         snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
         pos = snapshot.find('/', pos);
 
+        try {
+            c = priv->lookupSnapshot(snapshot.substr(0, pos));
+        } catch (SystemException e) {
+            return -e.getErrno();
+        }
+
         if (pos == snapshot.npos) {
-            c = priv->lookupSnapshot(snapshot);
             stbuf->st_uid = geteuid();
             stbuf->st_gid = getegid();
             stbuf->st_mode = 0755 | S_IFDIR;
@@ -819,18 +896,26 @@ ori_getattr(const char *path, struct stat *stbuf)
         if (parentPath == "")
             parentPath = "/";
 
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
         t = priv->getTree(c, parentPath);
+        if (!t)
+            return -ENOENT;
 
         // lookup tree
-        Tree::iterator it = t.find(fileName);
-        if (it == t.end())
+        Tree::iterator it = t->find(fileName);
+        if (it == t->end())
             return -ENOENT;
 
         // Convert
         AttrMap *attrs = &it->second.attrs;
-        struct passwd *pw = getpwnam(attrs->getAsStr(ATTR_USERNAME).c_str());
+        struct passwd pwd;
+        struct passwd *pw = NULL;
+        char pwbuf[1024];
+
+        // Snapshots are looked up concurrently, use the reentrant lookups
+        getpwnam_r(attrs->getAsStr(ATTR_USERNAME).c_str(),
+                   &pwd, pwbuf, sizeof(pwbuf), &pw);
+        if (pw == NULL)
+            getpwuid_r(getuid(), &pwd, pwbuf, sizeof(pwbuf), &pw);
 
         memset(stbuf, 0, sizeof(*stbuf));
         if (it->second.type == TreeEntry::Tree) {
@@ -851,9 +936,11 @@ ori_getattr(const char *path, struct stat *stbuf)
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
+        Monitor m(info->lock);
+
         *stbuf = info->statInfo;
     } catch (SystemException e) {
         return -e.getErrno();
@@ -882,14 +969,18 @@ ori_chmod(const char *path, mode_t mode)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
+        OriDir *dir = priv->getDir(parentPath);
 
-        info->statInfo.st_mode = mode;
-        info->type = FILETYPE_DIRTY;
+        {
+            Monitor m(info->lock);
+            info->statInfo.st_mode = mode;
+            info->type = FILETYPE_DIRTY;
+        }
 
-        OriDir *dir = priv->getDir(parentPath);
+        Monitor m(dir->lock);
         dir->setDirty();
     } catch (SystemException e) {
         return -e.getErrno();
@@ -918,15 +1009,19 @@ ori_chown(const char *path, uid_t uid, gid_t gid)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
+        OriDir *dir = priv->getDir(parentPath);
 
-        info->statInfo.st_uid = uid;
-        info->statInfo.st_gid = gid;
-        info->type = FILETYPE_DIRTY;
+        {
+            Monitor m(info->lock);
+            info->statInfo.st_uid = uid;
+            info->statInfo.st_gid = gid;
+            info->type = FILETYPE_DIRTY;
+        }
 
-        OriDir *dir = priv->getDir(parentPath);
+        Monitor m(dir->lock);
         dir->setDirty();
     } catch (SystemException e) {
         return -e.getErrno();
@@ -955,15 +1050,19 @@ ori_utimens(const char *path, const struct timespec tv[2])
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
+        OriDir *dir = priv->getDir(parentPath);
 
-        // Ignore access times
-        info->statInfo.st_mtime = tv[1].tv_sec;
-        info->type = FILETYPE_DIRTY;
+        {
+            Monitor m(info->lock);
+            // Ignore access times
+            info->statInfo.st_mtime = tv[1].tv_sec;
+            info->type = FILETYPE_DIRTY;
+        }
 
-        OriDir *dir = priv->getDir(parentPath);
+        Monitor m(dir->lock);
         dir->setDirty();
     } catch (SystemException e) {
         return -e.getErrno();
@@ -1061,6 +1160,11 @@ usage()
     printf("                                    or use a synchronous or\n");
     printf("                                    asynchronous journal. Default\n");
     printf("                                    is 'async'.\n");
+    printf("    -o objcache=[MB]                Size of the decompressed object\n");
+    printf("                                    cache, 0 disables it. Default\n");
+    printf("                                    is 32 MB.\n");
+    printf("    -o lowlevel                     Use the inode based FUSE\n");
+    printf("                                    low-level interface.\n");
     printf("\nOther mount options will be passed on to FUSE; see below.\n");
 
     printf("\nPlease report bugs to orifs-devel@stanford.edu\n");
@@ -1087,12 +1191,16 @@ const fuse_opt option_spec[] = {
   { "journal=async", offsetof(struct mount_ori_config, journal), (int) OriJournalMode::AsyncJournal },
   { "journal=sync", offsetof(struct mount_ori_config, journal), (int) OriJournalMode::SyncJournal },
 
+  { "objcache=%d", offsetof(struct mount_ori_config, objcache), 0 },
+
   { "-s", offsetof(struct mount_ori_config, single), 1 },
 
   { "-d", offsetof(struct mount_ori_config, debug), 1 },
   { "debug", offsetof(struct mount_ori_config, debug), 1 },
   { "no_debug", offsetof(struct mount_ori_config, debug), 0 },
 
+  { "lowlevel", offsetof(struct mount_ori_config, lowlevel), 1 },
+
   { "clone=", -1U, OPT_KEY_CLONE_PARAM },
 
   FUSE_OPT_END
@@ -1329,6 +1437,10 @@ main(int argc, char *argv[])
     // Cast is safe enough in C++, if code explicitly sets and tests for
     // enum values - which it does.
     priv->setJournalMode(static_cast<OriJournalMode::JournalMode>(config.journal));
+    if (config.objcache >= 0) {
+        priv->getRepo()->getObjectCache().setMaxSize(
+                (size_t)config.objcache * 1024 * 1024);
+    }
 
     if (config.debug == 1) {
         cout << "Repo Path:     " << config.repoPath << endl;
@@ -1336,7 +1448,11 @@ main(int argc, char *argv[])
         cout << "Mount Point:   " << config.mountPoint << endl;
     }
 
-    int status = fuse_main(args.argc, args.argv, &ori_oper, NULL);
+    int status;
+    if (config.lowlevel)
+        status = ori_ll_main(&args, &ori_oper);
+    else
+        status = fuse_main(args.argc, args.argv, &ori_oper, NULL);
     if (status != 0) {
         priv->cleanup();
     }
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORIFUSE_H__
+#define __ORIFUSE_H__
+
+#define ORI_CONTROL_FILENAME ".ori_control"
+#define ORI_CONTROL_FILEPATH "/" ORI_CONTROL_FILENAME
+#define ORI_SNAPSHOT_DIRNAME ".snapshot"
+#define ORI_SNAPSHOT_DIRPATH "/" ORI_SNAPSHOT_DIRNAME
+
+struct fuse_args;
+struct fuse_operations;
+
+/*
+ * Mount with the inode based low-level frontend (orifuse_ll.cc).  Changes to
+ * the working tree are forwarded to the path based operations.
+ */
+int ori_ll_main(struct fuse_args *args, const struct fuse_operations *ops);
+
+#endif /* __ORIFUSE_H__ */
+
@@ -0,0 +1,1191 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Inode based frontend on the FUSE low-level API.
+ *
+ * The kernel refers to files by inode number, the inode number of a file in
+ * the working tree is the OriPrivId of its OriFileInfo.  Each inode the kernel
+ * knows about is kept until it is forgotten and holds a reference to its
+ * OriFileInfo, attributes and links are read from it without resolving the
+ * path.  The inode also records its path, other requests are forwarded to the
+ * path based operations of orifuse.cc without libfuse rebuilding the path
+ * under its tree lock.
+ *
+ * Inodes under .snapshot hold the tree entry they were looked up from.
+ * Snapshots never change, a lookup reads one tree from the snapshot tree
+ * cache, getattr and read never resolve the path again and the kernel caches
+ * names, attributes and file pages for a long time.  Committed files in the
+ * working tree keep their pages in the kernel while their hash stays the
+ * same.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/monitor.h>
+#include <oriutil/orifile.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/rwlock.h>
+#include <ori/commit.h>
+#include <ori/tree.h>
+#include <ori/localrepo.h>
+
+#include "logging.h"
+#include "oripriv.h"
+#include "orifuse.h"
+
+using namespace std;
+
+// Seconds the kernel caches names and attributes of the working tree,
+// commands such as checkout change it without going through the kernel
+#define ORILL_TIMEOUT 1.0
+// Snapshots never change
+#define ORILL_SNAPSHOT_TIMEOUT 86400.0
+// Directory entries whose inode is not known yet
+#define ORILL_UNKNOWN_INO 0xffffffff
+
+extern OriPriv *priv;
+
+struct OriInode
+{
+    OriInode()
+        : info(NULL), nlookup(0), unlinked(false), snapshot(false), parent(0),
+          isTree(false)
+    {
+        memset(&attr, 0, sizeof(attr));
+    }
+    string path;
+    // Working tree file, the reference belongs to the table entry
+    OriFileInfo *info;
+    uint64_t nlookup;
+    // Removed while the kernel still holds it, the path is no longer valid
+    bool unlinked;
+    struct stat attr;
+    // Entries under .snapshot, resolved once from their tree
+    bool snapshot;
+    fuse_ino_t parent;
+    bool isTree;
+    ObjectHash hash;
+    string link;
+    // Root tree of the snapshot and the directory path within it
+    ObjectHash root;
+    string treePath;
+};
+
+static const struct fuse_operations *ops;
+static fuse_ino_t controlIno;
+static fuse_ino_t snapshotIno;
+
+// Protects the inode table, never held across a call into OriPriv
+static Mutex inodesLock;
+static unordered_map<fuse_ino_t, OriInode> inodes;
+// Working tree paths looked up by the kernel, ordered to find descendants
+static map<string, fuse_ino_t> inodePaths;
+// Inodes of snapshot entries by parent and name
+static map<pair<fuse_ino_t, string>, fuse_ino_t> snapshotNames;
+
+static string
+childPath(const string &parent, const char *name)
+{
+    if (parent == "/")
+        return parent + name;
+    return parent + "/" + name;
+}
+
+static bool
+getInode(fuse_ino_t ino, OriInode *node)
+{
+    Monitor m(inodesLock);
+    unordered_map<fuse_ino_t, OriInode>::iterator it = inodes.find(ino);
+
+    if (it == inodes.end())
+        return false;
+
+    *node = (*it).second;
+    return true;
+}
+
+/*
+ * Copy the inode and retain its file for the caller.  The file stays valid
+ * after its path was removed or renamed.  @returns false if the inode is not
+ * known, info is NULL unless it is a working tree file.
+ */
+static bool
+getInodeInfo(fuse_ino_t ino, OriInode *node, OriFileInfo **info)
+{
+    Monitor m(inodesLock);
+    unordered_map<fuse_ino_t, OriInode>::iterator it = inodes.find(ino);
+
+    if (it == inodes.end())
+        return false;
+
+    *node = (*it).second;
+    *info = node->info;
+    if (*info != NULL)
+        (*info)->retain();
+    return true;
+}
+
+/*
+ * Attributes of a working tree inode, read from its file when it has one.
+ */
+static int
+statLive(const OriInode &node, OriFileInfo *info, struct stat *st)
+{
+    if (info == NULL)
+        return ops->getattr(node.path.c_str(), st);
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    Monitor m(info->lock);
+
+    *st = info->statInfo;
+    if (node.unlinked)
+        st->st_nlink = 0;
+
+    return 0;
+}
+
+/*
+ * Record a lookup of the inode and fill in the reply.
+ */
+static void
+addEntry(fuse_ino_t ino, const OriInode &node, double timeout,
+         struct fuse_entry_param *e)
+{
+    OriFileInfo *old;
+
+    {
+        Monitor m(inodesLock);
+        OriInode &n = inodes[ino];
+        uint64_t nlookup = n.nlookup;
+
+        if (!node.snapshot) {
+            if (n.path != "" && n.path != node.path &&
+                inodePaths[n.path] == ino)
+                inodePaths.erase(n.path);
+            inodePaths[node.path] = ino;
+        }
+        old = n.info;
+        n = node;
+        n.nlookup = nlookup + 1;
+        n.attr.st_ino = ino;
+
+        memset(e, 0, sizeof(*e));
+        e->ino = ino;
+        e->attr = n.attr;
+        e->attr_timeout = timeout;
+        e->entry_timeout = timeout;
+    }
+
+    if (old != NULL)
+        old->release();
+}
+
+static int
+lookupLive(const string &path, struct fuse_entry_param *e)
+{
+    OriInode node;
+    fuse_ino_t ino;
+
+    node.path = path;
+    if (path == ORI_CONTROL_FILEPATH || path == ORI_SNAPSHOT_DIRPATH) {
+        int status = ops->getattr(path.c_str(), &node.attr);
+        if (status < 0)
+            return status;
+        ino = (path == ORI_CONTROL_FILEPATH) ? controlIno : snapshotIno;
+    } else {
+        RWKey::sp lock = priv->nsLock.readLock();
+        try {
+            OriFileInfo *info = priv->getFileInfo(path);
+            Monitor m(info->lock);
+
+            node.attr = info->statInfo;
+            ino = info->id;
+            info->retain();
+            node.info = info;
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
+    }
+
+    addEntry(ino, node, ORILL_TIMEOUT, e);
+    return 0;
+}
+
+/*
+ * Attributes of a snapshot entry, converted like OriPriv::loadDir does.
+ */
+static void
+loadSnapshotEntry(const TreeEntry &te, OriInode *node)
+{
+    OriFileInfo *info = new OriFileInfo();
+
+    node->isTree = (te.type == TreeEntry::Tree);
+    if (node->isTree) {
+        info->statInfo.st_mode = S_IFDIR;
+        info->statInfo.st_nlink = 2;
+    }
+    info->loadAttr(te.attrs);
+    node->attr = info->statInfo;
+    node->hash = te.hash;
+    info->release();
+
+    if (S_ISLNK(node->attr.st_mode))
+        node->link = priv->getRepo()->getPayload(te.hash);
+}
+
+static int
+lookupSnapshot(fuse_ino_t parent, const OriInode &dir, const char *name,
+               struct fuse_entry_param *e)
+{
+    OriInode node;
+    fuse_ino_t ino;
+
+    node.snapshot = true;
+    node.parent = parent;
+    node.path = childPath(dir.path, name);
+
+    try {
+        if (parent == snapshotIno) {
+            map<string, ObjectHash> snapshots = priv->listSnapshots();
+
+            // New snapshots appear, do not cache the miss
+            if (snapshots.find(name) == snapshots.end())
+                return -ENOENT;
+
+            Commit c = priv->lookupSnapshot(name);
+            node.isTree = true;
+            node.hash = c.getTree();
+            node.root = c.getTree();
+            node.treePath = "/";
+            node.attr.st_uid = geteuid();
+            node.attr.st_gid = getegid();
+            node.attr.st_mode = 0755 | S_IFDIR;
+            node.attr.st_nlink = 2;
+            node.attr.st_size = 512;
+            node.attr.st_blksize = 4096;
+            node.attr.st_blocks = 1;
+            node.attr.st_ctime = c.getTime();
+            node.attr.st_mtime = c.getTime();
+        } else {
+            shared_ptr<Tree> t = priv->getTree(dir.root, dir.treePath);
+            if (!t)
+                return -ENOTDIR;
+
+            Tree::iterator it = t->find(name);
+            if (it == t->end()) {
+                // Negative entry, the name never appears
+                memset(e, 0, sizeof(*e));
+                e->entry_timeout = ORILL_SNAPSHOT_TIMEOUT;
+                return 0;
+            }
+            loadSnapshotEntry((*it).second, &node);
+            node.root = dir.root;
+            node.treePath = childPath(dir.treePath, name);
+        }
+    } catch (exception &ex) {
+        FUSE_LOG("Unexpected %s", ex.what());
+        return -EIO;
+    }
+
+    {
+        Monitor m(inodesLock);
+        pair<fuse_ino_t, string> key = make_pair(parent, string(name));
+        map<pair<fuse_ino_t, string>, fuse_ino_t>::iterator it;
+
+        /*
+         * A snapshot name may be reused after a purge, the old inode keeps
+         * the contents the kernel cached for it.
+         */
+        it = snapshotNames.find(key);
+        if (it != snapshotNames.end() &&
+            inodes[(*it).second].hash == node.hash) {
+            ino = (*it).second;
+        } else {
+            ino = priv->generateId();
+            snapshotNames[key] = ino;
+        }
+    }
+
+    addEntry(ino, node, ORILL_SNAPSHOT_TIMEOUT, e);
+    return 0;
+}
+
+static void
+forgetInode(fuse_ino_t ino, uint64_t nlookup)
+{
+    OriFileInfo *info;
+
+    {
+        Monitor m(inodesLock);
+        unordered_map<fuse_ino_t, OriInode>::iterator it = inodes.find(ino);
+
+        if (it == inodes.end())
+            return;
+
+        OriInode &node = (*it).second;
+        ASSERT(node.nlookup >= nlookup);
+        node.nlookup -= nlookup;
+        if (node.nlookup != 0)
+            return;
+
+        info = node.info;
+        if (node.snapshot) {
+            map<pair<fuse_ino_t, string>, fuse_ino_t>::iterator sit;
+
+            sit = snapshotNames.find(make_pair(node.parent,
+                                               OriFile_Basename(node.path)));
+            if (sit != snapshotNames.end() && (*sit).second == ino)
+                snapshotNames.erase(sit);
+        } else if (!node.unlinked) {
+            map<string, fuse_ino_t>::iterator pit;
+
+            pit = inodePaths.find(node.path);
+            if (pit != inodePaths.end() && (*pit).second == ino)
+                inodePaths.erase(pit);
+        }
+
+        inodes.erase(it);
+    }
+
+    // Released outside the table lock, the last reference frees the file
+    if (info != NULL)
+        info->release();
+}
+
+/*
+ * The kernel may still hold the inode of a removed path.
+ */
+static void
+unlinkPath(const string &path)
+{
+    Monitor m(inodesLock);
+    map<string, fuse_ino_t>::iterator it = inodePaths.find(path);
+
+    if (it == inodePaths.end())
+        return;
+
+    OriInode &node = inodes[(*it).second];
+    node.unlinked = true;
+    node.attr.st_nlink = 0;
+    inodePaths.erase(it);
+}
+
+/*
+ * Move the inode of a path and of everything below it.
+ */
+static void
+renamePath(const string &from, const string &to)
+{
+    vector<pair<string, fuse_ino_t> > moved;
+    string prefix = from + "/";
+
+    unlinkPath(to);
+
+    Monitor m(inodesLock);
+    map<string, fuse_ino_t>::iterator it = inodePaths.find(from);
+
+    if (it != inodePaths.end()) {
+        moved.push_back(make_pair(to, (*it).second));
+        inodePaths.erase(it);
+    }
+
+    it = inodePaths.lower_bound(prefix);
+    while (it != inodePaths.end() &&
+           (*it).first.compare(0, prefix.size(), prefix) == 0) {
+        moved.push_back(make_pair(to + (*it).first.substr(from.size()),
+                                  (*it).second));
+        inodePaths.erase(it++);
+    }
+
+    for (size_t i = 0; i < moved.size(); i++) {
+        inodes[moved[i].second].path = moved[i].first;
+        inodePaths[moved[i].first] = moved[i].second;
+    }
+}
+
+// Mount/Unmount
+
+static void
+ori_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    ops->init(conn);
+}
+
+static void
+ori_ll_destroy(void *userdata)
+{
+    ops->destroy(priv);
+}
+
+// Names
+
+static void
+ori_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    OriInode dir;
+    int status;
+
+    FUSE_LOG("FUSE ori_ll_lookup(parent=%lu, name=\"%s\")", parent, name);
+
+    if (!getInode(parent, &dir)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    if (parent == snapshotIno || dir.snapshot) {
+        status = lookupSnapshot(parent, dir, name, &e);
+    } else {
+        status = lookupLive(childPath(dir.path, name), &e);
+    }
+
+    if (status < 0)
+        fuse_reply_err(req, -status);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void
+ori_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    forgetInode(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+// File Attributes
+
+static void
+ori_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    OriInode node;
+    OriFileInfo *info;
+    struct stat st;
+
+    FUSE_LOG("FUSE ori_ll_getattr(ino=%lu)", ino);
+
+    if (!getInodeInfo(ino, &node, &info)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    if (node.snapshot) {
+        fuse_reply_attr(req, &node.attr, ORILL_SNAPSHOT_TIMEOUT);
+        return;
+    }
+
+    int status = statLive(node, info, &st);
+    if (info != NULL)
+        info->release();
+    if (status < 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, ORILL_TIMEOUT);
+}
+
+static void
+ori_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+               int to_set, struct fuse_file_info *fi)
+{
+    OriInode node;
+    OriFileInfo *info;
+    const char *path;
+    struct stat st;
+    int status = 0;
+
+    FUSE_LOG("FUSE ori_ll_setattr(ino=%lu, to_set=%x)", ino, to_set);
+
+    if (!getInodeInfo(ino, &node, &info)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    if (node.snapshot || node.unlinked) {
+        if (info != NULL)
+            info->release();
+        fuse_reply_err(req, node.snapshot ? EACCES : ENOENT);
+        return;
+    }
+
+    path = node.path.c_str();
+    status = statLive(node, info, &st);
+
+    if (status == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+        status = ops->chmod(path, attr->st_mode);
+    }
+    if (status == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : st.st_uid;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : st.st_gid;
+
+        status = ops->chown(path, uid, gid);
+    }
+    if (status == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (fi != NULL)
+            status = ops->ftruncate(path, attr->st_size, fi);
+        else
+            status = ops->truncate(path, attr->st_size);
+    }
+    if (status == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                                  FUSE_SET_ATTR_ATIME_NOW |
+                                  FUSE_SET_ATTR_MTIME_NOW))) {
+        struct timespec tv[2];
+
+        memset(tv, 0, sizeof(tv));
+        tv[0].tv_sec = st.st_atime;
+        tv[1].tv_sec = st.st_mtime;
+        if (to_set & FUSE_SET_ATTR_ATIME)
+            tv[0].tv_sec = attr->st_atime;
+        if (to_set & FUSE_SET_ATTR_MTIME)
+            tv[1].tv_sec = attr->st_mtime;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            tv[0].tv_sec = time(NULL);
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            tv[1].tv_sec = time(NULL);
+
+        status = ops->utimens(path, tv);
+    }
+    if (status == 0)
+        status = statLive(node, info, &st);
+    if (info != NULL)
+        info->release();
+
+    if (status < 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, ORILL_TIMEOUT);
+}
+
+static void
+ori_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    OriInode node;
+    OriFileInfo *info;
+    string link;
+
+    if (!getInodeInfo(ino, &node, &info)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    if (info != NULL) {
+        {
+            RWKey::sp lock = priv->nsLock.readLock();
+            Monitor m(info->lock);
+
+            node.attr = info->statInfo;
+            link = info->link;
+        }
+        info->release();
+    } else {
+        link = node.link;
+    }
+
+    if (!S_ISLNK(node.attr.st_mode)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    fuse_reply_readlink(req, link.c_str());
+}
+
+// File Manipulation
+
+/*
+ * Forward a request that creates a name and reply with its entry.
+ */
+static void
+replyCreated(fuse_req_t req, int status, const string &path)
+{
+    struct fuse_entry_param e;
+
+    if (status == 0)
+        status = lookupLive(path, &e);
+
+    if (status < 0)
+        fuse_reply_err(req, -status);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static bool
+getParentPath(fuse_req_t req, fuse_ino_t parent, const char *name,
+              string *path)
+{
+    OriInode dir;
+
+    if (!getInode(parent, &dir)) {
+        fuse_reply_err(req, ESTALE);
+        return false;
+    }
+    if (dir.unlinked) {
+        fuse_reply_err(req, ENOENT);
+        return false;
+    }
+
+    *path = childPath(dir.path, name);
+    return true;
+}
+
+static void
+ori_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+             mode_t mode, dev_t rdev)
+{
+    string path;
+
+    if (!getParentPath(req, parent, name, &path))
+        return;
+
+    replyCreated(req, ops->mknod(path.c_str(), mode, rdev), path);
+}
+
+static void
+ori_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+             mode_t mode)
+{
+    string path;
+
+    if (!getParentPath(req, parent, name, &path))
+        return;
+
+    replyCreated(req, ops->mkdir(path.c_str(), mode), path);
+}
+
+static void
+ori_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+               const char *name)
+{
+    string path;
+
+    if (!getParentPath(req, parent, name, &path))
+        return;
+
+    replyCreated(req, ops->symlink(link, path.c_str()), path);
+}
+
+static void
+ori_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    string path;
+
+    if (!getParentPath(req, parent, name, &path))
+        return;
+
+    int status = ops->unlink(path.c_str());
+    if (status == 0)
+        unlinkPath(path);
+
+    fuse_reply_err(req, -status);
+}
+
+static void
+ori_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    string path;
+
+    if (!getParentPath(req, parent, name, &path))
+        return;
+
+    int status = ops->rmdir(path.c_str());
+    if (status == 0)
+        unlinkPath(path);
+
+    fuse_reply_err(req, -status);
+}
+
+static void
+ori_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+              fuse_ino_t newparent, const char *newname)
+{
+    string from, to;
+
+    if (!getParentPath(req, parent, name, &from))
+        return;
+    if (!getParentPath(req, newparent, newname, &to))
+        return;
+
+    int status = ops->rename(from.c_str(), to.c_str());
+    if (status == 0)
+        renamePath(from, to);
+
+    fuse_reply_err(req, -status);
+}
+
+// File IO
+
+static void
+ori_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+              mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    string path;
+
+    if (!getParentPath(req, parent, name, &path))
+        return;
+
+    int status = ops->create(path.c_str(), mode, fi);
+    if (status < 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    status = lookupLive(path, &e);
+    if (status < 0) {
+        ops->release(path.c_str(), fi);
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    fuse_reply_create(req, &e, fi);
+}
+
+/*
+ * Snapshot files are read through their own OriFileInfo, which holds the
+ * decoded objects while the file is open.
+ */
+static void
+openSnapshot(fuse_req_t req, const OriInode &node, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    if (node.isTree) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    OriFileInfo *info = new OriFileInfo();
+    info->type = FILETYPE_COMMITTED;
+    info->hash = node.hash;
+    info->statInfo = node.attr;
+    info->retainFd();
+
+    fi->fh = (uint64_t)(uintptr_t)info;
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void
+ori_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    OriInode node;
+
+    FUSE_LOG("FUSE ori_ll_open(ino=%lu)", ino);
+
+    if (!getInode(ino, &node)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    if (node.snapshot) {
+        openSnapshot(req, node, fi);
+        return;
+    }
+    if (node.unlinked) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int status = ops->open(node.path.c_str(), fi);
+    if (status < 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    fuse_reply_open(req, fi);
+}
+
+static void
+ori_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info *fi)
+{
+    OriInode node;
+    vector<char> buf(size);
+    int status;
+
+    if (!getInode(ino, &node)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    if (node.snapshot) {
+        OriFileInfo *info = (OriFileInfo *)(uintptr_t)fi->fh;
+
+        status = (int)priv->readFile(info, &buf[0], size, off);
+    } else {
+        status = ops->read(node.path.c_str(), &buf[0], size, off, fi);
+    }
+
+    if (status < 0)
+        fuse_reply_err(req, -status);
+    else
+        fuse_reply_buf(req, &buf[0], status);
+}
+
+static void
+ori_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+             off_t off, struct fuse_file_info *fi)
+{
+    OriInode node;
+
+    if (!getInode(ino, &node)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    int status = ops->write(node.path.c_str(), buf, size, off, fi);
+    if (status < 0)
+        fuse_reply_err(req, -status);
+    else
+        fuse_reply_write(req, status);
+}
+
+static void
+ori_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    OriInode node;
+
+    if (!getInode(ino, &node)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    if (node.snapshot) {
+        OriFileInfo *info = (OriFileInfo *)(uintptr_t)fi->fh;
+
+        {
+            Monitor m(info->lock);
+            info->releaseFd();
+        }
+        info->release();
+        fuse_reply_err(req, 0);
+        return;
+    }
+
+    fuse_reply_err(req, -ops->release(node.path.c_str(), fi));
+}
+
+static void
+ori_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+             struct fuse_file_info *fi)
+{
+    OriInode node;
+
+    if (!getInode(ino, &node)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    if (node.snapshot) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+
+    fuse_reply_err(req, -ops->fsync(node.path.c_str(), datasync, fi));
+}
+
+// Directory Operations
+
+static void
+addDirEntry(fuse_req_t req, string *buf, const char *name,
+            fuse_ino_t ino, mode_t mode)
+{
+    struct stat st;
+    size_t off = buf->size();
+    size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ino;
+    st.st_mode = mode;
+    buf->resize(off + len);
+    fuse_add_direntry(req, &(*buf)[off], len, name, &st, off + len);
+}
+
+/*
+ * Entries are listed with their inode number and type, tools like find do
+ * not need to stat them.
+ */
+static int
+listLive(fuse_req_t req, fuse_ino_t ino, const OriInode &node, string *buf)
+{
+    vector<pair<string, OriPrivId> > entries;
+    string dirPath = (node.path == "/") ? "/" : node.path + "/";
+    RWKey::sp lock = priv->nsLock.readLock();
+
+    try {
+        OriDir *dir = priv->getDir(node.path);
+        Monitor m(dir->lock);
+
+        for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
+            entries.push_back(*it);
+        }
+    } catch (SystemException &e) {
+        return -e.getErrno();
+    }
+
+    if (ino == FUSE_ROOT_ID) {
+        addDirEntry(req, buf, ORI_CONTROL_FILENAME, controlIno, S_IFREG);
+        addDirEntry(req, buf, ORI_SNAPSHOT_DIRNAME, snapshotIno, S_IFDIR);
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        mode_t mode = 0;
+
+        try {
+            OriFileInfo *info = priv->getFileInfo(dirPath + entries[i].first);
+            Monitor m(info->lock);
+
+            mode = info->statInfo.st_mode & S_IFMT;
+        } catch (SystemException &e) {
+            FUSE_LOG("Unexpected %s", e.what());
+        }
+        addDirEntry(req, buf, entries[i].first.c_str(), entries[i].second,
+                    mode);
+    }
+
+    return 0;
+}
+
+static int
+listSnapshot(fuse_req_t req, fuse_ino_t ino, const OriInode &node,
+             string *buf)
+{
+    try {
+        if (ino == snapshotIno) {
+            map<string, ObjectHash> snapshots = priv->listSnapshots();
+            map<string, ObjectHash>::iterator it;
+
+            for (it = snapshots.begin(); it != snapshots.end(); it++) {
+                addDirEntry(req, buf, (*it).first.c_str(), ORILL_UNKNOWN_INO,
+                            S_IFDIR);
+            }
+            return 0;
+        }
+
+        shared_ptr<Tree> t = priv->getTree(node.root, node.treePath);
+        if (!t)
+            return -ENOTDIR;
+
+        for (Tree::iterator it = t->begin(); it != t->end(); it++) {
+            const TreeEntry &te = (*it).second;
+            mode_t mode = S_IFREG;
+
+            if (te.type == TreeEntry::Tree)
+                mode = S_IFDIR;
+            else if (te.attrs.has(ATTR_SYMLINK) &&
+                     te.attrs.getAs<bool>(ATTR_SYMLINK))
+                mode = S_IFLNK;
+            addDirEntry(req, buf, (*it).first.c_str(), ORILL_UNKNOWN_INO,
+                        mode);
+        }
+    } catch (exception &e) {
+        FUSE_LOG("Unexpected %s", e.what());
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * The listing is built once on open and read from the handle.
+ */
+static void
+ori_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    OriInode node;
+    string *buf;
+    int status;
+
+    FUSE_LOG("FUSE ori_ll_opendir(ino=%lu)", ino);
+
+    if (!getInode(ino, &node)) {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    if (node.unlinked) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (node.snapshot && !node.isTree) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    buf = new string();
+    addDirEntry(req, buf, ".", ino, S_IFDIR);
+    addDirEntry(req, buf, "..", ORILL_UNKNOWN_INO, S_IFDIR);
+
+    if (ino == snapshotIno || node.snapshot)
+        status = listSnapshot(req, ino, node, buf);
+    else
+        status = listLive(req, ino, node, buf);
+
+    if (status < 0) {
+        delete buf;
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)buf;
+    fuse_reply_open(req, fi);
+}
+
+static void
+ori_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info *fi)
+{
+    string *buf = (string *)(uintptr_t)fi->fh;
+
+    if ((size_t)off >= buf->size()) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    fuse_reply_buf(req, buf->data() + off, MIN(size, buf->size() - off));
+}
+
+static void
+ori_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    delete (string *)(uintptr_t)fi->fh;
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops ori_ll_oper;
+
+static void
+ori_setup_ori_ll_oper()
+{
+    memset(&ori_ll_oper, 0, sizeof(struct fuse_lowlevel_ops));
+
+    ori_ll_oper.init = ori_ll_init;
+    ori_ll_oper.destroy = ori_ll_destroy;
+
+    ori_ll_oper.lookup = ori_ll_lookup;
+    ori_ll_oper.forget = ori_ll_forget;
+    ori_ll_oper.getattr = ori_ll_getattr;
+    ori_ll_oper.setattr = ori_ll_setattr;
+    ori_ll_oper.readlink = ori_ll_readlink;
+
+    ori_ll_oper.mknod = ori_ll_mknod;
+    ori_ll_oper.mkdir = ori_ll_mkdir;
+    ori_ll_oper.symlink = ori_ll_symlink;
+    ori_ll_oper.unlink = ori_ll_unlink;
+    ori_ll_oper.rmdir = ori_ll_rmdir;
+    ori_ll_oper.rename = ori_ll_rename;
+
+    ori_ll_oper.create = ori_ll_create;
+    ori_ll_oper.open = ori_ll_open;
+    ori_ll_oper.read = ori_ll_read;
+    ori_ll_oper.write = ori_ll_write;
+    ori_ll_oper.release = ori_ll_release;
+    ori_ll_oper.fsync = ori_ll_fsync;
+
+    ori_ll_oper.opendir = ori_ll_opendir;
+    ori_ll_oper.readdir = ori_ll_readdir;
+    ori_ll_oper.releasedir = ori_ll_releasedir;
+}
+
+/*
+ * The root, the control file and .snapshot are never forgotten.
+ */
+static void
+ori_ll_setup_inodes()
+{
+    OriInode root;
+
+    root.path = "/";
+    root.nlookup = 1;
+    {
+        RWKey::sp lock = priv->nsLock.readLock();
+
+        root.info = priv->getFileInfo("/");
+        root.info->retain();
+    }
+    inodes[FUSE_ROOT_ID] = root;
+    inodePaths["/"] = FUSE_ROOT_ID;
+
+    controlIno = priv->generateId();
+    snapshotIno = priv->generateId();
+}
+
+int
+ori_ll_main(struct fuse_args *args, const struct fuse_operations *oper)
+{
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int err = -1;
+
+    ops = oper;
+    ori_setup_ori_ll_oper();
+    ori_ll_setup_inodes();
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                           &foreground) == -1)
+        return 1;
+
+    ch = fuse_mount(mountpoint, args);
+    if (ch == NULL) {
+        free(mountpoint);
+        return 1;
+    }
+
+    se = fuse_lowlevel_new(args, &ori_ll_oper, sizeof(ori_ll_oper), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            fuse_session_add_chan(se, ch);
+            fuse_daemonize(foreground);
+            if (multithreaded)
+                err = fuse_session_loop_mt(se);
+            else
+                err = fuse_session_loop(se);
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+    free(mountpoint);
+
+    return err ? 1 : 0;
+}
+
@@ -30,8 +30,10 @@ struct mount_ori_config {
     // Used by orifs
     int cache;
     int journal;
+    int objcache;
     int single;
     int debug;
+    int lowlevel;
     std::string repoPath;
     std::string clonePath;
     std::string mountPoint;
@@ -42,8 +44,10 @@ struct mount_ori_config {
       , show_version(0)
       , cache(OriCacheMode::Deep)
       , journal(OriJournalMode::AsyncJournal)
+      , objcache(-1)
       , single(0)
       , debug(0)
+      , lowlevel(0)
       , repoPath()
       , clonePath()
       , mountPoint()
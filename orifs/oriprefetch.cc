@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <oriutil/debug.h>
+#include <oriutil/thread.h>
+#include <oriutil/rwlock.h>
+#include <ori/tree.h>
+#include <ori/localrepo.h>
+
+#include "oripriv.h"
+#include "oriprefetch.h"
+
+using namespace std;
+
+class PrefetchWorker : public Thread
+{
+public:
+    PrefetchWorker(OriPrefetcher *prefetcher)
+        : Thread("PrefetchWorker"), prefetcher(prefetcher)
+    {
+    }
+    virtual void run()
+    {
+        OriPrefetcher::Job job;
+
+        while (prefetcher->nextJob(&job)) {
+            // Nobody else holds the cache once the file is closed
+            if (!job.cache)
+                prefetcher->fetchTrees(job.objs);
+            else if (job.cache.use_count() > 1)
+                job.cache->prefetch(job.objs, prefetcher->lock);
+            job.cache.reset();
+        }
+    }
+private:
+    OriPrefetcher *prefetcher;
+};
+
+OriPrefetcher::OriPrefetcher(LocalRepo *repo, RWLock *lock, int threads)
+    : repo(repo), lock(lock), exiting(false)
+{
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(new PrefetchWorker(this));
+        workers.back()->start();
+    }
+}
+
+OriPrefetcher::~OriPrefetcher()
+{
+    {
+        unique_lock<mutex> l(queueLock);
+        exiting = true;
+        queue.clear();
+    }
+    queueCV.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+}
+
+void
+OriPrefetcher::submit(OriFileCache::sp cache, const vector<ObjectHash> &objs)
+{
+    {
+        unique_lock<mutex> l(queueLock);
+
+        if (exiting || queue.size() >= ORIPREFETCH_MAXJOBS)
+            return;
+
+        queue.push_back(Job());
+        queue.back().cache = cache;
+        queue.back().objs = objs;
+    }
+    queueCV.notify_one();
+}
+
+void
+OriPrefetcher::submitTrees(const vector<ObjectHash> &trees)
+{
+    submit(OriFileCache::sp(), trees);
+}
+
+bool
+OriPrefetcher::nextJob(Job *job)
+{
+    unique_lock<mutex> l(queueLock);
+
+    while (queue.empty() && !exiting)
+        queueCV.wait(l);
+    if (queue.empty())
+        return false;
+
+    *job = queue.front();
+    queue.pop_front();
+    return true;
+}
+
+/*
+ * Fetch the missing trees one level at a time, each level is a single
+ * request to the remote.  Stops at a level that is stored already, the
+ * directories there fetch their own subtrees once they are loaded.  Only
+ * the repository is used, it locks itself, so nsLock is not held.
+ */
+void
+OriPrefetcher::fetchTrees(vector<ObjectHash> trees)
+{
+    size_t fetched = 0;
+
+    try {
+        while (!trees.empty() && !isExiting()) {
+            bytestream::ap received(repo->fetchObjects(trees));
+            vector<ObjectHash> next;
+
+            if (!received.get())
+                return;
+            fetched += trees.size();
+
+            repo->receive(received.get());
+            for (size_t i = 0; i < trees.size(); i++) {
+                Tree t = repo->getTree(trees[i]);
+
+                for (Tree::iterator it = t.begin(); it != t.end(); it++) {
+                    if (fetched + next.size() >= ORIPREFETCH_MAXTREES)
+                        break;
+                    if (it->second.type == TreeEntry::Tree)
+                        next.push_back(it->second.hash);
+                }
+            }
+            trees.swap(next);
+        }
+    } catch (exception &e) {
+        WARNING("Prefetch failed: %s", e.what());
+    }
+}
+
+bool
+OriPrefetcher::isExiting()
+{
+    unique_lock<mutex> l(queueLock);
+
+    return exiting;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORIFS_ORIPREFETCH_H__
+#define __ORIFS_ORIPREFETCH_H__
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// Threads decoding and fetching objects ahead of readers
+#define ORIPREFETCH_THREADS 4
+// Read-ahead requests queued before new ones are dropped
+#define ORIPREFETCH_MAXJOBS 256
+// Trees fetched below a directory that is loaded
+#define ORIPREFETCH_MAXTREES 4096
+
+class PrefetchWorker;
+
+/*
+ * Pool of threads running OriFileCache::prefetch and fetching the trees
+ * below loaded directories from an instaclone remote.  Prefetching is
+ * advisory, requests are dropped when the queue is full and the requests of
+ * closed files are skipped.
+ */
+class OriPrefetcher
+{
+public:
+    /// @param lock Namespace lock
+    OriPrefetcher(LocalRepo *repo, RWLock *lock,
+                  int threads = ORIPREFETCH_THREADS);
+    ~OriPrefetcher();
+    void submit(OriFileCache::sp cache, const std::vector<ObjectHash> &objs);
+    /// Fetch the subdirectory trees of a directory being loaded
+    void submitTrees(const std::vector<ObjectHash> &trees);
+private:
+    friend class PrefetchWorker;
+
+    // Jobs without a cache fetch trees
+    struct Job {
+        OriFileCache::sp cache;
+        std::vector<ObjectHash> objs;
+    };
+
+    bool nextJob(Job *job);
+    void fetchTrees(std::vector<ObjectHash> trees);
+    bool isExiting();
+
+    LocalRepo *repo;
+    RWLock *lock;
+    std::vector<PrefetchWorker *> workers;
+
+    std::mutex queueLock;
+    std::condition_variable queueCV;
+    std::deque<Job> queue;
+    bool exiting;
+};
+
+#endif /* __ORIFS_ORIPREFETCH_H__ */
+
@@ -35,6 +35,7 @@
 #include <unordered_map>
 
 #include <oriutil/debug.h>
+#include <oriutil/monitor.h>
 #include <oriutil/orifile.h>
 #include <oriutil/scan.h>
 #include <oriutil/systemexception.h>
@@ -42,11 +43,15 @@
 #include <oriutil/objecthash.h>
 #include <ori/commit.h>
 #include <ori/localrepo.h>
+#include <ori/objectpipeline.h>
+#include <ori/repacker.h>
 #include <ori/treediff.h>
 
 #include "logging.h"
 #include "oricmd.h"
 #include "oripriv.h"
+#include "oriprefetch.h"
+#include "oriwriteback.h"
 #include "oriopt.h"
 #include "server.h"
 
@@ -54,14 +59,20 @@ using namespace std;
 
 // XXX: Hacky remove dependence
 extern mount_ori_config config;
+extern OriPriv *priv;
 
 void
 OriFileInfo::loadAttr(const AttrMap &attrs)
 {
-    struct passwd *pw = getpwnam(attrs.getAsStr(ATTR_USERNAME).c_str());
+    struct passwd pwd;
+    struct passwd *pw = NULL;
+    char buf[1024];
 
+    // Directories are loaded concurrently, use the reentrant lookups
+    getpwnam_r(attrs.getAsStr(ATTR_USERNAME).c_str(),
+               &pwd, buf, sizeof(buf), &pw);
     if (pw == NULL) {
-      pw = getpwuid(getuid());
+      getpwuid_r(getuid(), &pwd, buf, sizeof(buf), &pw);
       NOT_IMPLEMENTED(pw != NULL);
     }
 
@@ -119,16 +130,411 @@ OriFileInfo::storeAttr(AttrMap *attrs) const
     attrs->setAs<time_t>(ATTR_CTIME, statInfo.st_ctime);
 }
 
+/*
+ * Add the range from off to end, ranges that overlap or touch are merged.
+ */
+static void
+addRange(map<uint64_t, uint64_t> *ranges, uint64_t off, uint64_t end)
+{
+    map<uint64_t, uint64_t>::iterator it;
+
+    it = ranges->upper_bound(off);
+    if (it != ranges->begin()) {
+        it--;
+        if ((*it).second < off)
+            it++;
+    }
+    while (it != ranges->end() && (*it).first <= end) {
+        off = min(off, (*it).first);
+        end = max(end, (*it).second);
+        it = ranges->erase(it);
+    }
+    (*ranges)[off] = end;
+}
+
+/*
+ * Record a write to the temporary file.  Caller holds the lock.
+ */
+void
+OriFileInfo::markDirty(uint64_t off, uint64_t len)
+{
+    writeGen++;
+    if (len == 0)
+        return;
+
+    addRange(&dirtyRanges, off, off + len);
+    if (overlay)
+        addRange(&overlay->written, off, off + len);
+}
+
+/*
+ * Start tracking the writes to a new temporary file, copied from the
+ * LargeBlob base or else chunked whole.  Caller holds the lock.
+ */
+void
+OriFileInfo::resetDirty(const ObjectHash &base)
+{
+    baseHash = base;
+    dirtyRanges.clear();
+    chunked.reset();
+    overlay.reset();
+    writeGen++;
+}
+
+OriOverlay::Ranges
+OriOverlay::baseRanges(uint64_t off, uint64_t end) const
+{
+    map<uint64_t, uint64_t>::const_iterator it;
+    Ranges ranges;
+
+    end = min(end, baseSize);
+    it = written.upper_bound(off);
+    if (it != written.begin()) {
+        it--;
+        if ((*it).second <= off)
+            it++;
+    }
+    for (; off < end; it++) {
+        uint64_t next = it == written.end() ? end : min(end, (*it).first);
+
+        if (off < next)
+            ranges.push_back(make_pair(off, next));
+        if (it == written.end())
+            break;
+        off = max(off, (*it).second);
+    }
+
+    return ranges;
+}
+
+int
+OriOverlay::readBase(uint8_t *buf, uint64_t off, const Ranges &ranges) const
+{
+    for (size_t i = 0; i < ranges.size(); i++) {
+        size_t len = ranges[i].second - ranges[i].first;
+        ssize_t status;
+
+        status = base->read(buf + ranges[i].first - off, len, ranges[i].first);
+        if (status != (ssize_t)len)
+            return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads a temporary file for chunking, through its overlay if it has one.
+ * Write-back threads pass a copy of the overlay, the writes made meanwhile
+ * are chunked again.
+ */
+class OriOverlaySource : public LargeBlobSource
+{
+public:
+    explicit OriOverlaySource(OriOverlay::sp overlay)
+        : overlay(overlay)
+    {
+    }
+    int open(const string &path)
+    {
+        return file.open(path);
+    }
+    virtual uint64_t size()
+    {
+        return file.size();
+    }
+    virtual ssize_t read(uint8_t *buf, size_t len, uint64_t off)
+    {
+        ssize_t status = file.read(buf, len, off);
+
+        if (status <= 0 || !overlay)
+            return status;
+        if (overlay->readBase(buf, off,
+                              overlay->baseRanges(off, off + status)) < 0)
+            return -EIO;
+
+        return status;
+    }
+private:
+    LargeBlobFile file;
+    OriOverlay::sp overlay;
+};
+
+OriFileCache::OriFileCache(LocalRepo *repo, OriPrefetcher *prefetcher,
+                           const ObjectHash &hash)
+    : hash(hash), repo(repo), prefetcher(prefetcher), loaded(false),
+      type(ObjectInfo::Null), chunks(ORIFILECACHE_MAXBYTES, 1),
+      seqEnd(0), raEnd(0), raWindow(0)
+{
+}
+
+OriFileCache::~OriFileCache()
+{
+}
+
+/*
+ * Look up the file type and parse the LargeBlob.  Caller holds the lock.
+ */
+bool
+OriFileCache::load()
+{
+    if (loaded)
+        return true;
+
+    type = repo->getObjectType(hash);
+    if (type == ObjectInfo::LargeBlob) {
+        lb.reset(new LargeBlob(repo));
+        lb->fromBlob(repo->getPayload(hash));
+    } else if (type == ObjectInfo::Blob) {
+        // Framed blobs can be read in part, only small ones are kept whole
+        if (repo->getObjectLength(hash) > ORIFILECACHE_MAXBLOB)
+            type = ObjectInfo::Null;
+    } else {
+        return false;
+    }
+
+    loaded = true;
+    return true;
+}
+
+OriFileCache::Payload
+OriFileCache::getPayload(const ObjectHash &objId)
+{
+    {
+        unique_lock<mutex> l(lock);
+
+        while (true) {
+            Payload p = chunks.get(objId);
+            if (p)
+                return p;
+            // Wait rather than decoding the object twice
+            if (fetching.find(objId) == fetching.end())
+                break;
+            fetchedCV.wait(l);
+        }
+    }
+
+    // Decode without the lock so other chunks can be read meanwhile
+    Payload p(new string(repo->getPayload(objId)));
+    chunks.put(objId, p, p->size());
+
+    return p;
+}
+
+/*
+ * Runs on a prefetcher thread.  Objects are fetched from an instaclone
+ * remote without the namespace lock and the repository stores them under
+ * its own lock.  Local objects are decoded with nsLock held for reading.
+ */
+void
+OriFileCache::prefetch(const vector<ObjectHash> &objs, RWLock *nsLock)
+{
+    vector<ObjectHash> wanted;
+    size_t done = 0;
+
+    try {
+        bytestream::ap received(repo->fetchObjects(objs));
+
+        if (received.get())
+            repo->receive(received.get());
+    } catch (exception &e) {
+        WARNING("Prefetch failed: %s", e.what());
+        return;
+    }
+
+    RWKey::sp key = nsLock->readLock();
+
+    {
+        unique_lock<mutex> l(lock);
+
+        for (size_t i = 0; i < objs.size(); i++) {
+            if (!chunks.hasKey(objs[i]) && fetching.insert(objs[i]).second)
+                wanted.push_back(objs[i]);
+        }
+    }
+
+    try {
+        for (; done < wanted.size(); done++) {
+            Payload p(new string(repo->getPayload(wanted[done])));
+            unique_lock<mutex> l(lock);
+
+            chunks.put(wanted[done], p, p->size());
+            fetching.erase(wanted[done]);
+            fetchedCV.notify_all();
+        }
+    } catch (exception &e) {
+        WARNING("Prefetch failed: %s", e.what());
+    }
+
+    // Readers decode whatever was not fetched themselves
+    unique_lock<mutex> l(lock);
+    for (; done < wanted.size(); done++)
+        fetching.erase(wanted[done]);
+    fetchedCV.notify_all();
+}
+
+/*
+ * Detect sequential reads and hand the chunks of the next window to the
+ * prefetcher.  Caller holds the lock.
+ */
+void
+OriFileCache::readAhead(off_t offset, size_t size)
+{
+    uint64_t end = offset + size;
+    vector<ObjectHash> objs;
+
+    if ((uint64_t)offset != seqEnd) {
+        raWindow = 0;
+        raEnd = 0;
+    } else if (raEnd < end + raWindow / 2) {
+        uint64_t from = MAX(raEnd, end);
+
+        if (raWindow == 0)
+            raWindow = ORIFILECACHE_READAHEAD_MIN;
+        else
+            raWindow = MIN(raWindow * 2, ORIFILECACHE_READAHEAD_MAX);
+        raEnd = end + raWindow;
+
+        for (size_t i = lb->findPart(from);
+                i < lb->parts.size() && lb->offsets[i] < raEnd;
+                i++) {
+            objs.push_back(lb->parts[i].hash);
+        }
+    }
+    seqEnd = end;
+
+    if (!objs.empty())
+        prefetcher->submit(shared_from_this(), objs);
+}
+
+ssize_t
+OriFileCache::read(uint8_t *buf, size_t size, off_t offset)
+{
+    {
+        unique_lock<mutex> l(lock);
+
+        if (!load())
+            return -EIO;
+        if (type == ObjectInfo::LargeBlob && prefetcher != NULL)
+            readAhead(offset, size);
+    }
+
+    if (type == ObjectInfo::Null) {
+        return repo->readPayload(hash, buf, size, offset);
+    } else if (type == ObjectInfo::Blob) {
+        Payload p = getPayload(hash);
+
+        if ((size_t)offset >= p->size())
+            return 0;
+        size = MIN(size, p->size() - offset);
+        memcpy(buf, p->data() + offset, size);
+        return size;
+    }
+
+    // The LargeBlob is not modified once loaded
+    size_t total = 0;
+    for (size_t i = lb->findPart(offset);
+            i < lb->parts.size() && total < size;
+            i++) {
+        uint64_t partOff = offset + total - lb->offsets[i];
+        const LBlobEntry &part = lb->parts[i];
+
+        Payload p = getPayload(part.hash);
+        size_t n = MIN(size - total, part.length - partOff);
+        if (partOff + n > p->size())
+            return -EIO;
+
+        memcpy(buf + total, p->data() + partOff, n);
+        total += n;
+    }
+
+    return total;
+}
+
+OriPathMap::OriPathMap()
+{
+}
+
+OriPathMap::~OriPathMap()
+{
+}
+
+OriFileInfo *
+OriPathMap::find(const string &path)
+{
+    Shard &s = getShard(path);
+    Monitor m(s.lock);
+    unordered_map<string, OriFileInfo *>::iterator it = s.paths.find(path);
+
+    if (it == s.paths.end())
+        return NULL;
+
+    return (*it).second;
+}
+
+void
+OriPathMap::insert(const string &path, OriFileInfo *info)
+{
+    Shard &s = getShard(path);
+    Monitor m(s.lock);
+
+    s.paths[path] = info;
+}
+
+OriFileInfo *
+OriPathMap::remove(const string &path)
+{
+    Shard &s = getShard(path);
+    Monitor m(s.lock);
+    unordered_map<string, OriFileInfo *>::iterator it = s.paths.find(path);
+    OriFileInfo *info;
+
+    if (it == s.paths.end())
+        return NULL;
+
+    info = (*it).second;
+    s.paths.erase(it);
+
+    return info;
+}
+
+vector<pair<string, OriFileInfo *> >
+OriPathMap::list()
+{
+    vector<pair<string, OriFileInfo *> > entries;
+
+    for (int i = 0; i < ORIPATHMAP_SHARDS; i++) {
+        Monitor m(shards[i].lock);
+
+        entries.insert(entries.end(),
+                       shards[i].paths.begin(), shards[i].paths.end());
+    }
+    sort(entries.begin(), entries.end());
+
+    return entries;
+}
+
+OriPathMap::Shard &
+OriPathMap::getShard(const string &path)
+{
+    return shards[hash<string>()(path) % ORIPATHMAP_SHARDS];
+}
+
 OriPriv::OriPriv(const std::string &repoPath,
                  const string &origin,
                  Repo *remoteRepo)
+    : snapshotTrees(ORISNAPSHOT_CACHEENTRIES, ORISNAPSHOT_CACHESHARDS)
 {
     repo = new LocalRepo(repoPath);
+    repacker = NULL;
+    prefetcher = NULL;
+    writeBack = NULL;
     nextId = ORIPRIVID_INVALID + 1;
     nextFH = 1;
 
     try {
         repo->open();
+        // Objects are only referenced once a snapshot is taken, commit syncs
+        repo->setGroupCommit(true);
         if (ori_open_log(repo->getLogPath()) < 0)
             printf("Couldn't open log!\n");
     } catch (exception &e) {
@@ -181,7 +587,7 @@ OriPriv::OriPriv(const std::string &repoPath,
         dirInfo->type = FILETYPE_COMMITTED;
     }
 
-    paths["/"] = dirInfo;
+    paths.insert("/", dirInfo);
 }
 
 OriPriv::~OriPriv()
@@ -212,7 +618,10 @@ OriPriv::reset()
     "Check the .ori/tmp/fuse directory for any files that may not have been\n"
     "saved to the file systems store.  You can copy or move these files to\n"
     "another location. Then delete the .ori/tmp/fuse directory and all\n"
-    "remaining files.\n\n");
+    "remaining files.\n\n"
+    "Files named sparse.* were opened from large files and may hold only the\n"
+    "bytes written since, the rest of the file reads as zeros.  Recover them\n"
+    "by writing those bytes into a copy of the file from the last snapshot.\n\n");
         printf("Notes: This is a known bug and will be fixed in the future.\n");
         exit(1);
     }
@@ -229,6 +638,18 @@ void
 OriPriv::init()
 {
     UDSServerStart(repo);
+
+    // Reclaim the space of purged snapshots in the background, ORI_REPACKRATE
+    // limits the copy rate in MB/s (0 is unlimited)
+    repacker = new Repacker(repo, &nsLock);
+    const char *rate = getenv("ORI_REPACKRATE");
+    if (rate != NULL) {
+        repacker->setRate(strtoul(rate, NULL, 10) * 1024 * 1024);
+    }
+    repacker->start();
+
+    prefetcher = new OriPrefetcher(repo, &nsLock);
+    writeBack = new OriWriteBack(this);
 }
 
 int
@@ -244,18 +665,31 @@ OriPriv::cleanup()
 {
     tmpDir = repo->getRootPath() + ORI_PATH_TMP + "fuse";
 
+    // Finish chunking before the temporary files are deleted
+    delete writeBack;
+    writeBack = NULL;
+
     // XXX: Delete all files on exit, but need support to delete only closed 
     // and committed files.  This would allow us to reclaim temporary space 
     // after a commit.
     DirIterate(tmpDir, this, cleanupHelper);
 
+    if (repacker != NULL) {
+        repacker->stop();
+        delete repacker;
+        repacker = NULL;
+    }
+
+    delete prefetcher;
+    prefetcher = NULL;
+
     UDSServerStop();
 }
 
 pair<string, int>
-OriPriv::getTemp()
+OriPriv::getTemp(const string &prefix)
 {
-    string filePath = tmpDir + "/obj.XXXXXX";
+    string filePath = tmpDir + "/" + prefix + ".XXXXXX";
     char tmpPath[PATH_MAX];
     int fd;
 
@@ -275,27 +709,19 @@ OriPriv::getTemp()
 uint64_t
 OriPriv::generateFH()
 {
-    uint64_t fh = nextFH;
-
-    nextFH++;
-
-    return fh;
+    return nextFH++;
 }
 
 OriPrivId
 OriPriv::generateId()
 {
-    OriPrivId id = nextId;
-
-    nextId++;
-
-    return id;
+    return nextId++;
 }
 
 OriFileInfo *
 OriPriv::getFileInfo(const string &path)
 {
-    map<string, OriFileInfo*>::iterator it;
+    OriFileInfo *info;
 
     // Must call getDir to make sure it is loaded
     if (path != "/") {
@@ -307,25 +733,18 @@ OriPriv::getFileInfo(const string &path)
     }
 
     // Check pending directories
-    it = paths.find(path);
-    if (it != paths.end()) {
-        OriFileInfo *info = (*it).second;
-
-        if (info->type == FILETYPE_NULL)
-            throw SystemException(ENOENT);
+    info = paths.find(path);
+    if (info == NULL || info->type == FILETYPE_NULL)
+        throw SystemException(ENOENT);
 
-        return info;
-    }
-
-    // Check repository
-
-    throw SystemException(ENOENT);
+    return info;
 }
 
 OriFileInfo *
 OriPriv::getFileInfo(uint64_t fh)
 {
     unordered_map<uint64_t, OriFileInfo*>::iterator it;
+    Monitor m(handlesLock);
 
     it = handles.find(fh);
     if (it != handles.end()) {
@@ -340,23 +759,45 @@ OriPriv::getFileInfo(uint64_t fh)
 int
 OriPriv::closeFH(uint64_t fh)
 {
+    unordered_map<uint64_t, OriFileInfo*>::iterator it;
+    OriFileInfo *info;
     int status = 0;
 
-    ASSERT(handles.find(fh) != handles.end());
+    {
+        Monitor m(handlesLock);
 
-    // Manage open count
-    handles[fh]->releaseFd();
-    if (handles[fh]->openCount == 0 && handles[fh]->fd != -1) {
-        // Close file
-        status = close(handles[fh]->fd);
-        handles[fh]->fd = -1;
+        it = handles.find(fh);
+        ASSERT(it != handles.end());
+        info = (*it).second;
+        handles.erase(it);
+    }
+
+    {
+        Monitor m(info->lock);
+
+        // Manage open count
+        info->releaseFd();
+        if (info->openCount == 0 && info->fd != -1) {
+            // Close file
+            if (close(info->fd) < 0)
+                status = -errno;
+            info->fd = -1;
+        }
+        if (info->openCount == 0)
+            info->cache.reset();
+
+        // Chunk the file ahead of the next snapshot
+        if (info->openCount == 0 && writeBack != NULL &&
+            info->type == FILETYPE_DIRTY && info->path != "" &&
+            info->statInfo.st_size > ORIWRITEBACK_MINSIZE &&
+            (!info->chunked || info->chunked->gen != info->writeGen))
+            writeBack->submit(info);
     }
 
     // Manage reference count
-    handles[fh]->release();
-    handles.erase(fh);
+    info->release();
 
-    return (status == 0) ? 0 : -errno;
+    return status;
 }
 
 OriFileInfo *
@@ -380,45 +821,76 @@ OriPriv::createInfo()
     return info;
 }
 
+/*
+ * The files are filled in before they are added to the parent directory,
+ * other threads never see them half initialized.
+ */
 OriFileInfo *
-OriPriv::addSymlink(const string &path)
+OriPriv::addSymlink(const string &path, const string &target)
 {
+    string parentPath;
+    OriDir *parentDir;
+
+    parentPath = OriFile_Dirname(path);
+    if (parentPath == "")
+        parentPath = "/";
+
+    parentDir = getDir(parentPath);
+
     OriFileInfo *info = createInfo();
 
-    info->statInfo.st_mode = S_IFLNK;
-    // XXX: Adjust size properly
+    info->statInfo.st_mode = S_IFLNK | 0755;
+    info->statInfo.st_size = target.length();
+    info->link = target;
 
-    paths[path] = info;
+    Monitor m(parentDir->lock);
+    paths.insert(path, info);
+    parentDir->add(OriFile_Basename(path), info->id);
 
     return info;
 }
 
 pair<OriFileInfo *, uint64_t>
-OriPriv::addFile(const string &path)
+OriPriv::addFile(const string &path, mode_t mode, OriFileInfo **replaced)
 {
-    OriFileInfo *info = createInfo();
+    string parentPath;
+    OriDir *parentDir;
+    OriFileInfo *old;
+
+    parentPath = OriFile_Dirname(path);
+    if (parentPath == "")
+        parentPath = "/";
+
+    parentDir = getDir(parentPath);
+
     pair<string, int> file = getTemp();
+    OriFileInfo *info = createInfo();
     uint64_t handle = generateFH();
 
-    info->statInfo.st_mode = S_IFREG;
+    info->statInfo.st_mode = S_IFREG | mode;
     // XXX: Adjust size properly
     info->statInfo.st_size = 0;
     info->path = file.first; // XXX: Change to relative
     info->fd = file.second;
 
-    // Delete any old temporary files
-    map<string, OriFileInfo*>::iterator it = paths.find(path);
-    if (it != paths.end()) {
-        ASSERT(!it->second->isDir());
-        it->second->release();
-    }
-
-    paths[path] = info;
-    handles[handle] = info;
-
     info->retain();
     info->retainFd();
 
+    {
+        Monitor m(parentDir->lock);
+
+        old = paths.find(path);
+        paths.insert(path, info);
+        parentDir->add(OriFile_Basename(path), info->id);
+    }
+    {
+        Monitor m(handlesLock);
+        handles[handle] = info;
+    }
+
+    ASSERT(old == NULL || !old->isDir());
+    *replaced = old;
+
     return make_pair(info, handle);
 }
 
@@ -427,12 +899,16 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
 {
     OriFileInfo *info = getFileInfo(path);
     uint64_t handle = generateFH();
+    Monitor m(info->lock);
 
     // XXX: Need to release and remove the hanlde during a failure!
 
     info->retain();
     info->retainFd();
-    handles[handle] = info;
+    {
+        Monitor hm(handlesLock);
+        handles[handle] = info;
+    }
 
     // Handle opening directories
     if (info->isDir()) {
@@ -467,6 +943,24 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
             info->type = FILETYPE_DIRTY;
             info->path = temp.first;
             info->fd = temp.second;
+            info->resetDirty(ObjectHash());
+        } else if (writing && !info->largeHash.isEmpty()) {
+            // Sparse copy, the bytes not written are read from the LargeBlob
+            pair<string, int> temp = getTemp("sparse");
+
+            if (ftruncate(temp.second, info->statInfo.st_size) < 0) {
+                ASSERT(false); // XXX: Need to release the handle
+                throw SystemException(errno);
+            }
+
+            info->type = FILETYPE_DIRTY;
+            info->path = temp.first;
+            info->fd = temp.second;
+            info->resetDirty(info->hash);
+            info->overlay.reset(new OriOverlay(
+                        OriFileCache::sp(new OriFileCache(repo, prefetcher,
+                                                          info->hash)),
+                        info->statInfo.st_size));
         } else if (writing) {
             // Copy file
             int status;
@@ -487,6 +981,7 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
             info->type = FILETYPE_DIRTY;
             info->path = temp.first;
             info->fd = status;
+            info->resetDirty(ObjectHash());
         } else {
             ASSERT(false);
         }
@@ -498,45 +993,90 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
     return make_pair(info, handle);
 }
 
+/*
+ * Decide whether an open may keep the pages the kernel cached for the file.
+ * Contents stored in the repository are identified by their hash, the pages
+ * stay valid while the hash is the one seen by the previous open.  Checkout
+ * replaces the file info, merge changes its hash and a write makes the file
+ * dirty, all of which drop the pages on the next open.
+ */
+bool
+OriPriv::keepCache(OriFileInfo *info, bool writing)
+{
+    Monitor m(info->lock);
+
+    bool stored = info->type == FILETYPE_COMMITTED ||
+                  (info->type == FILETYPE_DIRTY && info->path == "");
+
+    if (writing || info->isDir() || !stored || info->hash.isEmpty()) {
+        info->cachedHash = ObjectHash();
+        return false;
+    }
+
+    bool keep = (info->cachedHash == info->hash);
+    info->cachedHash = info->hash;
+
+    return keep;
+}
+
 size_t
 OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
 {
     ASSERT(!info->hash.isEmpty());
 
-    ObjectType type = repo->getObjectType(info->hash);
-    if (type == ObjectInfo::Blob) {
-        string payload = repo->getPayload(info->hash);
-        // XXX: Cache
-
-        size_t left = payload.size() - offset;
-        if (left > payload.size())
-            left = 0;
-        size_t real_read = min(size, left);
-
-        memcpy(buf, payload.data() + offset, real_read);
-
-        return real_read;
-    } else if (type == ObjectInfo::LargeBlob) {
-        LargeBlob lb = LargeBlob(repo);
-        lb.fromBlob(repo->getPayload(info->hash));
-        // XXX: Cache
-
-        ssize_t total = 0;
-        while (total < size) {
-            ssize_t res = lb.read((uint8_t*)(buf + total),
-                                 size - total,
-                                 offset + total);
-            if (res == 0)
-                return total;
-            else if (res < 0)
-                return res;
-            total += res;
-        }
+    ssize_t res = getFileCache(info)->read((uint8_t *)buf, size, offset);
+    if (res < 0)
+        return -EIO;
+
+    return res;
+}
+
+/*
+ * Read the temporary file of a dirty file, the bytes it does not hold yet
+ * are read from the LargeBlob it was opened from.
+ */
+ssize_t
+OriPriv::readTemp(OriFileInfo *info, int fd, char *buf, size_t size,
+                  off_t offset)
+{
+    OriOverlay::sp overlay;
+    OriOverlay::Ranges ranges;
+    ssize_t status;
+
+    status = pread(fd, buf, size, offset);
+    if (status <= 0)
+        return status < 0 ? -errno : 0;
+
+    {
+        Monitor m(info->lock);
 
-        return total;
+        if (!info->overlay || info->fd != fd)
+            return status;
+        overlay = info->overlay;
+        ranges = overlay->baseRanges(offset, offset + status);
     }
 
-    return -EIO;
+    if (overlay->readBase((uint8_t *)buf, offset, ranges) < 0)
+        return -EIO;
+
+    return status;
+}
+
+/*
+ * Readers share the file cache, closeFH drops it once the last handle is
+ * closed.
+ */
+OriFileCache::sp
+OriPriv::getFileCache(OriFileInfo *info)
+{
+    Monitor m(info->lock);
+
+    // Files read without a handle (snapshots) are read once, skip read-ahead
+    if (!info->cache || info->cache->hash != info->hash)
+        info->cache.reset(new OriFileCache(repo,
+                    info->openCount > 0 ? prefetcher : NULL, info->hash));
+
+    return info->cache;
 }
 
 void
@@ -555,7 +1095,7 @@ OriPriv::unlink(const string &path)
     ASSERT(info->isSymlink() || info->isReg());
 
     parentDir->remove(OriFile_Basename(path));
-    paths.erase(path);
+    paths.remove(path);
 
     // Drop refcount only delete if zero (including temp file)
     info->release();
@@ -593,8 +1133,8 @@ OriPriv::rename(const string &fromPath, const string &toPath)
     }
 
     info->type = FILETYPE_DIRTY;
-    paths.erase(fromPath);
-    paths[toPath] = info;
+    paths.remove(fromPath);
+    paths.insert(toPath, info);
 
     string from = OriFile_Basename(fromPath);
     string to = OriFile_Basename(toPath);
@@ -607,17 +1147,18 @@ OriPriv::rename(const string &fromPath, const string &toPath)
         toFile->release();
     }
 
-    ASSERT(paths.find(fromPath) == paths.end());
-    ASSERT(paths.find(toPath) != paths.end());
+    ASSERT(paths.find(fromPath) == NULL);
+    ASSERT(paths.find(toPath) != NULL);
 }
 
 OriFileInfo *
-OriPriv::addDir(const string &path)
+OriPriv::addDir(const string &path, mode_t mode)
 {
     OriFileInfo *info;
     string parentPath;
     OriDir *parentDir;
     OriFileInfo *parentInfo;
+    OriDir *dir;
     time_t now = time(NULL);
 
     parentPath = OriFile_Dirname(path);
@@ -642,7 +1183,7 @@ OriPriv::addDir(const string &path)
      * loadAttrs, which will assume the mode bits are empty except for this 
      * flag.
      */
-    info->statInfo.st_mode = S_IFDIR;
+    info->statInfo.st_mode = S_IFDIR | mode;
     info->statInfo.st_nlink = 2;
     info->statInfo.st_size = 512;
     info->statInfo.st_atime = 0;
@@ -652,11 +1193,20 @@ OriPriv::addDir(const string &path)
     info->id = generateId();
     info->dirLoaded = true;
 
-    dirs[info->id] = new OriDir();
-    paths[path] = info;
+    dir = new OriDir();
+
+    Monitor m(parentDir->lock);
+    {
+        unique_lock<mutex> l(dirsLock);
+        dirs[info->id] = dir;
+    }
+    paths.insert(path, info);
 
     parentDir->add(OriFile_Basename(path), info->id);
-    parentInfo->statInfo.st_nlink++;
+    {
+        Monitor pm(parentInfo->lock);
+        parentInfo->statInfo.st_nlink++;
+    }
 
     return info;
 }
@@ -692,7 +1242,7 @@ OriPriv::rmDir(const string &path)
     ASSERT(parentInfo->statInfo.st_nlink >= 2);
 
     dirs.erase(info->id);
-    paths.erase(path);
+    paths.remove(path);
 
     delete dir;
     info->release();
@@ -702,44 +1252,86 @@ OriDir*
 OriPriv::getDir(const string &path)
 {
     // Check pending directories
-    map<string, OriFileInfo*>::iterator it;
-
-    it = paths.find(path);
-    if (it != paths.end()) {
-        map<OriPrivId, OriDir*>::iterator dit;
-        if (!(*it).second->isDir())
-            throw SystemException(ENOTDIR);
-        if ((*it).second->type == FILETYPE_NULL)
-            throw SystemException(ENOENT);
-        dit = dirs.find((*it).second->id);
-        if (dit == dirs.end())
-            goto loadDir;
+    OriFileInfo *info = paths.find(path);
+
+    // Load the parents of a directory not seen yet
+    if (info == NULL)
+        info = getFileInfo(path);
+    if (!info->isDir())
+        throw SystemException(ENOTDIR);
+    if (info->type == FILETYPE_NULL)
+        throw SystemException(ENOENT);
+
+    {
+        unique_lock<mutex> l(dirsLock);
+        map<OriPrivId, OriDir*>::iterator it = dirs.find(info->id);
+
+        if (it != dirs.end())
+            return (*it).second;
+    }
+
+    return loadDir(path, info);
+}
+
+/*
+ * Build a directory from the head commit.  The tree is read and parsed
+ * without holding any lock exclusively, threads that need the same directory
+ * wait for it and all other directories stay usable meanwhile.  The tree
+ * hash comes from the parent directory, which was loaded from the same
+ * commit, and the subdirectory trees are prefetched from an instaclone
+ * remote.
+ */
+OriDir*
+OriPriv::loadDir(const string &path, OriFileInfo *dirInfo)
+{
+    vector<pair<string, OriFileInfo *> > entries;
+    vector<ObjectHash> subtrees;
+    OriDir *dir;
+    int subdirs = 0;
+
+    {
+        unique_lock<mutex> l(dirsLock);
 
-        return dit->second;
+        while (true) {
+            map<OriPrivId, OriDir*>::iterator it = dirs.find(dirInfo->id);
+
+            if (it != dirs.end())
+                return (*it).second;
+            if (loadingDirs.insert(dirInfo->id).second)
+                break;
+            dirLoadedCV.wait(l);
+        }
     }
 
-loadDir:
-    // Check repository
-    ObjectHash hash = repo->lookup(headCommit, path);
-    if (!hash.isEmpty()) {
+    dir = new OriDir();
+    try {
+        // Check repository
+        ObjectHash hash;
+        if (path == "/")
+            hash = headCommit.getTree();
+        else if (dirInfo->type == FILETYPE_COMMITTED)
+            hash = dirInfo->hash;
+        if (hash.isEmpty())
+            hash = repo->lookup(headCommit, path);
+        if (hash.isEmpty())
+            throw SystemException(ENOENT);
+
         Tree t = repo->getTree(hash);
         Tree::iterator it;
-        OriFileInfo *dirInfo;
-        OriDir *dir = new OriDir();
-
-        dirInfo = getFileInfo(path);
 
         for (it = t.begin(); it != t.end(); it++) {
             OriFileInfo *info = new OriFileInfo();
             AttrMap *attrs = &it->second.attrs;
             bool isSymlink = false;
 
+            entries.push_back(make_pair(it->first, info));
             if (it->second.type == TreeEntry::Tree) {
                 info->statInfo.st_mode = S_IFDIR;
                 info->statInfo.st_nlink = 2;
                 // XXX: This is hacky but a directory gets the correct nlink 
                 // value once it is opened for the first time.
-                dirInfo->statInfo.st_nlink++;
+                subdirs++;
+                subtrees.push_back(it->second.hash);
             }
             if (attrs->has(ATTR_SYMLINK)) {
                 isSymlink = attrs->getAs<bool>(ATTR_SYMLINK);
@@ -755,18 +1347,65 @@ loadDir:
             }
 
             dir->add(it->first, info->id);
-            if (path == "/")
-                paths["/" + it->first] = info;
-            else
-                paths[path + "/" + it->first] = info;
         }
+    } catch (exception &e) {
+        for (size_t i = 0; i < entries.size(); i++)
+            entries[i].second->release();
+        delete dir;
 
-        dirInfo->dirLoaded = true;
+        {
+            unique_lock<mutex> l(dirsLock);
+            loadingDirs.erase(dirInfo->id);
+        }
+        dirLoadedCV.notify_all();
+        throw;
+    }
+
+    if (!subtrees.empty() && prefetcher != NULL && repo->hasRemote())
+        prefetcher->submitTrees(subtrees);
+
+    // The entries are only looked up once the directory is published
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (path == "/")
+            paths.insert("/" + entries[i].first, entries[i].second);
+        else
+            paths.insert(path + "/" + entries[i].first, entries[i].second);
+    }
+
+    {
+        unique_lock<mutex> l(dirsLock);
+
+        {
+            Monitor m(dirInfo->lock);
+            dirInfo->statInfo.st_nlink += subdirs;
+            dirInfo->dirLoaded = true;
+        }
         dirs[dirInfo->id] = dir;
-        return dir;
+        loadingDirs.erase(dirInfo->id);
     }
+    dirLoadedCV.notify_all();
 
-    throw SystemException(ENOENT);
+    return dir;
+}
+
+/*
+ * Load the directories an operation needs with the namespace lock held for
+ * reading, so operations holding it for writing do not read trees.  Errors
+ * are left for the operation to report.
+ */
+void
+OriPriv::preload(const string &path)
+{
+    RWKey::sp lock = nsLock.readLock();
+
+    try {
+        OriFileInfo *info = getFileInfo(path);
+
+        if (info->isDir())
+            getDir(path);
+    } catch (exception &e) {
+        // Fall through
+    }
 }
 
 /*
@@ -784,15 +1423,54 @@ OriPriv::lookupSnapshot(const string &name)
 {
     ObjectHash hash = repo->lookupSnapshot(name);
 
+    if (hash.isEmpty())
+        throw SystemException(ENOENT);
+
     return repo->getCommit(hash);
 }
 
-Tree
+/*
+ * Get a directory of a snapshot, @returns NULL if the path is not a
+ * directory.  Snapshots never change so the parsed trees and the misses are
+ * cached until evicted, and a directory is found from its cached parent
+ * instead of walking the trees from the root.
+ */
+shared_ptr<Tree>
 OriPriv::getTree(const Commit &c, const string &path)
 {
-    ObjectHash hash = repo->lookup(c, path);
+    return getTree(c.getTree(), path);
+}
+
+/*
+ * Get a directory below the root tree of a snapshot.
+ */
+shared_ptr<Tree>
+OriPriv::getTree(const ObjectHash &root, const string &path)
+{
+    string key = root.hex() + path;
+    shared_ptr<Tree> t = snapshotTrees.get(key);
+
+    if (t || snapshotTrees.hasKey(key))
+        return t;
+
+    if (path == "/") {
+        t.reset(new Tree(repo->getTree(root)));
+    } else {
+        string parentPath = OriFile_Dirname(path);
+        shared_ptr<Tree> parent;
+        Tree::iterator it;
+
+        parent = getTree(root, parentPath == "" ? "/" : parentPath);
+        if (parent) {
+            it = parent->find(OriFile_Basename(path));
+            if (it != parent->end() && (*it).second.type == TreeEntry::Tree)
+                t.reset(new Tree(repo->getTree((*it).second.hash)));
+        }
+    }
 
-    return repo->getTree(hash);
+    snapshotTrees.put(key, t, t ? t->tree.size() + 1 : 1);
+
+    return t;
 }
 
 /*
@@ -805,8 +1483,178 @@ OriPriv::getTip()
     return head;
 }
 
+/*
+ * Chunk a dirty file without storing the chunks.  Only the ranges written
+ * since prev was chunked, or else since the file was copied from the
+ * LargeBlob base, are read and chunked again.
+ */
+OriChunkedFile::sp
+OriPriv::chunkFile(const string &path, OriOverlay::sp overlay,
+                   OriChunkedFile::sp prev, const ObjectHash &base,
+                   const map<uint64_t, uint64_t> &dirty)
+{
+    OriChunkedFile::sp c(new OriChunkedFile(repo));
+    OriOverlaySource src(overlay);
+    LargeBlob baseLb(repo);
+    int status;
+
+    status = src.open(path);
+    if (status < 0)
+        throw SystemException(-status);
+
+    if (!prev && !base.isEmpty())
+        baseLb.fromBlob(repo->getPayload(base));
+    c->lb.rechunk(&src, prev ? prev->lb : baseLb, dirty);
+
+    return c;
+}
+
+/*
+ * Chunk a closed dirty file on a write-back thread.  The repository is only
+ * modified with the namespace lock held for writing, so the chunks are
+ * hashed here and stored by the next snapshot (see addDirtyFile).  One
+ * thread at a time chunks a file.  The file's state is copied with the
+ * namespace lock held and chunked without it, the reference taken by
+ * OriWriteBack::submit keeps info alive meanwhile.  Files written in the
+ * meantime keep their dirty ranges and are chunked again by the next job.
+ * Drops that reference.
+ */
+void
+OriPriv::writeBackFile(OriFileInfo *info)
+{
+    RWKey::sp lock = nsLock.readLock();
+    OriChunkedFile::sp prev, c;
+    OriOverlay::sp overlay;
+    map<uint64_t, uint64_t> dirty;
+    ObjectHash base;
+    string path;
+    uint64_t gen = 0;
+
+    {
+        Monitor m(info->lock);
+
+        if (info->type == FILETYPE_DIRTY && info->path != "" &&
+            !info->chunking &&
+            (!info->chunked || info->chunked->gen != info->writeGen)) {
+            info->chunking = true;
+            path = info->path;
+            prev = info->chunked;
+            base = info->baseHash;
+            gen = info->writeGen;
+            dirty = info->dirtyRanges;
+            if (info->overlay)
+                overlay.reset(new OriOverlay(*info->overlay));
+        }
+    }
+
+    if (path != "") {
+        lock.reset();
+        try {
+            c = chunkFile(path, overlay, prev, base, dirty);
+            c->gen = gen;
+        } catch (exception &e) {
+            WARNING("Write-back of %s failed: %s", path.c_str(), e.what());
+        }
+
+        // Only kept if the file was neither replaced nor written meanwhile
+        lock = nsLock.readLock();
+        Monitor m(info->lock);
+        if (c && info->path == path && c->gen == info->writeGen) {
+            info->chunked = c;
+            info->dirtyRanges.clear();
+        }
+        info->chunking = false;
+
+        // Written while being chunked
+        if (c && info->openCount == 0 && info->path == path &&
+            c->gen != info->writeGen)
+            writeBack->submit(info);
+    }
+
+    info->release();
+}
+
+/*
+ * Add the temporary file of a dirty file to the repository, only the chunks
+ * that changed since the write-back threads chunked it or since it was
+ * opened from a LargeBlob are read again.  Caller holds the namespace lock
+ * for writing.
+ */
+void
+OriPriv::addDirtyFile(OriFileInfo *info, ObjectPipeline *pipe)
+{
+    OriChunkedFile::sp c = info->chunked;
+
+    if (info->statInfo.st_size <= ORIWRITEBACK_MINSIZE) {
+        fillOverlay(info);
+        repo->addFile(info->path, pipe, &info->hash, &info->largeHash);
+        return;
+    }
+    if (!c && info->baseHash.isEmpty() && !info->overlay) {
+        repo->addFile(info->path, pipe, &info->hash, &info->largeHash);
+        return;
+    }
+
+    if (!c || c->gen != info->writeGen) {
+        c = chunkFile(info->path, info->overlay, c, info->baseHash,
+                      info->dirtyRanges);
+        c->gen = info->writeGen;
+        info->chunked = c;
+        info->dirtyRanges.clear();
+    }
+
+    OriOverlaySource src(info->overlay);
+    int status = src.open(info->path);
+    if (status < 0)
+        throw SystemException(-status);
+    repo->addChunkedFile(&src, c->lb, pipe, &info->hash, &info->largeHash);
+}
+
+/*
+ * Copy the bytes that a dirty file still reads from its LargeBlob into the
+ * temporary file, which then no longer needs the overlay.  Caller holds the
+ * namespace lock for writing.
+ */
+void
+OriPriv::fillOverlay(OriFileInfo *info)
+{
+    OriOverlay::Ranges ranges;
+    int fd;
+
+    if (!info->overlay)
+        return;
+
+    ranges = info->overlay->baseRanges(0, info->statInfo.st_size);
+    fd = open(info->path.c_str(), O_WRONLY);
+    if (fd < 0)
+        throw SystemException(errno);
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        OriOverlay::Ranges r(1, ranges[i]);
+        string buf(r[0].second - r[0].first, '\0');
+        int err = 0;
+
+        ssize_t status;
+
+        if (info->overlay->readBase((uint8_t *)&buf[0], r[0].first, r) < 0) {
+            err = EIO;
+        } else {
+            status = pwrite(fd, buf.data(), buf.size(), r[0].first);
+            if (status != (ssize_t)buf.size())
+                err = status < 0 ? errno : EIO;
+        }
+        if (err != 0) {
+            close(fd);
+            throw SystemException(err);
+        }
+    }
+    close(fd);
+
+    info->overlay.reset();
+}
+
 ObjectHash
-OriPriv::commitTreeHelper(const string &path)
+OriPriv::commitTreeHelper(const string &path, ObjectPipeline *pipe)
 {
     ObjectHash hash = ObjectHash();
     OriDir *dir = getDir(path == "" ? "/" : path);
@@ -834,51 +1682,27 @@ OriPriv::commitTreeHelper(const string &path)
     }
 
     // Check this directory
+    vector<string> dirtyEntries;
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
         string objPath = path + "/" + it->first;
         OriFileInfo *info = getFileInfo(objPath);
 
         if (info->type == FILETYPE_DIRTY) {
             dirty = true;
-        
-            // Created or modified
-            TreeEntry e;
+            dirtyEntries.push_back(it->first);
 
+            /*
+             * Created or modified, the pipeline copies the hashes back to
+             * the info structure once it is drained.
+             */
             if (info->isSymlink()) {
-                ObjectHash hash = repo->addBlob(ObjectInfo::Blob, info->link);
-
-                // Copy hash back to info stgructure
-                info->hash = hash;
-
-                e = TreeEntry(hash, ObjectHash());
-            } else {
-                if (info->path != "") {
-                    pair<ObjectHash, ObjectHash> hashes;
-                    hashes = repo->addFile(info->path);
+                string blob = info->link;
 
-                    // Copy hashes back to info stgructure
-                    info->hash = hashes.first;
-                    info->largeHash = hashes.second;
-                }
-                e = TreeEntry(info->hash, info->largeHash);
+                info->largeHash = ObjectHash();
+                pipe->add(ObjectInfo::Blob, blob, &info->hash);
+            } else if (info->path != "") {
+                addDirtyFile(info, pipe);
             }
-
-            info->storeAttr(&e.attrs);
-
-            if (info->isDir()) {
-                e.type = TreeEntry::Tree;
-            } else {
-                if (e.largeHash.isEmpty())
-                    e.type = TreeEntry::Blob;
-                else
-                    e.type = TreeEntry::LargeBlob;
-            }
-
-            ASSERT(e.hasBasicAttrs());
-
-            newTree.tree[it->first] = e;
-
-            info->type = FILETYPE_COMMITTED;
         } else {
             Tree::iterator oldEntry = oldTree.find(it->first);
 
@@ -890,6 +1714,38 @@ OriPriv::commitTreeHelper(const string &path)
             newTree.tree[it->first] = oldEntry->second;
         }
     }
+    pipe->drain();
+
+    for (size_t i = 0; i < dirtyEntries.size(); i++) {
+        string objPath = path + "/" + dirtyEntries[i];
+        OriFileInfo *info = getFileInfo(objPath);
+
+        TreeEntry e = TreeEntry(info->hash, info->largeHash);
+
+        info->storeAttr(&e.attrs);
+
+        if (info->isDir()) {
+            e.type = TreeEntry::Tree;
+        } else {
+            if (e.largeHash.isEmpty())
+                e.type = TreeEntry::Blob;
+            else
+                e.type = TreeEntry::LargeBlob;
+        }
+
+        ASSERT(e.hasBasicAttrs());
+
+        newTree.tree[dirtyEntries[i]] = e;
+
+        info->type = FILETYPE_COMMITTED;
+        if (info->path != "") {
+            // Writes through open handles are chunked against the stored file
+            info->baseHash = info->largeHash.isEmpty() ? ObjectHash()
+                                                       : info->hash;
+            info->dirtyRanges.clear();
+            info->chunked.reset();
+        }
+    }
     for (Tree::iterator it = oldTree.begin(); it != oldTree.end(); it++) {
         string objPath = path + "/" + it->first;
 
@@ -905,7 +1761,7 @@ OriPriv::commitTreeHelper(const string &path)
         OriFileInfo *info = getFileInfo(objPath);
 
         if (info->isDir() && info->dirLoaded) {
-            ObjectHash subdir = commitTreeHelper(objPath);
+            ObjectHash subdir = commitTreeHelper(objPath, pipe);
 
             if (!subdir.isEmpty()) {
                 dirty = true;
@@ -935,7 +1791,8 @@ ObjectHash
 OriPriv::commit(const Commit &cTemplate, bool temporary)
 {
     Commit c;
-    ObjectHash root = commitTreeHelper("");
+    ObjectPipeline pipe(repo);
+    ObjectHash root = commitTreeHelper("", &pipe);
     ObjectHash commitHash = ObjectHash();
 
     if (root.isEmpty() || root == headCommit.getTree())
@@ -1095,27 +1952,29 @@ OriPriv::checkout(ObjectHash hash, bool force)
     }
 
     // Reset
+    vector<pair<string, OriFileInfo *> > allPaths = paths.list();
     map<string, OriFileInfo*>::iterator pit;
-    map<OriPrivId, OriDir*>::iterator dit;
-    for (pit = paths.begin(); pit != paths.end(); pit++)
+    for (size_t i = 0; i < allPaths.size(); i++)
     {
-        if (pit->first == "/") {
-            if (pit->second->dirLoaded)
-                dirs.erase(pit->second->id);
-            pit->second->statInfo.st_nlink = 2;
-            pit->second->dirLoaded = false;
+        OriFileInfo *info = allPaths[i].second;
+
+        if (allPaths[i].first == "/") {
+            if (info->dirLoaded)
+                dirs.erase(info->id);
+            info->statInfo.st_nlink = 2;
+            info->dirLoaded = false;
             continue;
         }
 
-        if (pit->second->isDir() && pit->second->dirLoaded) {
-            delete dirs[pit->second->id];
-            dirs.erase(pit->second->id);
+        if (info->isDir() && info->dirLoaded) {
+            delete dirs[info->id];
+            dirs.erase(info->id);
         }
-        pit->second->release();
-        paths.erase(pit);
+        info->release();
+        paths.remove(allPaths[i].first);
     }
 
-    OriFileInfo *rootInfo = paths["/"];
+    OriFileInfo *rootInfo = paths.find("/");
     rootInfo->statInfo.st_mtime = c.getTime();
     rootInfo->statInfo.st_ctime = c.getTime();
 
@@ -1158,12 +2017,12 @@ OriPriv::checkout(ObjectHash hash, bool force)
                 OriDir *parentDir = getDir(parentPath);
 
                 // Rename conflicting file if it exists
-                if (paths.find(filePath) != paths.end()) {
+                if (paths.find(filePath) != NULL) {
                     rename(filePath, filePath + ":create_conflict");
                 }
 
                 // Create the new file
-                paths[it->first] = info;
+                paths.insert(it->first, info);
                 parentDir->add(OriFile_Basename(filePath), info->id);
                 if (info->isDir()) {
                     OriFileInfo *parentInfo = getFileInfo(parentPath);
@@ -1200,7 +2059,7 @@ OriPriv::checkout(ObjectHash hash, bool force)
                     parentDir->add(OriFile_Basename(filePath), myInfo->id);
                 } else {
                     // No conflict
-                    paths[it->first] = myInfo;
+                    paths.insert(it->first, myInfo);
                     parentDir->add(OriFile_Basename(filePath), myInfo->id);
                     newInfo->release();
                 }
@@ -1361,10 +2220,10 @@ OriPriv::merge(ObjectHash hash)
 
             OriDir *parentDir = getDir(OriFile_Dirname(e.filepath));
             parentDir->add(OriFile_Basename(e.filepath), info->id);
-            paths[e.filepath] = info;
+            paths.insert(e.filepath, info);
         } else if (e.type == TreeDiffEntry::NewDir) {
             DLOG("N       %s", e.filepath.c_str());
-            OriFileInfo *info = addDir(e.filepath);
+            OriFileInfo *info = addDir(e.filepath, 0);
             info->loadAttr(e.newAttrs);
             info->statInfo.st_nlink++;
             info->hash = e.hashes.first;
@@ -1429,7 +2288,7 @@ OriPriv::merge(ObjectHash hash)
 
                 parentDir->add(OriFile_Basename(e.filepath) + ":conflict",
                                conflictInfo->id);
-                paths[e.filepath + ":conflict"] = conflictInfo;
+                paths.insert(e.filepath + ":conflict", conflictInfo);
 
                 /*
                  * Create '*:base' file if it exists.  It may not exist because 
@@ -1455,7 +2314,7 @@ OriPriv::merge(ObjectHash hash)
 
                     parentDir->add(OriFile_Basename(e.filepath) + ":base",
                                    baseInfo->id);
-                    paths[e.filepath + ":base"] = baseInfo;
+                    paths.insert(e.filepath + ":base", baseInfo);
                 }
             }
 
@@ -1527,6 +2386,7 @@ OriPriv::journal(const string &event, const string &arg)
         return;
 
     buf = event + ":" + arg + "\n";
+    Monitor m(journalLock);
     len = write(journalFd, buf.c_str(), buf.size());
     if (len < 0 || len != (int)buf.size())
         throw SystemException();
@@ -1601,7 +2461,8 @@ void
 OriPriv::fsck()
 {
     RWKey::sp lock;
-    map<string, OriFileInfo *>::iterator it;
+    vector<pair<string, OriFileInfo *> > allPaths;
+    vector<pair<string, OriFileInfo *> >::iterator it;
     OriDir *dir;
 
     lock = nsLock.writeLock();
@@ -1610,7 +2471,8 @@ OriPriv::fsck()
 
     OriPrivCheckDir(this, "", dir);
 
-    for (it = paths.begin(); it != paths.end(); it++) {
+    allPaths = paths.list();
+    for (it = allPaths.begin(); it != allPaths.end(); it++) {
         string basename = OriFile_Basename(it->first);
         string parentPath = OriFile_Dirname(it->first);
         OriDir *dir = NULL;
@@ -1650,6 +2512,7 @@ OriPriv::getRepo()
 OriPriv *
 GetOriPriv()
 {
-    return (OriPriv*)fuse_get_context()->private_data;
+    // The low-level frontend has no FUSE context
+    return priv;
 }
 
@@ -17,7 +17,19 @@
 #ifndef __ORIPRIV_H__
 #define __ORIPRIV_H__
 
+#include <set>
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+
 #include <oriutil/orifile.h>
+#include <oriutil/mutex.h>
+#include <oriutil/concurrentcache.h>
 
 typedef enum OriFileType
 {
@@ -29,6 +41,106 @@ typedef enum OriFileType
 #define ORIPRIVID_INVALID 0
 typedef uint64_t OriPrivId;
 
+// Decoded bytes kept per open file
+#define ORIFILECACHE_MAXBYTES (4 * 1024 * 1024)
+// Largest blob decoded whole, larger ones are stored in frames
+#define ORIFILECACHE_MAXBLOB (128 * 1024)
+// Read-ahead window of sequential LargeBlob reads, doubles up to the maximum
+#define ORIFILECACHE_READAHEAD_MIN (128 * 1024)
+#define ORIFILECACHE_READAHEAD_MAX (2 * 1024 * 1024)
+// Shards of the path table
+#define ORIPATHMAP_SHARDS 64
+// Tree entries of parsed snapshot directories kept, few shards so large
+// directories fit
+#define ORISNAPSHOT_CACHEENTRIES (64 * 1024)
+#define ORISNAPSHOT_CACHESHARDS 4
+// Released dirty files at least this large are chunked in the background,
+// the repository stores smaller files whole
+#define ORIWRITEBACK_MINSIZE (1024 * 1024)
+
+class LargeBlob;
+class LocalRepo;
+class OriPrefetcher;
+class OriWriteBack;
+
+/*
+ * Decoded contents of a committed file, kept while the file is open so
+ * sequential reads decode each object once instead of once per read.  Holds
+ * the parsed LargeBlob and the most recently read chunks (or the blob).
+ *
+ * Once a LargeBlob is read sequentially the chunks ahead of the reader are
+ * fetched and decoded by the prefetcher, the window grows while the reader
+ * keeps up and is dropped on the first random read.
+ */
+class OriFileCache : public std::enable_shared_from_this<OriFileCache>
+{
+public:
+    typedef std::shared_ptr<OriFileCache> sp;
+    typedef std::shared_ptr<const std::string> Payload;
+
+    /// @param prefetcher Used for read-ahead or NULL
+    OriFileCache(LocalRepo *repo, OriPrefetcher *prefetcher,
+                 const ObjectHash &hash);
+    ~OriFileCache();
+    ssize_t read(uint8_t *buf, size_t size, off_t offset);
+    /// Fetch and decode objects ahead of the reader
+    void prefetch(const std::vector<ObjectHash> &objs, RWLock *nsLock);
+
+    const ObjectHash hash;
+private:
+    bool load();
+    Payload getPayload(const ObjectHash &objId);
+    void readAhead(off_t offset, size_t size);
+
+    LocalRepo *repo;
+    OriPrefetcher *prefetcher;
+    std::mutex lock;
+    std::condition_variable fetchedCV;
+    bool loaded;
+    ObjectType type;
+    std::unique_ptr<LargeBlob> lb;
+    ConcurrentCache<ObjectHash, const std::string> chunks;
+    // Objects being decoded by the prefetcher
+    std::set<ObjectHash> fetching;
+    // End of the last read and of the read-ahead
+    uint64_t seqEnd;
+    uint64_t raEnd;
+    size_t raWindow;
+};
+
+/*
+ * Chunks of a dirty file computed ahead of the next snapshot, they match the
+ * temporary file while the file's write generation is gen.
+ */
+struct OriChunkedFile
+{
+    typedef std::shared_ptr<OriChunkedFile> sp;
+    explicit OriChunkedFile(Repo *repo) : lb(repo), gen(0) { }
+    LargeBlob lb;
+    uint64_t gen;
+};
+
+/*
+ * Copy-on-write view of a file opened for writing from a LargeBlob.  The
+ * temporary file is sparse and only holds the written bytes, the bytes
+ * before baseSize that were never written are read from base.  Truncating
+ * marks the bytes it cuts off or zero fills as written.
+ */
+struct OriOverlay
+{
+    typedef std::shared_ptr<OriOverlay> sp;
+    typedef std::vector<std::pair<uint64_t, uint64_t> > Ranges;
+    OriOverlay(OriFileCache::sp base, uint64_t baseSize)
+        : base(base), baseSize(baseSize) { }
+    /// The ranges from off to end that are read from base
+    Ranges baseRanges(uint64_t off, uint64_t end) const;
+    /// Read the ranges from base into buf, which starts at off
+    int readBase(uint8_t *buf, uint64_t off, const Ranges &ranges) const;
+    OriFileCache::sp base;
+    uint64_t baseSize;
+    std::map<uint64_t, uint64_t> written; // start to end
+};
+
 class OriFileInfo
 {
 public:
@@ -41,6 +153,8 @@ public:
         refCount = 1;
         openCount = 0;
         dirLoaded = false;
+        writeGen = 0;
+        chunking = false;
     }
     ~OriFileInfo() {
         ASSERT(refCount == 0);
@@ -60,14 +174,14 @@ public:
         refCount++;
     }
     void release() {
-        refCount--;
-        if (refCount == 0) {
+        if (--refCount == 0) {
             delete this;
         }
     }
     /*
      * Tracks the number of open handles to a file so that we can close the 
-     * temporary file when there are no file descriptors left.
+     * temporary file when there are no file descriptors left.  Caller holds
+     * the lock.
      */
     void retainFd() {
         openCount++;
@@ -81,17 +195,39 @@ public:
     bool isReg() const { return (statInfo.st_mode & S_IFREG) == S_IFREG; }
     void loadAttr(const AttrMap &attr);
     void storeAttr(AttrMap *attr) const;
+    void markDirty(uint64_t off, uint64_t len);
+    void resetDirty(const ObjectHash &base);
     struct stat statInfo;
     ObjectHash hash;
     ObjectHash largeHash;
-    OriFileType type;
+    // Contents the kernel may hold in its page cache, see keepCache
+    ObjectHash cachedHash;
+    std::atomic<OriFileType> type;
     OriPrivId id;
     std::string path; // temporary file
     std::string link; // link target
     int fd;
-    int refCount;
+    std::atomic<int> refCount;
     int openCount;
     bool dirLoaded;
+    // Decoded objects, dropped once the last handle is closed
+    OriFileCache::sp cache;
+    /*
+     * Write-back chunking of the temporary file.  Only the bytes written
+     * since the file was copied from the LargeBlob baseHash, or since the
+     * chunks were computed, are chunked again.
+     */
+    ObjectHash baseHash;
+    std::map<uint64_t, uint64_t> dirtyRanges; // start to end
+    uint64_t writeGen; // Bumped by every write and truncate
+    OriChunkedFile::sp chunked;
+    bool chunking; // A write-back thread is chunking the file
+    OriOverlay::sp overlay; // Unless the temporary file is a full copy
+    /*
+     * Protects the attributes, the temporary file and the open count from
+     * operations sharing the namespace lock.
+     */
+    Mutex lock;
 };
 
 class OriDir
@@ -118,11 +254,40 @@ public:
     iterator begin() { return entries.begin(); }
     iterator end() { return entries.end(); }
     iterator find(const std::string &name) { return entries.find(name); }
+    /// Held to read or change the entries with the namespace lock shared
+    Mutex lock;
 private:
     bool dirty;
     std::map<std::string, OriPrivId> entries;
 };
 
+/*
+ * Path to file table shared by all FUSE threads.  Paths are hashed over
+ * shards that each have their own lock, lookups of different paths rarely
+ * contend.
+ */
+class OriPathMap
+{
+public:
+    OriPathMap();
+    ~OriPathMap();
+    /// @returns NULL if the path is not present
+    OriFileInfo *find(const std::string &path);
+    void insert(const std::string &path, OriFileInfo *info);
+    /// @returns the removed file or NULL
+    OriFileInfo *remove(const std::string &path);
+    /// Snapshot of all entries in path order
+    std::vector<std::pair<std::string, OriFileInfo *> > list();
+private:
+    struct Shard {
+        Mutex lock;
+        std::unordered_map<std::string, OriFileInfo *> paths;
+    };
+    Shard &getShard(const std::string &path);
+
+    Shard shards[ORIPATHMAP_SHARDS];
+};
+
 class OriFileState
 {
 public:
@@ -155,6 +320,9 @@ public:
 };
 
 
+class ObjectPipeline;
+class Repacker;
+
 class OriPriv
 {
 public:
@@ -166,31 +334,56 @@ public:
     void reset();
     void init();
     void cleanup();
-    std::pair<std::string, int> getTemp();
+    std::pair<std::string, int> getTemp(const std::string &prefix = "obj");
     // Current Change Operations
     uint64_t generateFH();
     OriPrivId generateId();
     OriFileInfo* getFileInfo(const std::string &path);
     OriFileInfo* getFileInfo(uint64_t fh);
     int closeFH(uint64_t fh);
+    OriFileCache::sp getFileCache(OriFileInfo *info);
     OriFileInfo* createInfo();
-    OriFileInfo* addSymlink(const std::string &path);
-    std::pair<OriFileInfo*, uint64_t> addFile(const std::string &path);
+    OriFileInfo* addSymlink(const std::string &path,
+                            const std::string &target);
+    /*
+     * Adds a file or replaces the file at path.  The replaced file is
+     * returned in replaced for the caller to release with nsLock held for
+     * writing.
+     */
+    std::pair<OriFileInfo*, uint64_t> addFile(const std::string &path,
+                                              mode_t mode,
+                                              OriFileInfo **replaced);
     std::pair<OriFileInfo*, uint64_t> openFile(const std::string &path,
                                                bool writing, bool trunc);
+    bool keepCache(OriFileInfo *info, bool writing);
+    void writeBackFile(OriFileInfo *info);
     size_t readFile(OriFileInfo *info, char *buf, size_t size, off_t offset);
+    ssize_t readTemp(OriFileInfo *info, int fd, char *buf, size_t size,
+                     off_t offset);
     void unlink(const std::string &path);
     void rename(const std::string &fromPath, const std::string &toPath);
-    OriFileInfo* addDir(const std::string &path);
+    OriFileInfo* addDir(const std::string &path, mode_t mode);
     void rmDir(const std::string &path);
     OriDir* getDir(const std::string &path);
+    void preload(const std::string &path);
     // Snapshot Operations
     std::map<std::string, ObjectHash> listSnapshots();
     Commit lookupSnapshot(const std::string &name);
-    Tree getTree(const Commit &c, const std::string &path);
+    std::shared_ptr<Tree> getTree(const Commit &c, const std::string &path);
+    std::shared_ptr<Tree> getTree(const ObjectHash &root,
+                                  const std::string &path);
     ObjectHash getTip();
 private:
-    ObjectHash commitTreeHelper(const std::string &path);
+    OriDir* loadDir(const std::string &path, OriFileInfo *dirInfo);
+    OriChunkedFile::sp chunkFile(const std::string &path,
+                                 OriOverlay::sp overlay,
+                                 OriChunkedFile::sp prev,
+                                 const ObjectHash &base,
+                                 const std::map<uint64_t, uint64_t> &dirty);
+    void fillOverlay(OriFileInfo *info);
+    void addDirtyFile(OriFileInfo *info, ObjectPipeline *pipe);
+    ObjectHash commitTreeHelper(const std::string &path,
+                                ObjectPipeline *pipe);
     void getDiffHelper(const std::string &path,
                     std::map<std::string, OriFileState::StateType> *diff);
     void getCheckoutHelper(const std::string &path,
@@ -206,29 +399,53 @@ public:
     // Debugging
     void fsck();
 
-    // Locks
+    /*
+     * Locks
+     *
+     * File operations hold the namespace lock for reading and lock the
+     * directories and files they change.  Operations that delete files or
+     * directories and commands that walk the whole namespace hold it for
+     * writing, files and directories are only freed with it held so they
+     * may be used without a reference.
+     *
+     * Lock order: nsLock, OriDir::lock, dirsLock, then the path table,
+     * handle and OriFileInfo locks.
+     */
     RWLock ioLock; // File I/O lock to allow atomic commits
     RWLock nsLock; // Namespace lock
 
     LocalRepo *getRepo();
 private:
-    OriPrivId nextId;
-    uint64_t nextFH;
-    std::map<OriPrivId, OriDir*> dirs;
-    std::map<std::string, OriFileInfo*> paths;
+    std::atomic<OriPrivId> nextId;
+    std::atomic<uint64_t> nextFH;
+    OriPathMap paths;
     std::unordered_map<uint64_t, OriFileInfo*> handles;
+    Mutex handlesLock;
+
+    // Loaded directories and the directories being loaded
+    std::map<OriPrivId, OriDir*> dirs;
+    std::set<OriPrivId> loadingDirs;
+    std::mutex dirsLock;
+    std::condition_variable dirLoadedCV;
 
     // Journal
     OriJournalMode::JournalMode journalMode;
     std::string journalFile;
     int journalFd;
+    Mutex journalLock;
 
     // Repository State
     LocalRepo *repo;
+    Repacker *repacker;
+    OriPrefetcher *prefetcher;
+    OriWriteBack *writeBack;
     ObjectHash head;
     Commit headCommit;
     std::string tmpDir;
 
+    // Snapshot directories by root tree and path, NULL if it does not exist
+    ConcurrentCache<std::string, Tree> snapshotTrees;
+
     friend class OriCommand;
 };
 
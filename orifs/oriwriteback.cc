@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+#include <oriutil/debug.h>
+#include <oriutil/thread.h>
+#include <oriutil/rwlock.h>
+#include <ori/localrepo.h>
+
+#include "oripriv.h"
+#include "oriwriteback.h"
+
+using namespace std;
+
+class WriteBackWorker : public Thread
+{
+public:
+    WriteBackWorker(OriWriteBack *writeBack)
+        : Thread("WriteBackWorker"), writeBack(writeBack)
+    {
+    }
+    virtual void run()
+    {
+        OriFileInfo *info;
+
+        while (writeBack->nextJob(&info)) {
+            writeBack->priv->writeBackFile(info);
+        }
+    }
+private:
+    OriWriteBack *writeBack;
+};
+
+OriWriteBack::OriWriteBack(OriPriv *priv, int threads)
+    : priv(priv), exiting(false)
+{
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(new WriteBackWorker(this));
+        workers.back()->start();
+    }
+}
+
+OriWriteBack::~OriWriteBack()
+{
+    deque<OriFileInfo *> dropped;
+
+    {
+        unique_lock<mutex> l(queueLock);
+        exiting = true;
+        dropped.swap(queue);
+    }
+    queueCV.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+
+    for (size_t i = 0; i < dropped.size(); i++) {
+        dropped[i]->release();
+    }
+}
+
+void
+OriWriteBack::submit(OriFileInfo *info)
+{
+    {
+        unique_lock<mutex> l(queueLock);
+
+        if (exiting || queue.size() >= ORIWRITEBACK_MAXJOBS)
+            return;
+
+        info->retain();
+        queue.push_back(info);
+    }
+    queueCV.notify_one();
+}
+
+bool
+OriWriteBack::nextJob(OriFileInfo **info)
+{
+    unique_lock<mutex> l(queueLock);
+
+    while (queue.empty() && !exiting)
+        queueCV.wait(l);
+    if (queue.empty())
+        return false;
+
+    *info = queue.front();
+    queue.pop_front();
+    return true;
+}
+
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORIFS_ORIWRITEBACK_H__
+#define __ORIFS_ORIWRITEBACK_H__
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// Threads chunking released dirty files
+#define ORIWRITEBACK_THREADS 2
+// Files queued before new ones are left to the snapshot
+#define ORIWRITEBACK_MAXJOBS 1024
+
+class WriteBackWorker;
+
+/*
+ * Pool of threads running OriPriv::writeBackFile once dirty files are
+ * closed, so a snapshot only chunks the bytes written since.  Like read-ahead
+ * it is advisory, files are left to the snapshot when the queue is full.
+ */
+class OriWriteBack
+{
+public:
+    OriWriteBack(OriPriv *priv, int threads = ORIWRITEBACK_THREADS);
+    ~OriWriteBack();
+    /// Takes a reference to the file
+    void submit(OriFileInfo *info);
+private:
+    friend class WriteBackWorker;
+
+    bool nextJob(OriFileInfo **info);
+
+    OriPriv *priv;
+    std::vector<WriteBackWorker *> workers;
+
+    std::mutex queueLock;
+    std::condition_variable queueCV;
+    std::deque<OriFileInfo *> queue;
+    bool exiting;
+};
+
+#endif /* __ORIFS_ORIWRITEBACK_H__ */
+
@@ -18,9 +18,23 @@
 #define __HTTPCLIENT_H__
 
 #include <string>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+
+#include <oriutil/stream.h>
 
 void HttpClient_requestDoneCB(struct evhttp_request *, void *);
 
+struct HttpClientConn;
+
+struct HttpResponse
+{
+    int status;
+    std::string body;
+};
+
 class HttpClient
 {
 public:
@@ -31,23 +45,48 @@ public:
     void disconnect();
     bool connected();
 
-    // At the moment the protocol is synchronous
+    /*
+     * Requests may be made from any thread.  Each request uses one of up
+     * to HTTPCLIENT_MAXCONNS keep-alive connections and waits for one to
+     * be free.
+     */
     int getRequest(const std::string &command,
                    std::string &response);
     int postRequest(const std::string &url,
                     const std::string &payload,
                     std::string &response);
+    std::future<HttpResponse> getRequestAsync(const std::string &url);
+    std::future<HttpResponse> postRequestAsync(const std::string &url,
+                                               const std::string &payload);
+    /**
+     * Posts a request and returns the response body as a stream, the body
+     * is received while the stream is read.  The stream holds on to its
+     * connection until deleted.  @returns NULL if the request failed.
+     */
+    bytestream *postRequestStream(const std::string &url,
+                                  const std::string &payload);
     int putRequest(const std::string &command,
                    const std::string &payload,
                    std::string &response);
 
 private:
-    struct event_base *base;
-    struct evdns_base *dnsBase;
-    struct evhttp_connection *con;
+    int request(int type, const std::string &url, const std::string *payload,
+                std::string &response);
+    HttpClientConn *getConn();
+    void putConn(HttpClientConn *conn);
+    void dropConn(HttpClientConn *conn);
+    void freeConn(HttpClientConn *conn);
+
     std::string remoteHost, remotePort, remoteRepo;
+    std::string remoteIP;
+    // Idle connections
+    std::vector<HttpClientConn *> conns;
+    int numConns;
+    std::mutex connLock;
+    std::condition_variable connFree;
     friend void HttpClient_requestDoneCB(struct evhttp_request *,
                                          void *);
+    friend class HttpResponseStream;
 };
 
 #endif /* __HTTPCLIENT_H__ */
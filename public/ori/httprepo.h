@@ -42,6 +42,8 @@ public:
     bool hasObject(const ObjectHash &id);
     std::vector<bool> hasObjects(const ObjectHashVec &objs);
     bytestream *getObjects(const ObjectHashVec &objs);
+    int getObjectsStreams();
+    bytestream *getMissingObjects(const ObjectHashVec &haves);
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
@@ -49,12 +51,6 @@ public:
 
 private:
     HttpClient *client;
-    
-    std::string &_payload(const ObjectHash &id);
-    void _addPayload(const ObjectHash &id, const std::string &payload);
-    void _clearPayload(const ObjectHash &id);
-
-    std::map<ObjectHash, std::string> payloads;
 
     std::unordered_set<ObjectHash> *containedObjs;
 };
@@ -62,13 +58,15 @@ private:
 class HttpObject : public Object
 {
 public:
-    HttpObject(HttpRepo *repo, ObjectInfo info);
+    HttpObject(HttpRepo *repo, ObjectInfo info, const std::string &payload);
     ~HttpObject();
 
     bytestream *getPayloadStream();
 
 private:
     HttpRepo *repo;
+    // Kept with the object so that concurrent requests don't share it
+    std::string payload;
 };
 
 #endif /* __HTTPREPO_H__ */
@@ -24,16 +24,33 @@
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
+#include <atomic>
+#include <vector>
+
+struct HTTPServerLoop;
+
+/*
+ * Each event loop runs on its own thread and accepts connections from the
+ * same socket.  A loop busy in a handler does not accept, so new clients go
+ * to the idle loops.
+ */
 class HTTPServer
 {
 public:
-    HTTPServer(LocalRepo &repository, uint16_t port);
+    /**
+     * @param threads Event loops to run, 0 for the default
+     * @throws SystemException if the port cannot be bound
+     */
+    HTTPServer(LocalRepo &repository, uint16_t port, int threads = 0);
     ~HTTPServer();
+    /// Serves requests until stopped
     void start(bool mDNSEnable);
+    /// Stops the server, may be called from any thread
     void stop();
 protected:
     void entry(struct evhttp_request *req);
 private:
+    void freeLoops();
     int authenticate(struct evhttp_request *req, struct evbuffer *buf);
     // Handlers
     void stop(struct evhttp_request *req);
@@ -44,13 +61,14 @@ private:
     void getCommits(struct evhttp_request *req);
     void contains(struct evhttp_request *req);
     void getObjs(struct evhttp_request *req);
+    void getMissing(struct evhttp_request *req);
     void getObjInfo(struct evhttp_request *req);
     LocalRepo &repo;
     uint16_t port;
-    struct evhttp *httpd;
-    /* set if a test needs to call loopexit on a base */
-    struct event_base *base;
+    std::vector<HTTPServerLoop *> loops;
+    std::atomic<bool> exiting;
     friend void HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg);
+    friend void HTTPServerCheckCB(evutil_socket_t fd, short what, void *arg);
 };
 
 #endif
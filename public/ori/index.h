@@ -21,11 +21,28 @@
 
 #include <string>
 #include <set>
+#include <vector>
 #include <unordered_map>
 
 #include "object.h"
 #include "packfile.h"
 
+#define INDEX_SORTED ".sorted"
+#define INDEX_SORTED_MAGIC "ORIX"
+#define INDEX_SORTED_VERSION 1
+
+/*
+ * The index is kept in two files.  The sorted index (<index>.sorted) is a
+ * table of fixed size entries ordered by hash with a 256 entry fanout table
+ * in front, it is mmap'd and binary searched so opening a repository does
+ * not depend on the number of objects.  The index log (<index>) is the
+ * append-only journal of entries added since the sorted index was last
+ * written, it is loaded into memory and merged into the sorted index by
+ * rewrite().  Purged objects are recorded as entries of type
+ * ObjectInfo::Purged that hide the object.  These are kept in the sorted
+ * index until the packfiles are compacted, so that rebuilding the index from
+ * the packfiles does not bring the objects back.
+ */
 class Index
 {
 public:
@@ -34,18 +51,53 @@ public:
     void open(const std::string &indexFile);
     void close();
     void sync();
-    void rewrite();
+    /**
+     * Merge the index log into the sorted index and truncate the log.
+     * @param dropPurged Drop the purged entries, only once no packfile
+     * holds the purged objects
+     */
+    void rewrite(bool dropPurged = false);
     void dump();
     void updateEntry(const ObjectHash &objId, const IndexEntry &entry);
-    const IndexEntry &getEntry(const ObjectHash &objId) const;
-    const ObjectInfo &getInfo(const ObjectHash &objId) const;
+    /// Adds the entries with a single append to the index log
+    void updateEntries(const std::vector<IndexEntry> &entries);
+    /// Points existing objects at a new packfile location
+    void relocateEntries(const std::vector<IndexEntry> &entries);
+    /// Marks the objects as purged
+    void removeEntries(const std::vector<ObjectHash> &objIds);
+    /// @returns the objects marked as purged
+    std::vector<ObjectHash> getPurged() const;
+    /**
+     * In group commit mode appends to the index log are buffered until
+     * flush or sync is called.
+     */
+    void setGroupCommit(bool enable);
+    void flush();
+    IndexEntry getEntry(const ObjectHash &objId) const;
+    ObjectInfo getInfo(const ObjectHash &objId) const;
     bool hasObject(const ObjectHash &objId) const;
     std::set<ObjectInfo> getList();
 private:
     int fd;
     std::string fileName;
+    // Entries in the index log
     std::unordered_map<ObjectHash, IndexEntry> index;
+    // Encoded entries not yet appended to the index log
+    std::string pending;
+    bool groupCommit;
+
+    // Sorted index mapping
+    uint8_t *sortedMap;
+    size_t sortedLen;
+    size_t sortedCount;
+    const uint8_t *sortedEntries;
+    uint32_t fanout[256];
 
+    void _openSorted();
+    void _closeSorted();
+    bool _findSorted(const ObjectHash &objId, IndexEntry *entry) const;
+    static std::string _encodeEntry(const IndexEntry &e);
+    static IndexEntry _decodeEntry(const uint8_t *buf);
     void _writeEntry(const IndexEntry &e);
 };
 
@@ -21,6 +21,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "repo.h"
 
@@ -35,27 +36,70 @@ public:
 };
 
 class Repo;
+class ObjectPipeline;
+
+/*
+ * Random access to the bytes of a file being chunked.
+ */
+class LargeBlobSource
+{
+public:
+    virtual ~LargeBlobSource() { }
+    virtual uint64_t size() = 0;
+    /// @returns the bytes read, fewer only at the end, or -errno
+    virtual ssize_t read(uint8_t *buf, size_t len, uint64_t off) = 0;
+};
+
+class LargeBlobFile : public LargeBlobSource
+{
+public:
+    LargeBlobFile();
+    virtual ~LargeBlobFile();
+    /// @returns 0 or -errno
+    int open(const std::string &path);
+    virtual uint64_t size();
+    virtual ssize_t read(uint8_t *buf, size_t len, uint64_t off);
+private:
+    int fd;
+    uint64_t fileSize;
+};
 
 class LargeBlob
 {
 public:
     explicit LargeBlob(Repo *r);
     ~LargeBlob();
-    void chunkFile(const std::string &path);
+    /// Fragments are added through pipe if one is given
+    void chunkFile(const std::string &path, ObjectPipeline *pipe = NULL);
+    /*
+     * Chunk a file that matches base outside of the dirty ranges (start to
+     * end) without adding the chunks to the repository.  The parts of base
+     * that no dirty range overlaps are kept.  From a changed part on the file
+     * is chunked until a cut lands where a kept part starts.
+     */
+    void rechunkFile(const std::string &path, const LargeBlob &base,
+                     const std::map<uint64_t, uint64_t> &dirty);
+    void rechunk(LargeBlobSource *src, const LargeBlob &base,
+                 const std::map<uint64_t, uint64_t> &dirty);
     void extractFile(const std::string &path);
-    /// May read less than s bytes
+    /// Reads less than s bytes only at the end of the file
     ssize_t read(uint8_t *buf, size_t s, off_t off) const;
     // XXX: Stream read/write operations
-    const std::string getBlob();
+    const std::string getBlob() const;
     void fromBlob(const std::string &blob);
     size_t totalSize() const;
+    /// Append a part to the end of the file
+    void addPart(const ObjectHash &hash, uint16_t length);
+    /// @returns the index of the part containing off or parts.size()
+    size_t findPart(uint64_t off) const;
     /*
-     * A map of the file parts contains the file offset as the key and the large 
-     * blob entry object as the value.  It allows O(log n) random access into 
-     * the file.
+     * The file parts in file order and the file offset of each part.  The
+     * offsets are kept in their own array so finding the part at an offset is
+     * a binary search over 8 bytes per part.
      */
     ObjectHash totalHash;
-    std::map<uint64_t, LBlobEntry> parts;
+    std::vector<LBlobEntry> parts;
+    std::vector<uint64_t> offsets;
     Repo *repo;
 };
 
@@ -27,6 +27,7 @@
 #include <oriutil/stream.h>
 #include "object.h"
 #include "packfile.h"
+#include "objectcache.h"
 
 class LocalObject : public Object
 {
@@ -34,18 +35,25 @@ public:
     typedef std::shared_ptr<LocalObject> sp;
 
     LocalObject(PfTransaction::sp transaction, size_t ix);
-    LocalObject(Packfile::sp packfile, const IndexEntry &entry);
+    LocalObject(Packfile::sp packfile, const IndexEntry &entry,
+                ObjectCache *cache = NULL);
     ~LocalObject();
 
     // BaseObject implementation
     bytestream *getPayloadStream();
+    std::string getPayload();
+    /// Read part of the payload, only decoding the blocks that cover it
+    /// @returns bytes read or -1 on error
+    ssize_t readPayload(uint8_t *buf, size_t n, size_t off);
 
 private:
     PfTransaction::sp transaction;
-    size_t ix_tr;
+    // Copied, the transaction keeps growing while the object is read
+    std::string stored;
 
     Packfile::sp packfile;
     IndexEntry entry;
+    ObjectCache *cache;
     //void setupLzma(lzma_stream *strm, bool encode);
     //bool appendLzma(int dstFd, lzma_stream *strm, lzma_action action);
 };
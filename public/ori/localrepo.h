@@ -18,9 +18,12 @@
 #define __LOCALREPO_H__
 
 #include <memory>
+#include <atomic>
+#include <unordered_set>
 
 #include <oriutil/lrucache.h>
 #include <oriutil/key.h>
+#include <oriutil/rwlock.h>
 #include "repo.h"
 #include "index.h"
 #include "snapshotindex.h"
@@ -34,6 +37,7 @@
 #include "packfile.h"
 #include "mergestate.h"
 #include "varlink.h"
+#include "objectcache.h"
 
 #define ORI_PATH_DIR "/.ori"
 #define ORI_PATH_VERSION "/version"
@@ -103,6 +107,11 @@ public:
      * Check if a remote repository is set.
      */
     bool hasRemote();
+    /**
+     * Fetch the objects missing locally from the remote in a single request.
+     * @returns the objects to be stored with receive or NULL if none
+     */
+    bytestream *fetchObjects(const ObjectHashVec &objs);
 
     // Repo implementation
     int distance() { return 0; }
@@ -114,8 +123,30 @@ public:
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
+    bool encodeObject(ObjectInfo &info, const std::string &payload,
+                      std::string &stored);
+    int addEncodedObject(const ObjectInfo &info, std::string &stored);
+    /**
+     * Add a file chunked ahead of time by LargeBlob::rechunkFile.  Only the
+     * chunks that are not stored yet are read from the file, files that are
+     * no longer large or no longer match the chunks are added whole.
+     */
+    void addChunkedFile(const std::string &path, const LargeBlob &lb,
+                        ObjectPipeline *pipe, ObjectHash *hash,
+                        ObjectHash *largeHash);
+    /// Same for a large file read through src, always added as a LargeBlob
+    void addChunkedFile(LargeBlobSource *src, const LargeBlob &lb,
+                        ObjectPipeline *pipe, ObjectHash *hash,
+                        ObjectHash *largeHash);
 
     void sync(); /// sync all changes to disk
+    /**
+     * In group commit mode packfiles, index and metadata updates are only
+     * written and fsync'd by sync, so a batch of transactions costs one
+     * fsync per file instead of one per packfile.  Changes made since the
+     * last sync are lost on a crash.
+     */
+    void setGroupCommit(bool enable);
 
     // Index
     bool rebuildIndex();
@@ -123,6 +154,32 @@ public:
     void dumpPackfile(packid_t packfileId);
 
     LocalObject::sp getLocalObject(const ObjectHash &objId);
+
+    // Object Cache
+    /**
+     * Cache of decompressed payloads shared by all objects read from
+     * packfiles.  The size defaults to OBJCACHE_DEFAULTSIZE and may be
+     * overridden with the ORI_OBJCACHE environment variable (in MB).
+     */
+    ObjectCache &getObjectCache();
+
+    // Transfer Locality
+    struct TransmitStats {
+        TransmitStats() : calls(0), objects(0), runs(0) { }
+        uint64_t calls;
+        uint64_t objects;
+        /// Contiguous byte ranges read from packfiles
+        uint64_t runs;
+    };
+    TransmitStats getTransmitStats();
+
+    // Compression
+    /**
+     * Set the codec policy used for objects added after this call.  Objects
+     * already stored keep their codec.
+     */
+    void setZipPolicy(const ZipPolicy &policy);
+    const ZipPolicy &getZipPolicy() const;
     
     std::vector<Commit> listCommits();
     std::map<std::string, ObjectHash> listSnapshots();
@@ -134,6 +191,8 @@ public:
     size_t getObjectLength(const ObjectHash &objId);
     ObjectType getObjectType(const ObjectHash &objId);
     std::string getPayload(const ObjectHash &objId);
+    ssize_t readPayload(const ObjectHash &objId, uint8_t *buf, size_t n,
+                        size_t off);
     std::string verifyObject(const ObjectHash &objId);
     size_t sendObject(const char *objId);
 
@@ -144,6 +203,9 @@ public:
     void pull(Repo *r);
     void multiPull(RemoteRepo::sp defaultRemote);
     void transmit(bytewstream *bs, const std::vector<ObjectHash> &objs);
+    /// Output of transmit read from the packfiles as it is consumed
+    bytestream *transmitStream(const std::vector<ObjectHash> &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &haves);
     void receive(bytestream *bs);
     bytestream *getObjects(const std::vector<ObjectHash> &objs);
 
@@ -161,7 +223,8 @@ public:
     ObjectHash commitFromObjects(const ObjectHash &treeHash, Repo *objects,
             Commit &c, const std::string &status="normal");
 
-    void gc();
+    /// @param reorder Also rewrite all packfiles in traversal order
+    void gc(bool reorder = false);
 
     // Reference Counting Operations
     MetadataLog &getMetadata();
@@ -224,6 +287,15 @@ public:
 private:
     // Helper Functions
     void createObjDirs(const ObjectHash &objId);
+    Packfile::sp newPackfile();
+    void prepareTransaction();
+    bool isStored(const ObjectHash &objId);
+    bool pullMissing(Repo *r, std::deque<Commit> *newCommits);
+    void pullObjects(Repo *r, std::deque<Commit> *newCommits);
+    void addStoredObjects(const ObjectHash &hash,
+                          const std::unordered_set<ObjectHash> &have,
+                          std::unordered_set<ObjectHash> *seen,
+                          ObjectHashVec *objs);
 public: // Hack to enable rebuild operations
     std::string objIdToPath(const ObjectHash &objId);
 private:
@@ -238,12 +310,23 @@ private:
     MetadataLog metadata;
 
     // Packfiles
+    // Guards index, packfiles, currPackfile and currTransaction.  Taken
+    // after remoteLock and never held across calls back into the repo.
+    RWLock storeLock;
     Packfile::sp currPackfile;
     PfTransaction::sp currTransaction;
     PackfileManager::sp packfiles;
-
-    // Purging
-    std::set<ObjectHash> purged;
+    ObjectCache objCache;
+    ZipPolicy zipPolicy;
+    bool groupCommit;
+    // Packfiles written since the last sync in group commit mode
+    std::vector<Packfile::sp> unsyncedPacks;
+
+    // Objects purged since the repository was opened
+    uint64_t purgeCount;
+    std::atomic<uint64_t> transmitCalls;
+    std::atomic<uint64_t> transmitObjects;
+    std::atomic<uint64_t> transmitRuns;
 
     // Repo lock
     LocalRepoLock::sp repoProcessLock;
@@ -256,6 +339,7 @@ private:
 
     // Friends
     friend int LocalRepo_PeerHelper(LocalRepo *l, const std::string &path);
+    friend class Repacker;
 };
 
 #endif
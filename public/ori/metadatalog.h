@@ -51,6 +51,12 @@ public:
 
     void open(const std::string &filename);
     void sync();
+    /**
+     * In group commit mode committed transactions are buffered until flush
+     * or sync is called.
+     */
+    void setGroupCommit(bool enable);
+    void flush();
     /// rewrites the log file, optionally with new counts
     void rewrite(const RefcountMap *refs = NULL, const MetadataMap *data = NULL);
 
@@ -69,6 +75,9 @@ private:
     friend class MdTransaction;
     int fd;
     std::string filename;
+    // Committed transactions not yet appended to the log
+    std::string pending;
+    bool groupCommit;
     RefcountMap refcounts;
     MetadataMap metadata;
 };
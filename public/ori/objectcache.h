@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __OBJECTCACHE_H__
+#define __OBJECTCACHE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <memory>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/concurrentcache.h>
+
+/*
+ * Cache of decompressed object payloads.
+ *
+ * Objects are immutable so entries never go stale, they only need to be
+ * dropped when an object is purged.  Entries are weighted by payload size in
+ * a ConcurrentCache, payloads are handed out as shared pointers so a hit
+ * never copies the payload while holding a shard lock.
+ */
+class ObjectCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Payload;
+
+    struct Stats {
+        Stats() : hits(0), misses(0), evictions(0), bytes(0), entries(0) { }
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t bytes;
+        uint64_t entries;
+    };
+
+    explicit ObjectCache(size_t maxBytes);
+    ~ObjectCache();
+
+    /// Returns NULL on a miss
+    Payload get(const ObjectHash &hash);
+    void put(const ObjectHash &hash, const Payload &payload);
+    void invalidate(const ObjectHash &hash);
+    void clear();
+    /// A size of zero disables the cache
+    void setMaxSize(size_t maxBytes);
+    size_t getMaxSize() const;
+    Stats getStats();
+private:
+    ConcurrentCache<ObjectHash, const std::string> cache;
+};
+
+#endif /* __OBJECTCACHE_H__ */
+
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __OBJECTPIPELINE_H__
+#define __OBJECTPIPELINE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/objectinfo.h>
+
+class Repo;
+class PipelineWorker;
+
+/*
+ * Hashes and encodes objects on a pool of worker threads.
+ *
+ * Objects are handed back to the repository by the thread calling add and
+ * drain, in the order they were added, so the packfile contents are the same
+ * as adding the objects one at a time and the repository is only modified
+ * from one thread.  The output hash of an object is valid once drain
+ * returns.  The amount of queued payload is bounded, add blocks and writes
+ * completed objects when the bound is reached.
+ */
+class ObjectPipeline
+{
+public:
+    /// @param threads Number of workers, zero picks one per processor
+    explicit ObjectPipeline(Repo *repo, int threads = 0);
+    ~ObjectPipeline();
+
+    /// Queue payload (swapped out of the argument) to be added to the repo
+    void add(ObjectType type, std::string &payload, ObjectHash *hash);
+    /// Queue a received payload to be checked against info
+    void verify(const ObjectInfo &info, const uint8_t *buf, size_t len);
+    /// Wait for all queued objects and add them to the repo
+    void drain();
+    /// @returns false if any object failed verification since the last reset
+    bool ok() const;
+    void reset();
+private:
+    friend class PipelineWorker;
+
+    struct Job {
+        enum Kind { Add, Verify };
+        Kind kind;
+        ObjectInfo info;
+        std::string payload;
+        std::string stored;
+        // Already in the repo, nothing is written
+        bool present;
+        bool encoded;
+        bool ok;
+        bool done;
+        size_t bytes;
+        ObjectHash *hash;
+    };
+
+    void process(Job *job);
+    void submit(Job *job);
+    void complete(Job *job);
+    void write(Job *job);
+    void writeCompleted(bool wait, size_t maxJobs, size_t maxBytes);
+    Job *nextJob();
+
+    Repo *repo;
+    std::vector<PipelineWorker *> workers;
+    bool failed;
+
+    // Held while checking for or adding objects in the repo
+    std::mutex repoLock;
+    std::mutex lock;
+    std::condition_variable workCV;
+    std::condition_variable doneCV;
+    bool exiting;
+    // Jobs in submission order and jobs waiting for a worker
+    std::deque<Job *> pending;
+    std::deque<Job *> work;
+    size_t pendingBytes;
+};
+
+#endif /* __OBJECTPIPELINE_H__ */
+
@@ -24,7 +24,8 @@
 
 #include <oriutil/objecthash.h>
 #include <oriutil/stream.h>
-#include <oriutil/lrucache.h>
+#include <oriutil/zipcodec.h>
+#include <oriutil/concurrentcache.h>
 #include "object.h"
 
 typedef uint32_t offset_t;
@@ -42,18 +43,40 @@ struct IndexEntry
         sizeof(uint32_t) + sizeof(packid_t);
 };
 
+/*
+ * Chooses the codec for each object added to a transaction.  Commits, trees
+ * and small blobs are read often and use the fast codec, blobs of at least
+ * denseMinimum bytes are mostly cold file data and use the dense codec.
+ */
+struct ZipPolicy
+{
+    ZipPolicy();
+    ObjectInfo::ZipAlgo select(ObjectType type, size_t size) const;
+
+    ObjectInfo::ZipAlgo fastAlgo;
+    ObjectInfo::ZipAlgo denseAlgo;
+    size_t denseMinimum;
+};
+
 class Packfile;
+class PfTransmitStream;
 class Index;
+class ObjectPipeline;
 class PfTransaction
 {
 public:
     typedef std::shared_ptr<PfTransaction> sp;
 
-    PfTransaction(Packfile *pf, Index *idx);
+    PfTransaction(Packfile *pf, Index *idx,
+                  const ZipPolicy &policy = ZipPolicy());
     ~PfTransaction();
 
     bool full() const;
     void addPayload(ObjectInfo info, const std::string &payload);
+    /// Adds a payload prepared by encodePayload, takes the contents of stored
+    void addStored(const ObjectInfo &info, std::string &stored);
+    static void encodePayload(const ZipPolicy &policy, ObjectInfo &info,
+                              const std::string &payload, std::string &stored);
     bool has(const ObjectHash &hash) const;
     void commit();
 
@@ -67,34 +90,71 @@ public:
 private:
     Packfile *pf;
     Index *idx;
-    float _checkCompressionRatio(const std::string &payload);
+    ZipPolicy policy;
+    static float _checkCompressionRatio(const ZipCodec *codec,
+                                        const std::string &payload);
 };
 
+/*
+ * Packfile readers (getPayload, readStored, getEntries, readEntries and
+ * transmit) only use positional reads and may be called concurrently from
+ * multiple threads.  Writers (append, commit and receive) must be serialized
+ * by the caller and must not run concurrently with readers of the same
+ * packfile.
+ */
 class Packfile
 {
 public:
     typedef std::shared_ptr<Packfile> sp;
 
-    Packfile(const std::string &filename, packid_t id);
+    /// @param create Create the file if it does not exist
+    Packfile(const std::string &filename, packid_t id, bool create = true);
     ~Packfile();
 
     packid_t getPackfileID() const;
 
     bool full() const;
-    PfTransaction::sp begin(Index *idx);
+    PfTransaction::sp begin(Index *idx, const ZipPolicy &policy = ZipPolicy());
     void commit(PfTransaction *t, Index *idx);
+    /**
+     * Writes the objects without adding them to the index.  The packfile is
+     * left dirty, the caller must sync it before publishing the entries.
+     */
+    std::vector<IndexEntry> append(PfTransaction *t);
+    /**
+     * In group commit mode commit and receive do not fsync, the packfile is
+     * marked dirty until sync is called.  The caller must sync the packfile
+     * before the index entries referring to it are made durable.
+     */
+    void setGroupCommit(bool enable);
+    bool isDirty() const;
+    void sync();
     //void addPayload(ObjectInfo info, const std::string &payload, Index *idx);
     bytestream *getPayload(const IndexEntry &entry);
-    /// @returns true when the packfile is empty
-    bool purge(const std::set<ObjectHash> &hset, Index *idx);
+    /// Stream starting at offset of the decompressed payload
+    bytestream *getPayload(const IndexEntry &entry, size_t offset);
+    /// Reads the object as stored in the packfile
+    void readStored(const IndexEntry &entry, std::string &stored);
+    /// @returns the entries of all objects written to the packfile
+    std::vector<IndexEntry> getEntries();
 
     typedef void (*ReadEntryCb)(const ObjectInfo &info, offset_t off,
                                 void *arg);
     void readEntries(ReadEntryCb cb, void *arg);
 
-    void transmit(bytewstream *bs, std::vector<IndexEntry> objects);
-    /// @returns false if nothing to receive
-    bool receive(bytestream *bs, Index *idx);
+    /// @returns the number of contiguous ranges sent
+    size_t transmit(bytewstream *bs, std::vector<IndexEntry> objects);
+    /**
+     * Same output as transmit read from the packfile as the stream is
+     * consumed.  The packfile must outlive the stream.
+     */
+    PfTransmitStream *transmitStream(const std::vector<IndexEntry> &objects);
+    /**
+     * @param verifier Optionally checks the received objects in parallel,
+     *                 they are discarded if any of them is corrupt
+     * @returns false if nothing to receive
+     */
+    bool receive(bytestream *bs, Index *idx, ObjectPipeline *verifier = NULL);
 
 private:
     int fd;
@@ -102,8 +162,35 @@ private:
     packid_t packid;
     size_t numObjects;
     size_t fileSize;
+    bool groupCommit;
+    bool dirty;
 };
 
+/*
+ * Object infos followed by the contiguous ranges of the packfile holding the
+ * objects (see Packfile::transmit).  Ranges are read with pread as needed.
+ */
+class PfTransmitStream : public bytestream
+{
+public:
+    bool ended();
+    size_t read(uint8_t *buf, size_t n);
+    size_t sizeHint() const;
+    /// @returns the number of contiguous ranges
+    size_t runs() const;
+
+private:
+    PfTransmitStream(int fd, std::vector<IndexEntry> objects);
+
+    int fd;
+    std::string header;
+    std::vector<std::pair<offset_t, offset_t> > blocks;
+    size_t size;
+    size_t pos;         // position in the stream
+    size_t curr;        // block being read
+    offset_t off;       // position in the current block
+    friend class Packfile;
+};
 
 #define PFMGR_FREELIST ".freelist"
 
@@ -115,8 +202,11 @@ public:
     PackfileManager(const std::string &rootPath);
     ~PackfileManager();
 
+    /// @throws SystemException if the packfile does not exist
     Packfile::sp getPackfile(packid_t id);
     Packfile::sp newPackfile();
+    /// Deletes an unreferenced packfile and returns its id to the free list
+    void removePackfile(packid_t id);
     bool hasPackfile(packid_t id);
     std::vector<packid_t> getPackfileList();
 
@@ -128,7 +218,7 @@ private:
     bool _loadFreeList();
     void _writeFreeList();
 
-    LRUCache<uint32_t, Packfile::sp, 96> _packfileCache;
+    ConcurrentCache<packid_t, Packfile> _packfileCache;
 
     std::string _getPackfileName(packid_t id);
 };
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __REPACKER_H__
+#define __REPACKER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+#include <oriutil/thread.h>
+#include <oriutil/rwlock.h>
+
+#include "packfile.h"
+
+class LocalRepo;
+
+/*
+ * Reclaims the space of purged objects.  A packfile is compacted once
+ * enough of it is dead, i.e. objects whose index entry was purged or points
+ * at another copy.  Its live objects are copied into a new packfile in
+ * bounded batches, the index is pointed at the copies and the old packfile
+ * is deleted and its id recycled.
+ *
+ * When given a lock the repacker only holds it for short sections, reading
+ * and writing packfiles happens without it, so it may run in the background
+ * of a process serving the repository.  All progress is recorded in the
+ * index, a repacker that is stopped or crashes picks up where it left off.
+ *
+ * reorder rewrites all packfiles so objects are stored in the order they are
+ * read: each commit followed by its trees, each tree followed by its files
+ * and a LargeBlob followed by its chunks.  Transfers and snapshot reads then
+ * touch long contiguous ranges instead of seeking across packfiles.
+ */
+class Repacker : public Thread
+{
+public:
+    /// @param lock Lock protecting the repository or NULL if not shared
+    explicit Repacker(LocalRepo *repo, RWLock *lock = NULL);
+    ~Repacker();
+
+    /// Only compact packfiles with at least this fraction of dead bytes
+    void setMinDead(float ratio);
+    /// Limit the bytes copied per second, zero is unlimited
+    void setRate(size_t bytesPerSec);
+    /// Compact all packfiles worth compacting
+    /// @returns the number of packfiles removed
+    size_t repack();
+    /// Rewrite all packfiles in traversal order
+    /// @returns the number of packfiles removed
+    size_t reorder();
+
+    /// Repack whenever objects have been purged until stop is called
+    virtual void run();
+    void stop();
+private:
+    bool scan(packid_t id, std::vector<IndexEntry> *live);
+    bool isEligible(packid_t id);
+    bool copy(const std::vector<IndexEntry> &live);
+    bool remove(packid_t id);
+    bool isLive(const IndexEntry &entry);
+    struct Traversal;
+    void visitTree(const ObjectHash &hash, Traversal *t);
+    void visitLargeBlob(const ObjectHash &hash, Traversal *t);
+    bool visitObject(const ObjectHash &hash, Traversal *t);
+    RWKey::sp readLock();
+    RWKey::sp writeLock();
+    void throttle(size_t bytes);
+    bool stopping();
+
+    LocalRepo *repo;
+    RWLock *lock;
+    float minDead;
+    size_t rate;
+    // Packfile receiving the copies
+    Packfile::sp output;
+
+    std::mutex stopLock;
+    std::condition_variable stopCV;
+    bool exiting;
+};
+
+#endif /* __REPACKER_H__ */
+
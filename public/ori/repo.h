@@ -35,6 +35,7 @@ extern ObjectHash EMPTYFILE_HASH;
 typedef std::vector<ObjectHash> ObjectHashVec;
 
 class LargeBlob;
+class ObjectPipeline;
 
 class Repo
 {
@@ -59,6 +60,12 @@ public:
     virtual bytestream *getObjects(
             const ObjectHashVec &objs
             ) = 0;
+    /**
+     * @returns how many streams returned by getObjects may be open at once.
+     * Once there are that many, getObjects may only be called again after
+     * one of them is read to the end and deleted.
+     */
+    virtual int getObjectsStreams();
 
     // Object queries
     virtual std::set<ObjectInfo> listObjects() = 0;
@@ -70,15 +77,33 @@ public:
             const std::string &payload
             ) = 0;
 
+    /*
+     * Used by ObjectPipeline.  encodeObject prepares the stored form of an
+     * object and may be called from several threads at once, the encoded
+     * object is then added with addEncodedObject.  Repositories that do not
+     * encode objects return false and the object is added with addObject.
+     * addEncodedObject may take the contents of stored.  isObjectStored
+     * lets the pipeline skip objects already present, it is called from the
+     * workers but never while the pipeline adds an object.
+     */
+    virtual bool isObjectStored(const ObjectHash &id);
+    virtual bool encodeObject(ObjectInfo &info, const std::string &payload,
+                              std::string &stored);
+    virtual int addEncodedObject(const ObjectInfo &info,
+                                 std::string &stored);
+
     // Wrappers
     virtual ObjectHash addBlob(ObjectType type, const std::string &blob);
     bytestream *getObjects(const std::deque<ObjectHash> &objs);
 
     ObjectHash addSmallFile(const std::string &path);
     std::pair<ObjectHash, ObjectHash>
-        addLargeFile(const std::string &path);
+        addLargeFile(const std::string &path, ObjectPipeline *pipe = NULL);
     std::pair<ObjectHash, ObjectHash>
         addFile(const std::string &path);
+    /// Adds the file through pipe, the hashes are set once pipe is drained
+    void addFile(const std::string &path, ObjectPipeline *pipe,
+                 ObjectHash *hash, ObjectHash *largeHash);
 
     virtual Tree getTree(const ObjectHash &treeId);
     virtual Commit getCommit(const ObjectHash &commitId);
@@ -90,6 +115,12 @@ public:
     // Transport
     virtual void transmit(bytewstream *bs, const ObjectHashVec &objs);
     virtual void receive(bytestream *bs);
+    /**
+     * Objects reachable from the commits held here but not from the commits
+     * in haves, in the format written by transmit.  Commits in haves that
+     * are unknown here are ignored.  @returns NULL if not supported.
+     */
+    virtual bytestream *getMissingObjects(const ObjectHashVec &haves);
 
     // Extensions
     virtual std::set<std::string> listExt();
@@ -40,6 +40,7 @@ public:
     ObjectInfo getObjectInfo(const ObjectHash &id);
     bool hasObject(const ObjectHash &id);
     bytestream *getObjects(const ObjectHashVec &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &haves);
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
@@ -55,6 +56,8 @@ private:
     std::map<ObjectHash, std::string> payloads;
 
     std::unordered_set<ObjectHash> *containedObjs;
+    // Protocol version of the server, empty until asked
+    std::string protoVersion;
 };
 
 class SshObject : public Object
@@ -42,6 +42,7 @@ public:
     ObjectInfo getObjectInfo(const ObjectHash &id);
     bool hasObject(const ObjectHash &id);
     bytestream *getObjects(const ObjectHashVec &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &haves);
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
@@ -64,6 +65,8 @@ private:
     std::map<ObjectHash, std::string> payloads;
 
     std::unordered_set<ObjectHash> *containedObjs;
+    // Protocol version of the server, empty until asked
+    std::string protoVersion;
 };
 
 class UDSObject : public Object
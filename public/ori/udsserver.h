@@ -19,7 +19,7 @@
 
 #include <oriutil/mutex.h>
 
-#define ORI_UDS_PROTO_VERSION "1.0"
+#define ORI_UDS_PROTO_VERSION "1.1"
 
 class UDSSession;
 
@@ -62,6 +62,7 @@ public:
     void cmd_listObjs();
     void cmd_listCommits();
     void cmd_readObjs();
+    void cmd_getMissing();
     void cmd_getObjInfo();
     void cmd_getHead();
     void cmd_getFSID();
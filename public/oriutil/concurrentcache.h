@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CONCURRENTCACHE_H__
+#define __CONCURRENTCACHE_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+
+#include "debug.h"
+#include "mutex.h"
+#include "monitor.h"
+
+/*
+ * LRU cache for use by many threads.
+ *
+ * Keys are spread over shards, each with its own mutex, LRU list and share
+ * of the capacity, so threads only contend when they hit the same shard.
+ * The LRU list is threaded through the hash table entries, an insert
+ * allocates one table node and a lookup allocates nothing.  Values are
+ * handed out as shared pointers, a hit never copies the value and the value
+ * stays valid after it is evicted.
+ *
+ * Every entry has a weight, e.g. its size in bytes, and a shard evicts its
+ * least recently used entries once their total weight exceeds its share of
+ * the capacity.
+ */
+template <class K, class V, class H = std::hash<K> >
+class ConcurrentCache
+{
+public:
+    typedef std::shared_ptr<V> Handle;
+
+    struct Stats {
+        Stats() : hits(0), misses(0), evictions(0), weight(0), entries(0) { }
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t weight;
+        uint64_t entries;
+    };
+
+    /// @param capacity Total weight held, zero disables the cache
+    explicit ConcurrentCache(size_t capacity, int numShards = 16)
+        : numShards(numShards), capacity(capacity)
+    {
+        ASSERT(numShards > 0);
+        shards = new Shard[numShards];
+    }
+    ~ConcurrentCache()
+    {
+        delete[] shards;
+    }
+
+    /// Returns NULL on a miss
+    Handle get(const K &key)
+    {
+        Shard &s = getShard(key);
+        Monitor lock(s.lock);
+
+        typename Map::iterator it = s.map.find(key);
+        if (it == s.map.end()) {
+            s.misses++;
+            return Handle();
+        }
+
+        s.hits++;
+        s.touch(&(*it).second);
+        return (*it).second.value;
+    }
+    /// Looks up a key without counting a hit or refreshing it
+    bool hasKey(const K &key)
+    {
+        Shard &s = getShard(key);
+        Monitor lock(s.lock);
+
+        return s.map.find(key) != s.map.end();
+    }
+    /// Insert or replace a value
+    /// @returns false if the entry does not fit in a shard
+    bool put(const K &key, const Handle &value, size_t weight = 1)
+    {
+        Shard &s = getShard(key);
+        Monitor lock(s.lock);
+        size_t limit = capacity / numShards;
+
+        if (limit == 0 || weight > limit)
+            return false;
+
+        typename Map::iterator it = s.map.find(key);
+        if (it != s.map.end()) {
+            Entry *e = &(*it).second;
+
+            s.weight -= e->weight;
+            e->value = value;
+            e->weight = weight;
+            s.touch(e);
+            s.weight += weight;
+            evict(s, limit);
+            return true;
+        }
+
+        evict(s, limit - weight);
+
+        it = s.map.emplace(key, Entry()).first;
+        Entry *e = &(*it).second;
+        e->value = value;
+        e->weight = weight;
+        e->key = &(*it).first;
+        s.link(e);
+        s.weight += weight;
+
+        return true;
+    }
+    void invalidate(const K &key)
+    {
+        Shard &s = getShard(key);
+        Monitor lock(s.lock);
+
+        typename Map::iterator it = s.map.find(key);
+        if (it == s.map.end())
+            return;
+
+        s.unlink(&(*it).second);
+        s.weight -= (*it).second.weight;
+        s.map.erase(it);
+    }
+    void clear()
+    {
+        for (int i = 0; i < numShards; i++) {
+            Monitor lock(shards[i].lock);
+
+            shards[i].map.clear();
+            shards[i].head.prev = shards[i].head.next = &shards[i].head;
+            shards[i].weight = 0;
+        }
+    }
+    void setCapacity(size_t newCapacity)
+    {
+        for (int i = 0; i < numShards; i++)
+            shards[i].lock.lock();
+
+        capacity = newCapacity;
+        for (int i = 0; i < numShards; i++) {
+            evict(shards[i], capacity / numShards);
+            shards[i].lock.unlock();
+        }
+    }
+    size_t getCapacity() const
+    {
+        return capacity;
+    }
+    Stats getStats()
+    {
+        Stats st;
+
+        for (int i = 0; i < numShards; i++) {
+            Monitor lock(shards[i].lock);
+
+            st.hits += shards[i].hits;
+            st.misses += shards[i].misses;
+            st.evictions += shards[i].evictions;
+            st.weight += shards[i].weight;
+            st.entries += shards[i].map.size();
+        }
+
+        return st;
+    }
+private:
+    struct Entry {
+        Entry() : weight(0), prev(NULL), next(NULL), key(NULL) { }
+        Handle value;
+        size_t weight;
+        // LRU list, least recently used first
+        Entry *prev;
+        Entry *next;
+        const K *key;
+    };
+    typedef std::unordered_map<K, Entry, H> Map;
+
+    struct Shard {
+        Shard() : weight(0), hits(0), misses(0), evictions(0)
+        {
+            head.prev = head.next = &head;
+        }
+        void link(Entry *e)
+        {
+            e->prev = head.prev;
+            e->next = &head;
+            head.prev->next = e;
+            head.prev = e;
+        }
+        void unlink(Entry *e)
+        {
+            e->prev->next = e->next;
+            e->next->prev = e->prev;
+        }
+        void touch(Entry *e)
+        {
+            unlink(e);
+            link(e);
+        }
+        Mutex lock;
+        Map map;
+        Entry head;
+        size_t weight;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        // Keep shards on separate cache lines
+        char pad[64];
+    };
+
+    Shard &getShard(const K &key)
+    {
+        // Mix the hash, std::hash of an integer is the integer itself
+        uint64_t h = H()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+
+        return shards[h % numShards];
+    }
+    /*
+     * Drop least recently used entries until the shard weighs at most limit.
+     * Caller must hold the shard lock.
+     */
+    void evict(Shard &s, size_t limit)
+    {
+        while (s.weight > limit && s.head.next != &s.head) {
+            Entry *e = s.head.next;
+            typename Map::iterator it = s.map.find(*e->key);
+            ASSERT(it != s.map.end());
+
+            s.unlink(e);
+            s.weight -= e->weight;
+            s.map.erase(it);
+            s.evictions++;
+        }
+    }
+
+    int numShards;
+    size_t capacity;
+    Shard *shards;
+};
+
+#endif /* __CONCURRENTCACHE_H__ */
+
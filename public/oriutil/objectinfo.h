@@ -31,13 +31,16 @@
 #define ORI_FLAG_UNCOMPRESSED   0x0000
 #define ORI_FLAG_FASTLZ         0x0001
 #define ORI_FLAG_LZMA           0x0002
+#define ORI_FLAG_SNAPPY         0x0003
 #define ORI_FLAG_ZIPMASK        0x000F
+#define ORI_FLAG_FRAMED         0x0010
 
 #define ORI_FLAG_DEFAULT        0x0000
 
 struct ObjectInfo {
     enum Type { Null, Commit, Tree, Blob, LargeBlob, Purged };
-    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA };
+    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA,
+                   ZIPALGO_SNAPPY };
 
     ObjectInfo();
     explicit ObjectInfo(const ObjectHash &hash);
@@ -51,6 +54,9 @@ struct ObjectInfo {
     bool isCompressed() const;
     ZipAlgo getAlgo() const;
     void setAlgo(ZipAlgo algo);
+    /// Payload is split into independently compressed blocks
+    bool isFramed() const;
+    void setFramed(bool framed);
     bool operator <(const ObjectInfo &) const;
 
     // Object type
@@ -27,10 +27,6 @@
 #include <memory>
 #include <stdexcept>
 
-#ifdef ORI_USE_LZMA
-#include <lzma.h>
-#endif /* ORI_USE_LZMA */
-
 #include "oriutil.h"
 #include "objecthash.h"
 #include "objectinfo.h"
@@ -126,6 +122,25 @@ private:
     size_t left;
 };
 
+/*
+ * Positional file stream.  Reads are done with pread so the file offset is
+ * never used, multiple pfdstreams may read from the same fd concurrently.
+ */
+class pfdstream : public bytestream
+{
+public:
+    pfdstream(int fd, off_t offset, size_t length=(size_t)-1);
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+
+private:
+    int fd;
+    off_t offset;
+    size_t length;
+    size_t left;
+};
+
 class diskstream : public bytestream
 {
 public:
@@ -144,13 +159,16 @@ private:
 #define COMPRESS true
 #define DECOMPRESS false
 
-#ifdef ORI_USE_LZMA
-
+/*
+ * Compresses or decompresses the whole source with the codec for algo (see
+ * zipcodec.h).  Reports an error if the codec is not part of this build.
+ */
 class zipstream : public bytestream
 {
 public:
     /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
+    zipstream(bytestream *source, ObjectInfo::ZipAlgo algo,
+              bool compress = false, size_t size_hint = 0);
     ~zipstream();
     bool ended();
     size_t read(uint8_t *, size_t);
@@ -159,45 +177,64 @@ public:
 
 private:
     bytestream *source;
+    ObjectInfo::ZipAlgo algo;
     size_t size_hint;
 
-    bool output_ended;
-    lzma_stream strm;
-    uint8_t in_buf[COMPFILE_BUFSZ];
+    bool compress;
+    bool input_processed;
+    std::string input; // TODO
+    std::string output;
 
-    void setLzmaErr(const char *msg, lzma_ret ret);
+    size_t offset;
+    bool output_ended;
 };
 
-#endif /* ORI_USE_LZMA */
-
-#ifdef ORI_USE_FASTLZ
-
-class zipstream : public bytestream
+/*
+ * Decompresses a framed payload (see ZipCodec_EncodeFramed) one block at a
+ * time, so memory use is bounded by one compressed and one decompressed
+ * block.  The fd constructor reads blocks with pread and supports seeking
+ * anywhere in the payload, the bytestream constructor only seeks forward.
+ */
+class framedstream : public bytestream
 {
 public:
-    /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
-    ~zipstream();
+    /// Takes ownership of source. size is the decompressed payload size
+    framedstream(bytestream *source, ObjectInfo::ZipAlgo algo, size_t size);
+    /// Payload stored at offset in fd and length bytes long
+    framedstream(int fd, off_t offset, size_t length,
+                 ObjectInfo::ZipAlgo algo, size_t size);
+    ~framedstream();
     bool ended();
     size_t read(uint8_t *, size_t);
+    /// Remaining bytes of output
     size_t sizeHint() const;
-    size_t inputConsumed() const;
+    /// Move to offset off of the decompressed payload
+    bool seek(size_t off);
 
 private:
     bytestream *source;
-    size_t size_hint;
-
-    bool compress;
-    bool input_processed;
-    std::string input; // TODO
-    std::vector<uint8_t> output;
-
-    size_t offset;
-    bool output_ended;
+    int fd;
+    off_t base;
+    size_t length;
+    ObjectInfo::ZipAlgo algo;
+    size_t size;
+
+    bool header_read;
+    uint32_t block_size;
+    std::vector<uint32_t> block_sizes;
+    std::vector<size_t> block_offsets;
+
+    size_t stored_pos;  // position in the stored payload
+    size_t pos;         // position in the decompressed payload
+    size_t curr_block;  // block held in output
+    std::string input;
+    std::string output;
+
+    bool readHeader();
+    bool readStored(uint8_t *buf, size_t n, size_t off);
+    bool loadBlock(size_t block);
 };
 
-#endif /* ORI_USE_FASTLZ */
-
 ////////////////////////////////
 // Writable streams
 
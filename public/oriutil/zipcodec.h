@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ZIPCODEC_H__
+#define __ZIPCODEC_H__
+
+#include <stdint.h>
+
+#include <string>
+
+#include "stream.h"
+#include "objectinfo.h"
+
+/*
+ * Compression codec for object payloads.
+ *
+ * Each codec corresponds to one ObjectInfo::ZipAlgo value stored in the
+ * object flags, so any build that includes the codec can read objects
+ * written with it.  Codecs are stateless and may be used from multiple
+ * threads.
+ */
+class ZipCodec
+{
+public:
+    virtual ~ZipCodec() { }
+    virtual ObjectInfo::ZipAlgo getAlgo() const = 0;
+    /// @returns false if the input could not be compressed
+    virtual bool compress(const char *buf, size_t len,
+                          std::string &out) const = 0;
+    /// @param size Expected size of the decompressed output
+    virtual bool decompress(const char *buf, size_t len, size_t size,
+                            std::string &out) const = 0;
+};
+
+/// @returns NULL for ZIPALGO_NONE or codecs not included in this build
+const ZipCodec *ZipCodec_Get(ObjectInfo::ZipAlgo algo);
+/// @returns ZIPALGO_UNKNOWN if name is not a known codec
+ObjectInfo::ZipAlgo ZipCodec_Lookup(const std::string &name);
+const char *ZipCodec_Name(ObjectInfo::ZipAlgo algo);
+
+/*
+ * Framed payloads are split into blocks that are compressed independently,
+ * so they can be decoded incrementally and read at any offset:
+ *
+ *   uint32 block size, uint32 number of blocks,
+ *   uint32 stored size of each block (ZIP_FRAME_RAWBLOCK if not compressed),
+ *   block data
+ *
+ * All integers are big endian.  Objects using it have ORI_FLAG_FRAMED set.
+ */
+#define ZIP_FRAME_RAWBLOCK      0x80000000
+#define ZIP_FRAME_HDRSIZE       8
+
+bool ZipCodec_EncodeFramed(const ZipCodec *codec, const char *buf, size_t len,
+                           size_t blockSize, std::string &out);
+
+/// Wraps the stored payload of info in a decompressing stream if needed.
+/// Takes ownership of stored.
+bytestream *ZipCodec_Decode(bytestream *stored, const ObjectInfo &info);
+
+#endif /* __ZIPCODEC_H__ */
+
@@ -0,0 +1,82 @@
+# Concurrent namespace operations on one mount
+WORKERS=8
+FILES=200
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+mkdir shared
+
+worker() {
+    mkdir -p w$1/sub
+    for i in $(seq 1 $FILES); do
+        echo "$1 $i" > w$1/f$i
+        echo "$i" > shared/w$1-f$i
+        mv w$1/f$i w$1/sub/g$i
+        stat w$1/sub/g$i > /dev/null
+        if [ $((i % 4)) -eq 0 ]; then
+            rm w$1/sub/g$i
+        fi
+    done
+}
+
+walker() {
+    while [ ! -f $TEMP_DIR/stress-done ]; do
+        find . > /dev/null
+        ls -lR > /dev/null
+    done
+}
+
+rm -f $TEMP_DIR/stress-done
+walker &
+WALKER=$!
+
+PIDS=""
+for w in $(seq 1 $WORKERS); do
+    worker $w &
+    PIDS="$PIDS $!"
+done
+for p in $PIDS; do
+    wait $p
+done
+
+touch $TEMP_DIR/stress-done
+wait $WALKER
+rm -f $TEMP_DIR/stress-done
+
+check() {
+    if [ $(ls shared | wc -l) -ne $((WORKERS * FILES)) ]; then
+        echo "Wrong number of files in shared"
+        exit 1
+    fi
+    for w in $(seq 1 $WORKERS); do
+        if [ $(ls w$w/sub | wc -l) -ne $((FILES - FILES / 4)) ]; then
+            echo "Wrong number of files in w$w/sub"
+            exit 1
+        fi
+        if [ "$(cat w$w/sub/g1)" != "$w 1" ]; then
+            echo "Wrong contents of w$w/sub/g1"
+            exit 1
+        fi
+    done
+}
+
+check
+
+# Unmounting commits, the remount loads directories from the snapshot
+cd $TEMP_DIR
+$UMOUNT $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+check
+
+cd $TEMP_DIR
+$UMOUNT $TEST_FS
+
+$ORI_EXE removefs $TEST_FS
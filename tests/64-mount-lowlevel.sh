@@ -0,0 +1,57 @@
+# Working tree and snapshots through the low-level frontend
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS -o lowlevel
+
+sleep 1
+
+cd $TEST_FS
+
+mkdir dir
+echo "hello" > dir/file1
+echo "file 2" > dir/file2
+mv dir/file2 dir/file3
+ln -s file1 dir/link
+chmod 600 dir/file1
+rm -f dir/missing
+
+if [ "$(cat dir/file3)" != "file 2" ]; then
+    echo "Wrong contents of dir/file3"
+    exit 1
+fi
+if [ "$(readlink dir/link)" != "file1" ]; then
+    echo "Wrong target of dir/link"
+    exit 1
+fi
+if [ "$(ls dir | tr '\n' ' ')" != "file1 file3 link " ]; then
+    echo "Wrong listing of dir"
+    exit 1
+fi
+
+$ORI_EXE snapshot snap1
+
+echo "changed" > dir/file1
+
+# Snapshots keep the old contents, repeated reads come from the page cache
+for i in 1 2 3; do
+    if [ "$(cat .snapshot/snap1/dir/file1)" != "hello" ]; then
+        echo "Wrong contents of snap1/dir/file1"
+        exit 1
+    fi
+done
+if [ -e .snapshot/snap1/dir/missing ]; then
+    echo "Missing file found in snap1"
+    exit 1
+fi
+if [ "$(ls .snapshot/snap1/dir | tr '\n' ' ')" != "file1 file3 link " ]; then
+    echo "Wrong listing of snap1/dir"
+    exit 1
+fi
+if [ "$(cat dir/file1)" != "changed" ]; then
+    echo "Wrong contents of dir/file1"
+    exit 1
+fi
+
+cd $TEMP_DIR
+$UMOUNT $TEST_FS
+
+$ORI_EXE removefs $TEST_FS